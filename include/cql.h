@@ -40,6 +40,15 @@
 #define CQL_ERROR_SSL_WRITE_WAITING   1000007
 #define CQL_ERROR_LIB_NO_STREAMS      1000008
 #define CQL_ERROR_LIB_MAX_CONNECTIONS 1000009
+#define CQL_ERROR_LIB_INVALID_STREAM  1000010
+#define CQL_ERROR_LIB_REQUEST_TIMEOUT 1000011
+#define CQL_ERROR_LIB_QUEUE_FULL      1000012
+#define CQL_ERROR_LIB_NO_HOSTS        1000013
+#define CQL_ERROR_LIB_SESSION_STATE   1000014
+#define CQL_ERROR_LIB_CONNECTION_CLOSED 1000015
+
+// error codes sent by the server
+#define CQL_SERVER_ERROR_PROTOCOL     0x000A
 
 #define CQL_OPCODE_ERROR        0x00
 #define CQL_OPCODE_STARTUP      0x01
@@ -96,10 +105,30 @@
 #define CQL_OPTION_CQL_VERSION                5
 #define CQL_OPTION_SCHEMA_AGREEMENT_WAIT      6
 #define CQL_OPTION_CONTROL_CONNECTION_TIMEOUT 7
+#define CQL_OPTION_PROTOCOL_VERSION           8
 
 #define CQL_OPTION_COMPRESSION                9
 #define CQL_OPTION_COMPRESSION_NONE           0
 #define CQL_OPTION_COMPRESSION_SNAPPY         1
 #define CQL_OPTION_COMPRESSION_LZ4            2
+#define CQL_OPTION_REQUEST_TIMEOUT            10
+#define CQL_OPTION_QUEUE_OVERFLOW             11
+#define CQL_OPTION_CORE_CONNECTIONS_PER_HOST  12
+#define CQL_OPTION_MAX_CONNECTIONS_PER_HOST   13
+#define CQL_OPTION_TOKEN_AWARE                14
+#define CQL_OPTION_REPLICATION_FACTOR         15
+#define CQL_OPTION_LOCAL_DATACENTER           16
+#define CQL_OPTION_USED_HOSTS_PER_REMOTE_DC   17
+#define CQL_OPTION_REMOTE_CORE_CONNECTIONS_PER_HOST 18
+#define CQL_OPTION_REMOTE_MAX_CONNECTIONS_PER_HOST  19
+#define CQL_OPTION_LATENCY_AWARE                    20
+// in percent of the fastest host's latency
+#define CQL_OPTION_LATENCY_EXCLUSION_THRESHOLD      21
+#define CQL_OPTION_LATENCY_RETRY_PERIOD             22
+// milliseconds before a copy of an idempotent request goes to another host
+#define CQL_OPTION_SPECULATIVE_EXECUTION_DELAY      23
+// in tenths of a percent, 990 waits for the host's 99th percentile
+#define CQL_OPTION_SPECULATIVE_EXECUTION_PERCENTILE 24
+#define CQL_OPTION_SPECULATIVE_EXECUTIONS_MAX       25
 
 #endif
@@ -17,9 +17,15 @@
 #ifndef __BODY_HPP_INCLUDED__
 #define __BODY_HPP_INCLUDED__
 
+#include <vector>
+
+#include "cql_frame_writer.hpp"
+#include "cql_object_pool.hpp"
+
 namespace cql {
 
-struct Body {
+struct Body
+    : public PoolAllocated {
   virtual ~Body()
   {}
 
@@ -36,6 +42,53 @@ struct Body {
       size_t  reserved,
       char**  output,
       size_t& size) = 0;
+
+  /**
+   * encode the body as segments, bodies which carry large caller owned
+   * values override this to avoid copying them. the default encodes into
+   * a contiguous buffer which is handed to the writer.
+   *
+   * @param writer
+   *
+   * @return
+   */
+  virtual bool
+  encode(
+      FrameWriter& writer) {
+    char*  output = NULL;
+    size_t size   = 0;
+    if (!prepare(0, &output, size)) {
+      return false;
+    }
+    writer.append_owned(output, size);
+    return true;
+  }
+
+  /**
+   * the serialized partition key the request is for, used to send it
+   * to a replica
+   *
+   * @param output appended to
+   *
+   * @return false if the body doesn't carry one
+   */
+  virtual bool
+  routing_key(
+      std::vector<char>& output) {
+    (void) output;
+    return false;
+  }
+
+  /**
+   * whether running the request twice does no harm, only such requests
+   * are sent to a second host while the first is still out
+   *
+   * @return
+   */
+  virtual bool
+  idempotent() {
+    return false;
+  }
 };
 }
 #endif
@@ -46,8 +46,8 @@ struct BodyOptions
       size_t  reserved,
       char**  output,
       size_t& size) {
-    *output = new char[size];
     size = reserved;
+    *output = new char[size];
     return true;
   }
 
@@ -17,6 +17,7 @@
 #ifndef __QUERY_HPP_INCLUDED__
 #define __QUERY_HPP_INCLUDED__
 
+#include <iterator>
 #include <list>
 #include <string>
 #include <utility>
@@ -45,6 +46,10 @@ class BodyQuery
   bool              serial_consistent_;
   int16_t           serial_consistency_;
   ValueCollection   values_;
+  // positions of the partition key components among the values
+  std::vector<int>  routing_indexes_;
+  std::vector<char> routing_key_;
+  bool              idempotent_;
 
  public:
   BodyQuery() :
@@ -52,7 +57,8 @@ class BodyQuery
       page_size_(0),
       page_size_set_(false),
       serial_consistent_(false),
-      serial_consistency_(CQL_CONSISTENCY_SERIAL)
+      serial_consistency_(CQL_CONSISTENCY_SERIAL),
+      idempotent_(false)
   {}
 
   uint8_t
@@ -101,6 +107,96 @@ class BodyQuery
     values_.push_back(std::make_pair(value, size));
   }
 
+  /**
+   * mark which bound values make up the partition key, in the order of
+   * the key's columns, so the query can be sent to a replica
+   *
+   * @param indexes
+   * @param count
+   */
+  void
+  routing_key_indexes(
+      const int* indexes,
+      size_t     count) {
+    routing_indexes_.assign(indexes, indexes + count);
+  }
+
+  /**
+   * set the serialized partition key directly, for queries with the key
+   * in the statement text. takes precedence over routing_key_indexes.
+   *
+   * @param key
+   * @param size
+   */
+  void
+  routing_key(
+      const char* key,
+      size_t      size) {
+    routing_key_.assign(key, key + size);
+  }
+
+  /**
+   * mark the query safe to run more than once, a read or a write of
+   * fixed values. lets the driver race a second host against a slow one.
+   *
+   * @param idempotent
+   */
+  void
+  idempotent(
+      bool idempotent) {
+    idempotent_ = idempotent;
+  }
+
+  bool
+  idempotent() {
+    return idempotent_;
+  }
+
+  /**
+   * a single component key is the value itself, a composite one is each
+   * component prefixed with its short length and followed by a zero
+   * byte, the way Cassandra serializes a CompositeType
+   *
+   * @param output
+   *
+   * @return
+   */
+  bool
+  routing_key(
+      std::vector<char>& output) {
+    if (!routing_key_.empty()) {
+      output.insert(output.end(), routing_key_.begin(), routing_key_.end());
+      return true;
+    }
+
+    if (routing_indexes_.empty()) {
+      return false;
+    }
+
+    for (std::vector<int>::const_iterator index = routing_indexes_.begin();
+         index != routing_indexes_.end();
+         ++index) {
+      if (*index < 0 || static_cast<size_t>(*index) >= values_.size()) {
+        output.clear();
+        return false;
+      }
+
+      ValueCollection::const_iterator value = values_.begin();
+      std::advance(value, *index);
+      if (routing_indexes_.size() == 1) {
+        output.insert(output.end(), value->first, value->first + value->second);
+        return true;
+      }
+
+      char length[sizeof(int16_t)];
+      encode_short(length, value->second);
+      output.insert(output.end(), length, length + sizeof(length));
+      output.insert(output.end(), value->first, value->first + value->second);
+      output.push_back(0);
+    }
+    return true;
+  }
+
   void
   consistency(
       int16_t consistency) {
@@ -200,6 +296,68 @@ class BodyQuery
     return true;
   }
 
+  /**
+   * same wire format as prepare, but bound values of
+   * CQL_FRAME_WRITER_REFERENCE_MIN bytes or more are written straight from
+   * the caller's memory, which must stay valid until the request completes
+   *
+   * @param writer
+   *
+   * @return
+   */
+  bool
+  encode(
+      FrameWriter& writer) {
+    uint8_t flags = 0x00;
+    if (!values_.empty()) {
+      flags |= CQL_QUERY_FLAG_VALUES;
+    }
+
+    if (page_size_set_) {
+      flags |= CQL_QUERY_FLAG_PAGE_SIZE;
+    }
+
+    if (!paging_state_.empty()) {
+      flags |= CQL_QUERY_FLAG_PAGING_STATE;
+    }
+
+    if (serial_consistent_) {
+      flags |= CQL_QUERY_FLAG_SERIAL_CONSISTENCY;
+    }
+
+    char* buffer = writer.reserve(
+        sizeof(int32_t) + query_.size() + sizeof(int16_t) + 1);
+    buffer = encode_long_string(buffer, query_.c_str(), query_.size());
+    buffer = encode_short(buffer, consistency_);
+    buffer = encode_byte(buffer, flags);
+
+    if (!values_.empty()) {
+      encode_short(writer.reserve(sizeof(int16_t)), values_.size());
+      for (ValueCollection::const_iterator it = values_.begin();
+           it != values_.end();
+           ++it) {
+        encode_int(writer.reserve(sizeof(int32_t)), it->second);
+        writer.append(it->first, it->second);
+      }
+    }
+
+    if (page_size_set_) {
+      encode_int(writer.reserve(sizeof(int32_t)), page_size_);
+    }
+
+    if (!paging_state_.empty()) {
+      encode_string(
+          writer.reserve(sizeof(int16_t) + paging_state_.size()),
+          &paging_state_[0],
+          paging_state_.size());
+    }
+
+    if (serial_consistent_) {
+      encode_short(writer.reserve(sizeof(int16_t)), serial_consistency_);
+    }
+    return true;
+  }
+
  private:
   BodyQuery(const BodyQuery&) {}
   void operator=(const BodyQuery&) {}
@@ -189,7 +189,8 @@ struct BodyResult
       no_metadata = true;
     } else {
       no_metadata = false;
-      column_metadata.resize(column_count);
+      column_metadata.clear();
+      column_metadata.reserve(column_count);
 
       for (int i = 0; i < column_count; ++i) {
         ColumnMetaData meta;
@@ -295,8 +296,11 @@ struct ResultIterator : Iterable {
       result(result),
       row_position(0),
       position(result->rows),
+      position_next(result->rows),
       row(result->column_count) {
-    position_next = parse_row(position, row);
+    if (result->row_count > 0) {
+      position_next = parse_row(position, row);
+    }
   }
 
   char*
@@ -309,6 +313,11 @@ struct ResultIterator : Iterable {
     for (int i = 0; i < result->column_count; ++i) {
       int32_t size  = 0;
       buffer        = decode_int(buffer, size);
+      if (size < 0) {
+        // null
+        output.push_back(std::make_pair(static_cast<char*>(NULL), 0));
+        continue;
+      }
       output.push_back(std::make_pair(buffer, size));
       buffer       += size;
     }
@@ -0,0 +1,411 @@
+/*
+  Copyright 2014 DataStax
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef __CQL_CALLBACK_EXECUTOR_HPP_INCLUDED__
+#define __CQL_CALLBACK_EXECUTOR_HPP_INCLUDED__
+
+#include <uv.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "cql_mpmc_queue.hpp"
+#include "cql_wait_strategy.hpp"
+
+// per callback thread, must be a power of two
+#define CQL_CALLBACK_QUEUE_SIZE 4096
+// most tasks a callback thread steals at once
+#define CQL_CALLBACK_BATCH      32
+// tasks an IO loop collects before handing them over
+#define CQL_CALLBACK_HANDOFF    64
+
+namespace cql {
+
+struct CallbackTask {
+  void (*run)(void*);
+  void*  data;
+};
+
+/**
+ * Runs user callbacks on a pool of driver owned threads, away from both
+ * the IO loops and the libuv threadpool which also does DNS resolution.
+ *
+ * Every thread has its own queue. Tasks are handed over in batches to one
+ * queue and a thread which runs out of work steals half of the deepest
+ * queue, so a slow callback only holds up the tasks behind it until a
+ * sibling steals them. Idle threads all park in one place; a submit wakes
+ * one of them, and a thread with more queued behind the task it's about
+ * to run wakes another.
+ *
+ * Callbacks never run on the submitting thread while the executor is
+ * up: tasks which don't fit in any queue wait in an overflow list the
+ * threads also take from.
+ */
+class CallbackExecutor {
+ public:
+  CallbackExecutor(
+      size_t thread_count) :
+      threads_(thread_count ? thread_count : 1, NULL),
+      next_(0),
+      stopping_(false),
+      submitting_(0),
+      overflow_size_(0),
+      closed_(false) {
+    for (size_t i = 0; i < threads_.size(); ++i) {
+      threads_[i] = new Thread(this);
+    }
+    for (size_t i = 0; i < threads_.size(); ++i) {
+      uv_thread_create(
+          &threads_[i]->thread,
+          &CallbackExecutor::run,
+          threads_[i]);
+    }
+  }
+
+  ~CallbackExecutor() {
+    shutdown();
+    for (size_t i = 0; i < threads_.size(); ++i) {
+      delete threads_[i];
+    }
+  }
+
+  /**
+   * queue tasks for the callback threads, they all go to the same queue.
+   * if every queue is full they go to the overflow list instead. only
+   * once shutdown has run everything left do tasks run on the calling
+   * thread, there's nobody else to run them.
+   *
+   * @param tasks
+   * @param count
+   */
+  void
+  submit(
+      const CallbackTask* tasks,
+      size_t              count) {
+    if (count == 0) {
+      return;
+    }
+
+    // sequentially consistent, pairs with shutdown: either this sees
+    // stopping_ or shutdown waits for it before the last drain
+    submitting_.fetch_add(1);
+    if (stopping_.load()) {
+      submitting_.fetch_sub(1);
+      overflow(tasks, count);
+      return;
+    }
+
+    size_t start = next_.fetch_add(1, std::memory_order_relaxed);
+    bool   queued = false;
+    for (size_t i = 0; i < threads_.size() && !queued; ++i) {
+      Thread* thread = threads_[(start + i) % threads_.size()];
+      queued = thread->queue.enqueue_bulk(tasks, count);
+    }
+    if (!queued) {
+      overflow(tasks, count);
+    }
+    submitting_.fetch_sub(1);
+    idle_.notify();
+  }
+
+  inline void
+  submit(
+      const CallbackTask& task) {
+    submit(&task, 1);
+  }
+
+  /**
+   * run whatever is still queued and stop the threads. tasks submitted
+   * while the threads wind down run on the calling thread once they're
+   * gone.
+   */
+  void
+  shutdown() {
+    if (stopping_.exchange(true)) {
+      return;
+    }
+    while (submitting_.load() != 0) {
+      std::this_thread::yield();
+    }
+    idle_.notify_all();
+    for (size_t i = 0; i < threads_.size(); ++i) {
+      uv_thread_join(&threads_[i]->thread);
+    }
+
+    CallbackTask task;
+    for (size_t i = 0; i < threads_.size(); ++i) {
+      while (threads_[i]->queue.dequeue(task)) {
+        task.run(task.data);
+      }
+    }
+
+    std::deque<CallbackTask> overflow;
+    {
+      std::lock_guard<std::mutex> lock(overflow_mutex_);
+      closed_ = true;
+      overflow.swap(overflow_);
+      overflow_size_.store(0, std::memory_order_release);
+    }
+    for (size_t i = 0; i < overflow.size(); ++i) {
+      overflow[i].run(overflow[i].data);
+    }
+  }
+
+  inline size_t
+  thread_count() {
+    return threads_.size();
+  }
+
+ private:
+  struct Thread {
+    CallbackExecutor*       executor;
+    uv_thread_t             thread;
+    MpmcQueue<CallbackTask> queue;
+    CallbackTask            stolen[CQL_CALLBACK_BATCH];
+
+    Thread(
+        CallbackExecutor* executor) :
+        executor(executor),
+        queue(CQL_CALLBACK_QUEUE_SIZE)
+    {}
+  };
+
+  struct Poll {
+    CallbackExecutor* executor;
+    Thread*           thread;
+    CallbackTask&     task;
+    bool&             found;
+
+    Poll(
+        CallbackExecutor* executor,
+        Thread*           thread,
+        CallbackTask&     task,
+        bool&             found) :
+        executor(executor),
+        thread(thread),
+        task(task),
+        found(found)
+    {}
+
+    inline bool
+    operator()() {
+      found = executor->take(thread, task);
+      return found || executor->stopping_.load(std::memory_order_acquire);
+    }
+  };
+
+  /**
+   * park tasks which didn't fit in any queue until a thread takes them,
+   * or run them right away once shutdown has drained everything
+   *
+   * @param tasks
+   * @param count
+   */
+  void
+  overflow(
+      const CallbackTask* tasks,
+      size_t              count) {
+    {
+      std::lock_guard<std::mutex> lock(overflow_mutex_);
+      if (!closed_) {
+        overflow_.insert(overflow_.end(), tasks, tasks + count);
+        overflow_size_.store(overflow_.size(), std::memory_order_release);
+        return;
+      }
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+      tasks[i].run(tasks[i].data);
+    }
+  }
+
+  /**
+   * next task from thread's own queue, or else steal up to half of the
+   * deepest sibling queue, or else take from the overflow list. stolen
+   * tasks go through the thief's queue, so they can be stolen again if
+   * the task ahead of them is slow.
+   *
+   * @param thread
+   * @param task
+   *
+   * @return
+   */
+  bool
+  take(
+      Thread*       thread,
+      CallbackTask& task) {
+    if (thread->queue.dequeue(task)) {
+      return true;
+    }
+
+    Thread* victim = NULL;
+    size_t  depth  = 0;
+    for (size_t i = 0; i < threads_.size(); ++i) {
+      size_t size = threads_[i]->queue.size_approx();
+      if (threads_[i] != thread && size > depth) {
+        victim = threads_[i];
+        depth  = size;
+      }
+    }
+
+    size_t count = 0;
+    if (victim) {
+      count = victim->queue.try_dequeue_up_to(
+          thread->stolen,
+          std::min<size_t>(CQL_CALLBACK_BATCH, (depth + 1) / 2));
+    }
+    if (count == 0) {
+      return take_overflow(thread, task);
+    }
+
+    task = thread->stolen[0];
+    for (size_t i = 1; i < count; ++i) {
+      if (!thread->queue.enqueue(thread->stolen[i])) {
+        thread->stolen[i].run(thread->stolen[i].data);
+      }
+    }
+    return true;
+  }
+
+  /**
+   * first task of the overflow list, and a batch more through thread's
+   * queue so siblings can steal them
+   *
+   * @param thread
+   * @param task
+   *
+   * @return
+   */
+  bool
+  take_overflow(
+      Thread*       thread,
+      CallbackTask& task) {
+    if (overflow_size_.load(std::memory_order_acquire) == 0) {
+      return false;
+    }
+
+    std::lock_guard<std::mutex> lock(overflow_mutex_);
+    if (overflow_.empty()) {
+      return false;
+    }
+    task = overflow_.front();
+    overflow_.pop_front();
+    for (size_t i = 0; i < CQL_CALLBACK_BATCH && !overflow_.empty(); ++i) {
+      if (!thread->queue.enqueue(overflow_.front())) {
+        break;
+      }
+      overflow_.pop_front();
+    }
+    overflow_size_.store(overflow_.size(), std::memory_order_release);
+    return true;
+  }
+
+  static void
+  run(
+      void* data) {
+    Thread*           thread   = reinterpret_cast<Thread*>(data);
+    CallbackExecutor* executor = thread->executor;
+
+    for (;;) {
+      CallbackTask task;
+      bool         found = false;
+      executor->idle_.wait(Poll(executor, thread, task, found));
+      if (!found) {
+        // stopping, and there's nothing left anywhere
+        return;
+      }
+
+      if (thread->queue.size_approx()) {
+        // more where that came from, get a sibling to help
+        executor->idle_.notify();
+      }
+      task.run(task.data);
+    }
+  }
+
+  std::vector<Thread*>     threads_;
+  std::atomic<size_t>      next_;
+  std::atomic<bool>        stopping_;
+  // threads inside submit, shutdown waits for them to leave
+  std::atomic<size_t>      submitting_;
+  ParkWaitStrategy         idle_;
+  // tasks which didn't fit in any queue, in submission order
+  std::mutex               overflow_mutex_;
+  std::deque<CallbackTask> overflow_;
+  std::atomic<size_t>      overflow_size_;
+  // shutdown ran what was left, later tasks run on the submitting thread
+  bool                     closed_;
+
+  CallbackExecutor(const CallbackExecutor&);
+  void operator=(const CallbackExecutor&);
+};
+
+/**
+ * Collects the callbacks one IO loop completes and hands them to the
+ * executor in one go, either once CQL_CALLBACK_HANDOFF have piled up or
+ * when the loop calls flush, once per iteration. Owned by the loop's
+ * thread.
+ */
+class CallbackBatch {
+ public:
+  CallbackBatch(
+      CallbackExecutor* executor) :
+      executor_(executor),
+      count_(0)
+  {}
+
+  ~CallbackBatch() {
+    flush();
+  }
+
+  inline void
+  add(
+      void (*run)(void*),
+      void*  data) {
+    tasks_[count_].run  = run;
+    tasks_[count_].data = data;
+    if (++count_ == CQL_CALLBACK_HANDOFF) {
+      flush();
+    }
+  }
+
+  inline void
+  flush() {
+    if (count_) {
+      executor_->submit(tasks_, count_);
+      count_ = 0;
+    }
+  }
+
+  inline size_t
+  size() {
+    return count_;
+  }
+
+ private:
+  CallbackExecutor* executor_;
+  CallbackTask      tasks_[CQL_CALLBACK_HANDOFF];
+  size_t            count_;
+
+  CallbackBatch(const CallbackBatch&);
+  void operator=(const CallbackBatch&);
+};
+}
+#endif
@@ -17,16 +17,32 @@
 #ifndef __CQL_CLIENT_CONNECTION_HPP_INCLUDED__
 #define __CQL_CLIENT_CONNECTION_HPP_INCLUDED__
 
+#include <limits>
+#include <vector>
+
+#include "cql_callback_executor.hpp"
 #include "cql_common.hpp"
+#include "cql_frame_writer.hpp"
+#include "cql_host.hpp"
 #include "cql_message.hpp"
+#include "cql_receive_buffer.hpp"
 #include "cql_request.hpp"
 #include "cql_session.hpp"
 #include "cql_ssl_context.hpp"
 #include "cql_ssl_session.hpp"
 #include "cql_stream_storage.hpp"
-
-#define CQL_ADDRESS_MAX_LENGTH 46
-#define CQL_STREAM_ID_MAX      127
+#include "cql_timing_wheel.hpp"
+
+#define CQL_ADDRESS_MAX_LENGTH     46
+#define CQL_STREAM_ID_MAX          127
+#define CQL_STREAM_ID_MAX_V3       32767
+#define CQL_WRITE_BATCH_MAX        64
+#define CQL_WRITE_BATCH_MAX_BYTES  65536
+// ms a partial batch may wait for more frames, 0 flushes every iteration
+#define CQL_WRITE_BATCH_DELAY      0
+// weight of a new sample in the latency average is 1 / 2^shift
+#define CQL_LATENCY_EWMA_SHIFT     3
+#define CQL_REQUEST_TIMEOUT        12000
 
 namespace cql {
 
@@ -54,11 +70,13 @@ struct ClientConnection {
     CLIENT_EVENT_SCHEMA_DROPPED
   };
 
-  typedef int8_t Stream;
+  typedef int16_t Stream;
 
   typedef std::function<void(ClientConnection*,
                              cql::Error*)> ConnectionCallback;
 
+  typedef std::function<void(ClientConnection*)> CloseCallback;
+
   typedef std::function<void(ClientConnection*,
                              const char*, size_t)> KeyspaceCallback;
 
@@ -75,20 +93,44 @@ struct ClientConnection {
   typedef cql::StreamStorage<
     Stream,
     CallerRequest*,
-    CQL_STREAM_ID_MAX> StreamStorageCollection;
-
-  struct WriteRequestData {
-    uv_buf_t buf;
-    ClientConnection* connection;
+    CQL_STREAM_ID_MAX_V3> StreamStorageCollection;
+
+  typedef std::vector<uv_buf_t> BufferCollection;
+
+  // a single vectored write of one or more frames, the scratch buffer
+  // and vectors keep their capacity as batches are recycled
+  struct WriteBatch {
+    uv_write_t         request;
+    ClientConnection*  connection;
+    BufferCollection   buffers;
+    std::vector<char*> owned;
+    std::vector<char>  scratch;
   };
 
   ClientConnectionState         state_;
   uv_loop_t*                    loop_;
+  ObjectPools*                  object_pools_;
+  TimingWheel*                  timing_wheel_;
+  // callbacks completed while handling a read go out together
+  CallbackBatch*                callback_batch_;
+  uint64_t                      request_timeout_;
+  // moving average of the response time in nanoseconds
+  uint64_t                      latency_;
+  // the host's average across connections, owned by the pool
+  HostLatency*                  host_latency_;
+  // requested frame compression, reset to none if the server or the
+  // build doesn't support it. read by new_message(), so it has to be
+  // initialized before incomming_
+  Compression                   compression_type_;
+  size_t                        compression_threshold_;
   std::unique_ptr<cql::Message> incomming_;
+  ReceiveBuffer                 receive_buffer_;
   StreamStorageCollection       stream_storage_;
   ConnectionCallback            connect_callback_;
   KeyspaceCallback              keyspace_callback_;
   PrepareCallback               prepare_callback_;
+  // the socket closed for good, whoever closed it
+  CloseCallback                 close_callback_;
   LogCallback                   log_callback_;
 
   // DNS and hostname stuff
@@ -99,10 +141,32 @@ struct ClientConnection {
   std::string              port_;
   uv_getaddrinfo_t         resolver_;
   struct addrinfo          resolver_hints_;
+  // a lookup is on its way, the connection can't be freed until it's back
+  bool                     resolving_;
 
   // the actual connection
   uv_connect_t             connect_request_;
   uv_tcp_t                 socket_;
+
+  // the version frames are sent with, lowered if the server rejects it
+  // during the handshake, in which case the connection is reopened
+  int                      protocol_version_;
+  bool                     reconnect_;
+  // stream of the OPTIONS probe while it waits on SUPPORTED, 0 if none
+  Stream                   options_stream_;
+
+  // outbound frames are queued and written once per loop iteration, or
+  // after at most write_batch_delay_ ms if a delay is set
+  uv_prepare_t             flush_handle_;
+  uv_timer_t               flush_timer_;
+  FrameSegmentCollection   outbound_;
+  std::vector<char>        outbound_scratch_;
+  size_t                   outbound_frames_;
+  size_t                   outbound_bytes_;
+  size_t                   write_batch_max_;
+  size_t                   write_batch_max_bytes_;
+  uint64_t                 write_batch_delay_;
+  std::vector<WriteBatch*> write_batch_free_;
   // ssl stuff
   SSLSession*              ssl_;
   bool                     ssl_handshake_done_;
@@ -111,27 +175,52 @@ struct ClientConnection {
   std::string              compression_;
   std::string              cql_version_;
 
-
   explicit
   ClientConnection(
-      uv_loop_t* loop,
-      cql::SSLSession* ssl_session) :
+      uv_loop_t*       loop,
+      cql::SSLSession* ssl_session,
+      ObjectPools*     object_pools = NULL,
+      TimingWheel*     timing_wheel = NULL,
+      CallbackBatch*   callback_batch = NULL) :
       state_(CLIENT_STATE_NEW),
       loop_(loop),
-      incomming_(new Message()),
+      object_pools_(object_pools),
+      timing_wheel_(timing_wheel),
+      callback_batch_(callback_batch),
+      request_timeout_(CQL_REQUEST_TIMEOUT),
+      latency_(0),
+      host_latency_(NULL),
+      compression_type_(CLIENT_COMPRESSION_NONE),
+      compression_threshold_(CQL_COMPRESSION_MIN_SIZE),
+      incomming_(new_message()),
       connect_callback_(nullptr),
       keyspace_callback_(nullptr),
       prepare_callback_(nullptr),
+      close_callback_(nullptr),
       log_callback_(nullptr),
       address_family_(PF_INET),         // use ipv4 by default
       hostname_("localhost"),
       port_("9042"),
+      resolving_(false),
+      protocol_version_(CQL_PROTOCOL_VERSION_MAX),
+      reconnect_(false),
+      options_stream_(0),
+      outbound_frames_(0),
+      outbound_bytes_(0),
+      write_batch_max_(CQL_WRITE_BATCH_MAX),
+      write_batch_max_bytes_(CQL_WRITE_BATCH_MAX_BYTES),
+      write_batch_delay_(CQL_WRITE_BATCH_DELAY),
       ssl_(ssl_session),
       ssl_handshake_done_(false),
       cql_version_("3.0.0") {
     resolver_.data = this;
     connect_request_.data = this;
     socket_.data = this;
+    flush_handle_.data = this;
+    flush_timer_.data = this;
+    uv_prepare_init(loop_, &flush_handle_);
+    uv_timer_init(loop_, &flush_timer_);
+    stream_storage_.max_streams(max_streams(protocol_version_));
 
     resolver_hints_.ai_family = address_family_;
     resolver_hints_.ai_socktype = SOCK_STREAM;
@@ -144,6 +233,50 @@ struct ClientConnection {
     }
   }
 
+  ~ClientConnection() {
+    discard_outbound();
+    // nobody would ever complete them, and the wheel outlives the
+    // connection so their timers have to come off it
+    fail_requests("connection closed");
+
+    for (std::vector<WriteBatch*>::iterator it = write_batch_free_.begin();
+         it != write_batch_free_.end();
+         ++it) {
+      delete *it;
+    }
+  }
+
+  /**
+   * complete every request still waiting on a response with
+   * CQL_ERROR_LIB_CONNECTION_CLOSED and give back all streams
+   *
+   * @param message
+   */
+  void
+  fail_requests(
+      const char* message) {
+    for (size_t id = 1; id <= stream_storage_.max_streams(); ++id) {
+      CallerRequest* request = NULL;
+      Stream         stream  = static_cast<Stream>(id);
+      if (!stream_storage_.in_use(stream)
+          || stream_storage_.get_stream(stream, request)
+          != CQL_ERROR_NO_ERROR
+          || !request) {
+        continue;
+      }
+
+      cancel_timeout(request);
+      request->error = new Error(
+          CQL_ERROR_SOURCE_LIBRARY,
+          CQL_ERROR_LIB_CONNECTION_CLOSED,
+          message,
+          __FILE__,
+          __LINE__);
+      request->notify(loop_);
+    }
+    options_stream_ = 0;
+  }
+
   inline void
   log(
       int         level,
@@ -163,11 +296,306 @@ struct ClientConnection {
     }
   }
 
+  inline Message*
+  new_message() {
+    Message* message = NULL;
+    if (object_pools_) {
+      message = new (object_pools_->message) Message(object_pools_->body);
+    } else {
+      message = new Message();
+    }
+    message->compression = compression_type_;
+    return message;
+  }
+
+  /**
+   * request frame compression, must be called before init. frames with
+   * bodies smaller than threshold are sent uncompressed.
+   *
+   * @param type
+   * @param threshold
+   */
+  void
+  compression(
+      Compression type,
+      size_t      threshold = CQL_COMPRESSION_MIN_SIZE) {
+    compression_type_      = type;
+    compression_threshold_ = threshold;
+    incomming_->compression = type;
+  }
+
+  /**
+   * the number of concurrent requests a protocol version allows
+   *
+   * @param version
+   *
+   * @return
+   */
+  inline static size_t
+  max_streams(
+      int version) {
+    return version >= CQL_PROTOCOL_VERSION_V3 ? CQL_STREAM_ID_MAX_V3
+                                              : CQL_STREAM_ID_MAX;
+  }
+
+  /**
+   * the highest protocol version to try, must be called before init. if
+   * the server doesn't support it the connection falls back to older
+   * versions down to CQL_PROTOCOL_VERSION_MIN.
+   *
+   * @param version
+   */
+  void
+  protocol_version(
+      int version) {
+    if (version < CQL_PROTOCOL_VERSION_MIN) {
+      version = CQL_PROTOCOL_VERSION_MIN;
+    } else if (version > CQL_PROTOCOL_VERSION_MAX) {
+      version = CQL_PROTOCOL_VERSION_MAX;
+    }
+    protocol_version_ = version;
+    stream_storage_.max_streams(max_streams(version));
+  }
+
+  inline int
+  protocol_version() {
+    return protocol_version_;
+  }
+
+  /**
+   * step down to the next older protocol version, only allowed before the
+   * connection is ready
+   *
+   * @return false if there is no older version to try
+   */
+  bool
+  downgrade_protocol() {
+    if (state_ >= CLIENT_STATE_READY
+        || protocol_version_ <= CQL_PROTOCOL_VERSION_MIN) {
+      return false;
+    }
+
+    char log_message[512];
+    snprintf(
+        log_message,
+        sizeof(log_message),
+        "protocol version %d rejected, retrying with %d",
+        protocol_version_,
+        protocol_version_ - 1);
+    log(CQL_LOG_INFO, log_message);
+
+    protocol_version(protocol_version_ - 1);
+    reconnect_ = true;
+    close();
+    return true;
+  }
+
+  /**
+   * the default time to wait for a response before failing a request with
+   * CQL_ERROR_LIB_REQUEST_TIMEOUT, 0 waits forever. requests can override
+   * it by setting their own timeout. only enforced when the connection has
+   * a timing wheel.
+   *
+   * @param timeout milliseconds
+   */
+  inline void
+  request_timeout(
+      uint64_t timeout) {
+    request_timeout_ = timeout;
+  }
+
+  /**
+   * also report response times to the host's average
+   *
+   * @param latency has to outlive the connection
+   */
+  inline void
+  host_latency(
+      HostLatency* latency) {
+    host_latency_ = latency;
+  }
+
+  /**
+   * called once the socket is closed and the requests on it failed,
+   * after close or when the server hung up. not called for a socket
+   * reopened after a protocol downgrade.
+   *
+   * @param callback
+   */
+  inline void
+  close_callback(
+      CloseCallback callback) {
+    close_callback_ = callback;
+  }
+
+  inline void
+  cancel_timeout(
+      CallerRequest* request) {
+    if (timing_wheel_) {
+      timing_wheel_->cancel(&request->timer);
+    }
+  }
+
+  /**
+   * a response for request arrived, stop its timer and fold its round
+   * trip into the latency average
+   *
+   * @param request
+   */
+  inline void
+  response_received(
+      CallerRequest* request) {
+    cancel_timeout(request);
+    record_latency(request);
+  }
+
+  void
+  record_latency(
+      CallerRequest* request) {
+    if (!request->start_time) {
+      return;
+    }
+
+    uint64_t now    = uv_hrtime();
+    uint64_t sample = now - request->start_time;
+    if (host_latency_) {
+      host_latency_->update(now, sample);
+    }
+
+    if (latency_ == 0) {
+      latency_ = sample;
+    } else {
+      int64_t delta = static_cast<int64_t>(sample)
+          - static_cast<int64_t>(latency_);
+      latency_ += delta / (1 << CQL_LATENCY_EWMA_SHIFT);
+    }
+  }
+
+  /**
+   * exponentially weighted moving average of the response time, timed
+   * out requests count with the time they waited
+   *
+   * @return nanoseconds, 0 until the first response
+   */
+  inline uint64_t
+  latency() {
+    return latency_;
+  }
+
+  /**
+   * streams currently waiting on a response, including ones held back
+   * for the late response to a timed out request
+   *
+   * @return
+   */
+  inline size_t
+  in_flight() {
+    return stream_storage_.max_streams()
+        - stream_storage_.available_streams();
+  }
+
+  static void
+  on_request_timeout(
+      TimerNode* timer) {
+    ClientConnection* connection
+        = reinterpret_cast<ClientConnection*>(timer->data);
+    connection->request_timed_out(static_cast<Stream>(timer->id));
+  }
+
+  /**
+   * fail the request waiting on stream. the id isn't released, a late
+   * response would otherwise be matched to whichever request gets the id
+   * next; it stays quarantined until that response arrives.
+   *
+   * @param stream
+   */
+  void
+  request_timed_out(
+      Stream stream) {
+    CallerRequest* request = NULL;
+    if (stream_storage_.get_stream(stream, request, false)
+        != CQL_ERROR_NO_ERROR || !request) {
+      return;
+    }
+    stream_storage_.update_stream(stream, NULL);
+    // a slow socket has to show up in the average even if it never answers
+    record_latency(request);
+
+    char log_message[512];
+    snprintf(
+        log_message,
+        sizeof(log_message),
+        "request on stream %d timed out",
+        stream);
+    log(CQL_LOG_INFO, log_message);
+
+    request->error = new Error(
+        CQL_ERROR_SOURCE_LIBRARY,
+        CQL_ERROR_LIB_REQUEST_TIMEOUT,
+        "request timed out",
+        __FILE__,
+        __LINE__);
+    request->notify(loop_);
+  }
+
+  /**
+   * a response arrived for a request which already timed out, its stream
+   * has been released by the lookup
+   *
+   * @param response
+   */
+  void
+  late_response(
+      Message* response) {
+    log(CQL_LOG_DEBUG, "dropping response to timed out request");
+    delete response;
+  }
+
+  inline CallerRequest*
+  new_request() {
+    CallerRequest* request = object_pools_
+        ? new (object_pools_->request) CallerRequest()
+        : new CallerRequest();
+    request->callback_batch = callback_batch_;
+    return request;
+  }
+
+  inline bool
+  is_ready() {
+    return state_ == CLIENT_STATE_READY;
+  }
+
   inline size_t
   available_streams() {
     return stream_storage_.available_streams();
   }
 
+  inline bool
+  is_closed() {
+    return state_ == CLIENT_STATE_DISCONNECTED;
+  }
+
+  /**
+   * requests still waiting on a response, unlike in_flight this doesn't
+   * count streams held for the late response to a timed out request.
+   * walks every stream, not for the request path.
+   *
+   * @return
+   */
+  size_t
+  waiting_requests() {
+    size_t count = 0;
+    for (size_t id = 1; id <= stream_storage_.max_streams(); ++id) {
+      CallerRequest* request = NULL;
+      Stream         stream  = static_cast<Stream>(id);
+      if (stream_storage_.in_use(stream)) {
+        stream_storage_.get_stream(stream, request, false);
+        count += request != NULL;
+      }
+    }
+    return count;
+  }
+
   void
   event_received() {
     log(CQL_LOG_DEBUG, "event received");
@@ -191,28 +619,41 @@ struct ClientConnection {
       case CLIENT_STATE_READY:
         notify_ready();
         break;
+      case CLIENT_STATE_DISCONNECTED:
+        break;
       default:
         assert(false);
     }
   }
 
+  /**
+   * consume the input stream, any frames wholly contained in input are
+   * decoded in place and will hold a reference to owner
+   *
+   * @param input
+   * @param size
+   * @param owner optional reference counted buffer containing input
+   */
   void
   consume(
-      char*  input,
-      size_t size) {
+      char*      input,
+      size_t     size,
+      RefBuffer* owner = NULL) {
     char* buffer    = input;
     int   remaining = size;
 
     while (remaining != 0) {
-      int consumed = incomming_->consume(buffer, remaining);
+      int consumed = incomming_->consume(buffer, remaining, owner);
       if (consumed < 0) {
         // TODO(mstump)
         fprintf(stderr, "consume error\n");
       }
 
       if (incomming_->body_ready) {
+        receive_buffer_.observe_frame(
+            Message::header_size(incomming_->version) + incomming_->length);
         Message* message = incomming_.release();
-        incomming_.reset(new Message());
+        incomming_.reset(new_message());
 
         char log_message[512];
         snprintf(
@@ -261,10 +702,38 @@ struct ClientConnection {
         = reinterpret_cast<ClientConnection*>(client->data);
 
     connection->log(CQL_LOG_DEBUG, "on_close");
-    connection->state_ = CLIENT_STATE_DISCONNECTED;
+    if (connection->reconnect_) {
+      // the address is still good, start over from the TCP connect
+      connection->reconnect_          = false;
+      connection->ssl_handshake_done_ = false;
+      connection->discard_outbound();
+      connection->incomming_.reset(connection->new_message());
+      if (connection->ssl_) {
+        connection->ssl_->init();
+        connection->ssl_->handshake(true);
+      }
+      connection->state_ = CLIENT_STATE_RESOLVED;
+    } else {
+      connection->state_ = CLIENT_STATE_DISCONNECTED;
+      // no response can arrive anymore
+      connection->fail_requests("connection closed");
+      if (connection->close_callback_) {
+        connection->close_callback_(connection);
+      }
+    }
     connection->event_received();
   }
 
+  static uv_buf_t
+  on_alloc(
+      uv_handle_t* client,
+      size_t       suggested_size) {
+    (void) suggested_size;
+    ClientConnection* connection =
+        reinterpret_cast<ClientConnection*>(client->data);
+    return connection->receive_buffer_.allocate();
+  }
+
   static void
   on_read(
       uv_stream_t* client,
@@ -279,11 +748,22 @@ struct ClientConnection {
         fprintf(stderr,
                 "Read error %s\n",
                 uv_err_name(uv_last_error(connection->loop_)));
+      } else if (connection->state_ == CLIENT_STATE_HANDSHAKE) {
+        // some servers hang up on a version they don't understand
+        // instead of answering with an error. the OPTIONS probe will
+        // never be answered, give its stream back before starting over
+        connection->release_options_stream();
+        if (connection->downgrade_protocol()) {
+          return;
+        }
       }
       connection->close();
       return;
     }
 
+    // buf belongs to the receive buffer, don't free it
+    RefBuffer* input = connection->receive_buffer_.commit(nread);
+
     if (connection->ssl_) {
       char*  read_input        = buf.base;
       size_t read_input_size   = nread;
@@ -309,8 +789,9 @@ struct ClientConnection {
 
         if (read_output && read_output_size) {
           // TODO(mstump) error handling
-          connection->consume(read_output, read_output_size);
-          delete read_output;
+          RefBuffer* decrypted = new RefBuffer(read_output, read_output_size);
+          connection->consume(read_output, read_output_size, decrypted);
+          decrypted->release();
         }
 
         if (write_output && write_output_size) {
@@ -333,9 +814,20 @@ struct ClientConnection {
         }
       }
     } else {
-      connection->consume(buf.base, nread);
+      // complete frames will be decoded in place and keep the read
+      // block alive until the resulting messages are deleted
+      connection->consume(buf.base, nread, input);
+    }
+
+    if (connection->in_flight() == 0
+        && connection->incomming_->received == 0) {
+      connection->receive_buffer_.shrink();
+    }
+
+    // one handoff to the callback threads for every response in the read
+    if (connection->callback_batch_) {
+      connection->callback_batch_->flush();
     }
-    free_buffer(buf);
   }
 
   Error*
@@ -345,27 +837,203 @@ struct ClientConnection {
     return send_data(uv_buf_init(input, size));
   }
 
+  /**
+   * queue a buffer for writing, ownership of buf.base passes to the
+   * connection. queued frames are flushed as a single vectored write
+   * before the loop next blocks, or write_batch_delay_ ms after the first
+   * of them was queued if a delay is set, or straight away once the batch
+   * reaches write_batch_max_ frames or write_batch_max_bytes_.
+   *
+   * @param buf
+   *
+   * @return
+   */
   Error*
   send_data(
       uv_buf_t buf) {
-    uv_write_t        *req  = new uv_write_t;
-    WriteRequestData*  data = new WriteRequestData;
-    data->buf               = buf;
-    data->connection        = this;
-    req->data               = data;
-    uv_write(
-        req,
+    FrameWriter writer(outbound_scratch_, outbound_);
+    writer.append_owned(buf.base, buf.len);
+    queued(writer.size());
+    return CQL_ERROR_NO_ERROR;
+  }
+
+  /**
+   * account for a frame appended to the outbound queue, flushing if the
+   * batch is full
+   *
+   * @param size
+   */
+  void
+  queued(
+      size_t size) {
+    if (outbound_frames_++ == 0) {
+      if (write_batch_delay_) {
+        uv_timer_start(
+            &flush_timer_,
+            ClientConnection::on_flush_timer,
+            write_batch_delay_,
+            0);
+      } else {
+        uv_prepare_start(&flush_handle_, ClientConnection::on_flush);
+      }
+    }
+    outbound_bytes_ += size;
+
+    if (outbound_frames_ >= write_batch_max_
+        || outbound_bytes_ >= write_batch_max_bytes_) {
+      flush();
+    }
+  }
+
+  /**
+   * set the limits at which queued writes are flushed without waiting for
+   * the end of the loop iteration
+   *
+   * @param max_buffers frames per write, 1 disables coalescing
+   * @param max_bytes
+   * @param max_delay ms a partial batch may wait for more frames across
+   * loop iterations, 0 flushes it before the loop next blocks
+   */
+  void
+  write_batching(
+      size_t   max_buffers,
+      size_t   max_bytes,
+      uint64_t max_delay = CQL_WRITE_BATCH_DELAY) {
+    write_batch_max_       = max_buffers ? max_buffers : 1;
+    write_batch_max_bytes_ = max_bytes;
+    write_batch_delay_     = max_delay;
+  }
+
+  static void
+  on_flush(
+      uv_prepare_t* handle,
+      int           status) {
+    (void) status;
+    ClientConnection* connection
+        = reinterpret_cast<ClientConnection*>(handle->data);
+    connection->flush();
+  }
+
+  static void
+  on_flush_timer(
+      uv_timer_t* handle,
+      int         status) {
+    (void) status;
+    ClientConnection* connection
+        = reinterpret_cast<ClientConnection*>(handle->data);
+    connection->flush();
+  }
+
+  void
+  flush() {
+    uv_prepare_stop(&flush_handle_);
+    uv_timer_stop(&flush_timer_);
+    if (outbound_.empty()) {
+      return;
+    }
+
+    WriteBatch* batch = NULL;
+    if (write_batch_free_.empty()) {
+      batch             = new WriteBatch;
+      batch->connection = this;
+    } else {
+      batch = write_batch_free_.back();
+      write_batch_free_.pop_back();
+    }
+    batch->request.data = batch;
+    batch->scratch.swap(outbound_scratch_);
+    FrameWriter::resolve(
+        batch->scratch,
+        outbound_,
+        batch->buffers,
+        batch->owned);
+    outbound_.clear();
+    outbound_scratch_.clear();
+    outbound_frames_ = 0;
+    outbound_bytes_  = 0;
+
+    char log_message[512];
+    snprintf(
+        log_message,
+        sizeof(log_message),
+        "flushing %zd buffers in one write",
+        batch->buffers.size());
+    log(CQL_LOG_DEBUG, log_message);
+
+    int err = uv_write(
+        &batch->request,
         reinterpret_cast<uv_stream_t*>(&socket_),
-        &buf,
-        1,
+        &batch->buffers[0],
+        batch->buffers.size(),
         ClientConnection::on_write);
-    return CQL_ERROR_NO_ERROR;
+
+    if (err) {
+      fprintf(
+          stderr,
+          "Write error %s\n",
+          uv_err_name(uv_last_error(loop_)));
+      release_write_batch(batch);
+    }
+  }
+
+  void
+  release_write_batch(
+      WriteBatch* batch) {
+    for (std::vector<char*>::iterator it = batch->owned.begin();
+         it != batch->owned.end();
+         ++it) {
+      delete[] *it;
+    }
+    batch->owned.clear();
+    batch->buffers.clear();
+    write_batch_free_.push_back(batch);
+  }
+
+  /**
+   * free frames which were queued but never written
+   */
+  void
+  discard_outbound() {
+    for (FrameSegmentCollection::iterator it = outbound_.begin();
+         it != outbound_.end();
+         ++it) {
+      if (it->owned) {
+        delete[] it->base;
+      }
+    }
+    outbound_.clear();
+    outbound_scratch_.clear();
+    outbound_frames_ = 0;
+    outbound_bytes_  = 0;
   }
 
   void
   close() {
+    if (state_ == CLIENT_STATE_DISCONNECTING
+        || state_ == CLIENT_STATE_DISCONNECTED) {
+      return;
+    }
+
+    if (state_ == CLIENT_STATE_NEW) {
+      // never got as far as opening a socket, on_resolve finishes the
+      // close if a lookup is still running
+      uv_close(reinterpret_cast<uv_handle_t*>(&flush_handle_), NULL);
+      uv_close(reinterpret_cast<uv_handle_t*>(&flush_timer_), NULL);
+      state_ = resolving_ ? CLIENT_STATE_DISCONNECTING
+                          : CLIENT_STATE_DISCONNECTED;
+      return;
+    }
+
     log(CQL_LOG_DEBUG, "close");
     state_ = CLIENT_STATE_DISCONNECTING;
+    if (reconnect_) {
+      // the flush handles are reused by the new socket
+      uv_prepare_stop(&flush_handle_);
+      uv_timer_stop(&flush_timer_);
+    } else {
+      uv_close(reinterpret_cast<uv_handle_t*>(&flush_handle_), NULL);
+      uv_close(reinterpret_cast<uv_handle_t*>(&flush_timer_), NULL);
+    }
     uv_close(
         reinterpret_cast<uv_handle_t*>(&socket_),
         ClientConnection::on_close);
@@ -380,17 +1048,19 @@ struct ClientConnection {
 
     connection->log(CQL_LOG_DEBUG, "on_connect");
     if (status == -1) {
-      // TODO(mstump)
-      fprintf(
-          stderr,
-          "connect failed error %s\n",
-          uv_err_name(uv_last_error(connection->loop_)));
+      connection->notify_error(
+          new Error(
+              CQL_ERROR_SOURCE_NETWORK,
+              uv_last_error(connection->loop_).code,
+              uv_err_name(uv_last_error(connection->loop_)),
+              __FILE__,
+              __LINE__));
       return;
     }
 
     uv_read_start(
         reinterpret_cast<uv_stream_t*>(&connection->socket_),
-        alloc_buffer,
+        ClientConnection::on_alloc,
         on_read);
 
     connection->state_ = CLIENT_STATE_CONNECTED;
@@ -417,7 +1087,7 @@ struct ClientConnection {
       on_read(
           reinterpret_cast<uv_stream_t*>(&socket_),
           0,
-          alloc_buffer(0));
+          receive_buffer_.allocate());
     } else {
       state_ = CLIENT_STATE_HANDSHAKE;
       event_received();
@@ -438,10 +1108,32 @@ struct ClientConnection {
         if (keyspace_callback_) {
           keyspace_callback_(this, result->keyspace, result->keyspace_size);
         }
+
+        // USE from set_keyspace has nobody waiting on it
+        err = stream_error(
+            stream_storage_.get_stream(response->stream, request));
+        if (!err && request) {
+          response_received(request);
+          request->result = response;
+          request->notify(loop_);
+        } else {
+          delete err;
+          delete response;
+        }
         break;
 
       case CQL_RESULT_KIND_PREPARED:
-        err = stream_storage_.get_stream(response->stream, request);
+        err = stream_error(
+            stream_storage_.get_stream(response->stream, request));
+        if (!err && !request) {
+          late_response(response);
+          break;
+        }
+
+        if (!err) {
+          response_received(request);
+        }
+
         if (prepare_callback_) {
           if (!err) {
             prepare_callback_(
@@ -471,8 +1163,12 @@ struct ClientConnection {
         break;
 
       default:
-        err = stream_storage_.get_stream(response->stream, request);
-        if (!err) {
+        err = stream_error(
+            stream_storage_.get_stream(response->stream, request));
+        if (!err && !request) {
+          late_response(response);
+        } else if (!err) {
+          response_received(request);
           request->result = response;
           request->notify(loop_);
         } else {
@@ -488,7 +1184,34 @@ struct ClientConnection {
   on_error(
       Message* response) {
     log(CQL_LOG_DEBUG, "on_error");
-    BodyError* error = static_cast<BodyError*>(response->body.get());
+    BodyError*     error   = static_cast<BodyError*>(response->body.get());
+    CallerRequest* request = NULL;
+    if (stream_storage_.get_stream(response->stream, request)) {
+      request = NULL;
+    }
+    if (response->stream == options_stream_) {
+      options_stream_ = 0;
+    }
+
+    if (state_ < CLIENT_STATE_READY
+        && error->code == CQL_SERVER_ERROR_PROTOCOL
+        && downgrade_protocol()) {
+      delete response;
+      return;
+    }
+
+    if (request) {
+      response_received(request);
+      request->error = new Error(
+          CQL_ERROR_SOURCE_SERVER,
+          error->code,
+          std::string(error->message, error->message_size),
+          __FILE__,
+          __LINE__);
+      request->result = response;
+      request->notify(loop_);
+      return;
+    }
 
     if (state_ < CLIENT_STATE_READY) {
       notify_error(
@@ -506,6 +1229,7 @@ struct ClientConnection {
   on_ready(
       Message* response) {
     log(CQL_LOG_DEBUG, "on_ready");
+    release_stream(response);
     delete response;
     state_ = CLIENT_STATE_READY;
     event_received();
@@ -518,14 +1242,62 @@ struct ClientConnection {
     BodySupported* supported
         = static_cast<BodySupported*>(response->body.get());
 
-    // TODO(mstump) do something with the supported info
-    (void) supported;
+    if (compression_type_ != CLIENT_COMPRESSION_NONE) {
+      const char* name = compression_name(compression_type_);
+      bool        offered = std::find(
+          supported->compression.begin(),
+          supported->compression.end(),
+          name) != supported->compression.end();
+
+      if (offered && compression_available(compression_type_)) {
+        compression_ = name;
+      } else {
+        log(CQL_LOG_INFO, "requested compression unavailable, disabling");
+        compression(CLIENT_COMPRESSION_NONE, compression_threshold_);
+      }
+    }
 
+    options_stream_ = 0;
+    release_stream(response);
     delete response;
     state_ = CLIENT_STATE_SUPPORTED;
     event_received();
   }
 
+  /**
+   * give back the stream of a response nobody is waiting on
+   *
+   * @param response
+   */
+  inline void
+  release_stream(
+      Message* response) {
+    CallerRequest* request = NULL;
+    stream_storage_.get_stream(response->stream, request);
+  }
+
+  /**
+   * turn a StreamStorage result code into an Error for the caller
+   *
+   * @param code
+   *
+   * @return NULL if code is CQL_ERROR_NO_ERROR
+   */
+  static Error*
+  stream_error(
+      int code) {
+    if (code == CQL_ERROR_NO_ERROR) {
+      return CQL_ERROR_NO_ERROR;
+    }
+    return new Error(
+        CQL_ERROR_SOURCE_LIBRARY,
+        code,
+        code == CQL_ERROR_LIB_NO_STREAMS ? "no available streams"
+                                         : "invalid stream id",
+        __FILE__,
+        __LINE__);
+  }
+
   void
   set_keyspace(
       const std::string& keyspace) {
@@ -556,7 +1328,18 @@ struct ClientConnection {
   send_options() {
     log(CQL_LOG_DEBUG, "send_options");
     Message message(CQL_OPCODE_OPTIONS);
-    send_message(&message, NULL);
+    if (send_message(&message, NULL) == CQL_ERROR_NO_ERROR) {
+      options_stream_ = message.stream;
+    }
+  }
+
+  void
+  release_options_stream() {
+    if (options_stream_) {
+      CallerRequest* request = NULL;
+      stream_storage_.get_stream(options_stream_, request);
+      options_stream_ = 0;
+    }
   }
 
   void
@@ -565,6 +1348,7 @@ struct ClientConnection {
     Message      message(CQL_OPCODE_STARTUP);
     BodyStartup* startup = static_cast<BodyStartup*>(message.body.get());
     startup->cql_version = cql_version_;
+    startup->compression = compression_;
     send_message(&message, NULL);
   }
 
@@ -572,10 +1356,9 @@ struct ClientConnection {
   on_write(
       uv_write_t* req,
       int         status) {
-    WriteRequestData* data
-        = reinterpret_cast<WriteRequestData*>(req->data);
+    WriteBatch*       batch      = reinterpret_cast<WriteBatch*>(req->data);
+    ClientConnection* connection = batch->connection;
 
-    ClientConnection* connection = data->connection;
     connection->log(CQL_LOG_DEBUG, "on_write");
     if (status == -1) {
       fprintf(
@@ -583,9 +1366,7 @@ struct ClientConnection {
           "Write error %s\n",
           uv_err_name(uv_last_error(connection->loop_)));
     }
-    delete data->buf.base;
-    delete data;
-    delete req;
+    connection->release_write_batch(batch);
   }
 
   CallerRequest*
@@ -593,7 +1374,7 @@ struct ClientConnection {
       const char*             statement,
       size_t                  size,
       CallerRequest::Callback callback = NULL) {
-    CallerRequest* request = new CallerRequest();
+    CallerRequest* request = new_request();
     Message*       message = new Message(CQL_OPCODE_PREPARE);
     BodyPrepare*   prepare = static_cast<BodyPrepare*>(message->body.get());
     prepare->prepare_string(statement, size);
@@ -613,7 +1394,7 @@ struct ClientConnection {
   exec(
       Message*                message,
       CallerRequest::Callback callback = NULL) {
-    CallerRequest* request = new CallerRequest();
+    CallerRequest* request = new_request();
     request->callback = callback;
     Error* err = send_message(message, request);
     if (err) {
@@ -623,16 +1404,59 @@ struct ClientConnection {
     return request;
   }
 
+  /**
+   * assign a stream and queue the message for writing. large values bound
+   * to the message are written from the caller's memory, which must stay
+   * valid until the request completes, unless the message copies its
+   * values; the message itself can be deleted as soon as this returns.
+   *
+   * @param message
+   * @param request
+   *
+   * @return
+   */
   Error*
   send_message(
       Message* message,
       CallerRequest* request = NULL) {
-    uv_buf_t   buf;
-    Error*     err = stream_storage_.set_stream(request, message->stream);
-    if (err) {
-      return err;
+    int code = stream_storage_.set_stream(request, message->stream);
+    if (code != CQL_ERROR_NO_ERROR) {
+      return stream_error(code);
+    }
+    message->version = protocol_version_;
+
+    if (request && !request->callback_batch) {
+      request->callback_batch = callback_batch_;
+    }
+
+    if (request) {
+      request->start_time = uv_hrtime();
+    }
+
+    if (request && timing_wheel_) {
+      uint64_t timeout = request->timeout ? request->timeout
+                                          : request_timeout_;
+      if (timeout) {
+        request->timer.data = this;
+        request->timer.id   = message->stream;
+        timing_wheel_->schedule(
+            &request->timer,
+            timeout,
+            ClientConnection::on_request_timeout);
+      }
     }
-    message->prepare(&buf.base, buf.len);
+
+    // STARTUP and everything before it must go out uncompressed
+    FrameWriter writer(
+        outbound_scratch_,
+        outbound_,
+        message->copy_values ? std::numeric_limits<size_t>::max()
+                             : CQL_FRAME_WRITER_REFERENCE_MIN);
+    message->prepare(
+        writer,
+        state_ == CLIENT_STATE_READY ? compression_type_
+                                     : CLIENT_COMPRESSION_NONE,
+        compression_threshold_);
 
     char log_message[512];
     snprintf(
@@ -641,12 +1465,14 @@ struct ClientConnection {
         "sending message type %s with stream %d, size %zd",
         opcode_to_string(message->opcode).c_str(),
         message->stream,
-        buf.len);
+        writer.size());
 
     log(CQL_LOG_DEBUG, log_message);
-    return send_data(buf);
+    queued(writer.size());
+    return CQL_ERROR_NO_ERROR;
   }
 
+
   static void
   on_resolve(
       uv_getaddrinfo_t* resolver_,
@@ -656,12 +1482,25 @@ struct ClientConnection {
         = reinterpret_cast<ClientConnection*>(resolver_->data);
 
     connection->log(CQL_LOG_DEBUG, "on_resolve");
+    connection->resolving_ = false;
+    if (connection->state_ == CLIENT_STATE_DISCONNECTING) {
+      // closed while the lookup ran
+      if (status != -1) {
+        uv_freeaddrinfo(res);
+      }
+      connection->state_ = CLIENT_STATE_DISCONNECTED;
+      connection->fail_requests("connection closed");
+      return;
+    }
+
     if (status == -1) {
-      // TODO(mstump)
-      fprintf(
-          stderr,
-          "getaddrinfo request error %s\n",
-          uv_err_name(uv_last_error(connection->loop_)));
+      connection->notify_error(
+          new Error(
+              CQL_ERROR_SOURCE_NETWORK,
+              uv_last_error(connection->loop_).code,
+              uv_err_name(uv_last_error(connection->loop_)),
+              __FILE__,
+              __LINE__));
       return;
     }
 
@@ -685,6 +1524,7 @@ struct ClientConnection {
   void
   resolve() {
     log(CQL_LOG_DEBUG, "resolve");
+    resolving_ = true;
     uv_getaddrinfo(
         loop_,
         &resolver_,
@@ -28,11 +28,33 @@ class Cluster {
   std::string            port_;
   std::string            cql_version_;
   int                    compression_;
+  int                    protocol_version_;
+  uint64_t               request_timeout_;
   size_t                 max_schema_agreement_wait_;
   size_t                 control_connection_timeout_;
   std::list<std::string> contact_points_;
   size_t                 thread_count_io_;
   size_t                 thread_count_callback_;
+  bool                   queue_overflow_;
+  size_t                 core_connections_per_host_;
+  size_t                 max_connections_per_host_;
+  size_t                 remote_core_connections_per_host_;
+  size_t                 remote_max_connections_per_host_;
+  // empty to use the datacenter of the first node reached
+  std::string            local_datacenter_;
+  size_t                 used_hosts_per_remote_dc_;
+  bool                   token_aware_;
+  bool                   latency_aware_;
+  // percent of the fastest host's latency
+  size_t                 latency_exclusion_threshold_;
+  // milliseconds
+  uint64_t               latency_retry_period_;
+  // milliseconds, 0 for none
+  uint64_t               speculative_execution_delay_;
+  // tenths of a percent, 0 for a fixed delay
+  size_t                 speculative_execution_percentile_;
+  size_t                 speculative_executions_max_;
+  size_t                 replication_factor_;
   LogCallback            log_callback_;
 
 
@@ -41,10 +63,27 @@ class Cluster {
       port_("9042"),
       cql_version_("3.0.0"),
       compression_(0),
+      protocol_version_(CQL_PROTOCOL_VERSION_MAX),
+      request_timeout_(CQL_REQUEST_TIMEOUT),
       max_schema_agreement_wait_(10),
       control_connection_timeout_(10),
       thread_count_io_(1),
       thread_count_callback_(4),
+      queue_overflow_(false),
+      core_connections_per_host_(1),
+      max_connections_per_host_(2),
+      remote_core_connections_per_host_(1),
+      remote_max_connections_per_host_(1),
+      used_hosts_per_remote_dc_(0),
+      token_aware_(true),
+      latency_aware_(true),
+      latency_exclusion_threshold_(
+          CQL_LATENCY_AWARE_EXCLUSION_THRESHOLD * 100),
+      latency_retry_period_(CQL_LATENCY_AWARE_RETRY_PERIOD),
+      speculative_execution_delay_(0),
+      speculative_execution_percentile_(0),
+      speculative_executions_max_(1),
+      replication_factor_(CQL_METADATA_REPLICATION_FACTOR),
       log_callback_(nullptr)
   {}
 
@@ -69,8 +108,82 @@ class Cluster {
   connect(
       const char* keyspace,
       size_t      size) {
-    (void) keyspace;
-    (void) size;
+    PoolOptions options;
+    options.port                      = port_;
+    options.cql_version               = cql_version_;
+    options.compression               = compression_;
+    options.protocol_version          = protocol_version_;
+    options.request_timeout           = request_timeout_;
+    options.core_connections_per_host = core_connections_per_host_;
+    options.max_connections_per_host  = max_connections_per_host_;
+    options.remote_core_connections_per_host
+        = remote_core_connections_per_host_;
+    options.remote_max_connections_per_host
+        = remote_max_connections_per_host_;
+    if (keyspace) {
+      options.keyspace.assign(keyspace, size);
+    }
+
+    cql::Session* session = new cql::Session(
+        thread_count_io_,
+        thread_count_callback_,
+        queue_overflow_);
+    session->log_callback_ = log_callback_;
+    // the option is in seconds
+    session->control_connection_timeout_ = control_connection_timeout_ * 1000;
+    session->metadata(new Metadata(replication_factor_));
+    delete session->policy_;
+    session->policy_ = load_balancing_policy();
+    session->speculative_policy_ = speculative_execution_policy();
+    session->init(contact_points_, options);
+    return session;
+  }
+
+  /**
+   * the policy a new session routes requests with, owned by the session
+   *
+   * @return
+   */
+  LoadBalancingPolicy*
+  load_balancing_policy() {
+    LoadBalancingPolicy* policy = new DCAwareRoundRobinPolicy(
+        local_datacenter_,
+        used_hosts_per_remote_dc_);
+    if (token_aware_) {
+      policy = new TokenAwarePolicy(policy);
+    }
+    if (latency_aware_) {
+      policy = new LatencyAwarePolicy(
+          policy,
+          latency_exclusion_threshold_ / 100.0,
+          latency_retry_period_);
+    }
+    return policy;
+  }
+
+  /**
+   * the policy a new session races copies of idempotent requests with,
+   * owned by the session
+   *
+   * @return NULL if neither a delay nor a percentile is set
+   */
+  SpeculativeExecutionPolicy*
+  speculative_execution_policy() {
+    if (speculative_executions_max_ == 0) {
+      return NULL;
+    }
+
+    if (speculative_execution_percentile_) {
+      return new PercentileSpeculativeExecutionPolicy(
+          speculative_execution_percentile_ / 1000.0,
+          speculative_executions_max_);
+    }
+
+    if (speculative_execution_delay_) {
+      return new ConstantSpeculativeExecutionPolicy(
+          speculative_execution_delay_,
+          speculative_executions_max_);
+    }
     return NULL;
   }
 
@@ -107,6 +220,74 @@ class Cluster {
         compression_ = int_value;
         break;
 
+      case CQL_OPTION_PROTOCOL_VERSION:
+        protocol_version_ = int_value;
+        break;
+
+      case CQL_OPTION_QUEUE_OVERFLOW:
+        queue_overflow_ = int_value != 0;
+        break;
+
+      case CQL_OPTION_CORE_CONNECTIONS_PER_HOST:
+        core_connections_per_host_ = int_value;
+        break;
+
+      case CQL_OPTION_MAX_CONNECTIONS_PER_HOST:
+        max_connections_per_host_ = int_value;
+        break;
+
+      case CQL_OPTION_REMOTE_CORE_CONNECTIONS_PER_HOST:
+        remote_core_connections_per_host_ = int_value;
+        break;
+
+      case CQL_OPTION_REMOTE_MAX_CONNECTIONS_PER_HOST:
+        remote_max_connections_per_host_ = int_value;
+        break;
+
+      case CQL_OPTION_LOCAL_DATACENTER:
+        local_datacenter_.assign(reinterpret_cast<const char*>(value), size);
+        break;
+
+      case CQL_OPTION_USED_HOSTS_PER_REMOTE_DC:
+        used_hosts_per_remote_dc_ = int_value;
+        break;
+
+      case CQL_OPTION_TOKEN_AWARE:
+        token_aware_ = int_value != 0;
+        break;
+
+      case CQL_OPTION_LATENCY_AWARE:
+        latency_aware_ = int_value != 0;
+        break;
+
+      case CQL_OPTION_LATENCY_EXCLUSION_THRESHOLD:
+        latency_exclusion_threshold_ = int_value;
+        break;
+
+      case CQL_OPTION_LATENCY_RETRY_PERIOD:
+        latency_retry_period_ = int_value;
+        break;
+
+      case CQL_OPTION_SPECULATIVE_EXECUTION_DELAY:
+        speculative_execution_delay_ = int_value;
+        break;
+
+      case CQL_OPTION_SPECULATIVE_EXECUTION_PERCENTILE:
+        speculative_execution_percentile_ = int_value;
+        break;
+
+      case CQL_OPTION_SPECULATIVE_EXECUTIONS_MAX:
+        speculative_executions_max_ = int_value;
+        break;
+
+      case CQL_OPTION_REPLICATION_FACTOR:
+        replication_factor_ = int_value;
+        break;
+
+      case CQL_OPTION_REQUEST_TIMEOUT:
+        request_timeout_ = int_value;
+        break;
+
       case CQL_OPTION_CONTROL_CONNECTION_TIMEOUT:
         control_connection_timeout_ = int_value;
         break;
@@ -33,12 +33,52 @@
 #include "cql_request.hpp"
 #include "cql_error.hpp"
 #include "cql_message.hpp"
+#include "cql_object_pool.hpp"
 
 namespace cql {
 
 typedef std::function<void(int, const char*, size_t)> LogCallback;
 typedef cql::Request<std::string, cql::Error*, cql::Message*> CallerRequest;
 
+/**
+ * A request on its way from the application to an IO loop, whoever
+ * sends it owns and deletes the message.
+ */
+struct QueuedRequest {
+  Message*       message;
+  CallerRequest* request;
+  // the message belongs to somebody else, it's not deleted once sent
+  bool           borrowed;
+};
+
+/**
+ * The free lists backing the objects allocated for every round trip,
+ * there is one set per IO loop. The lists outlive the set until every
+ * object allocated from them is deleted, results may be kept past the
+ * session.
+ */
+struct ObjectPools {
+  ObjectPool* message;
+  ObjectPool* body;
+  ObjectPool* request;
+
+  ObjectPools() :
+      message(new ObjectPool(sizeof(Message))),
+      body(new ObjectPool(Message::body_size_max())),
+      request(new ObjectPool(sizeof(CallerRequest)))
+  {}
+
+  ~ObjectPools() {
+    ObjectPool::retire(message);
+    ObjectPool::retire(body);
+    ObjectPool::retire(request);
+  }
+
+ private:
+  ObjectPools(const ObjectPools&);
+  void operator=(const ObjectPools&);
+};
+
 uv_buf_t
 alloc_buffer(
     size_t suggested_size) {
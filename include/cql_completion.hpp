@@ -0,0 +1,156 @@
+/*
+  Copyright 2014 DataStax
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef __CQL_COMPLETION_HPP_INCLUDED__
+#define __CQL_COMPLETION_HPP_INCLUDED__
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+#include "cql_futex.hpp"
+#include "cql_wait_strategy.hpp"
+
+// bounds for the number of polls before a waiter sleeps
+#define CQL_COMPLETION_SPIN_MIN 16
+#define CQL_COMPLETION_SPIN_MAX 4096
+
+namespace cql {
+
+/**
+ * One shot completion flag, a single 32 bit word. Completing costs one
+ * atomic exchange, plus a wakeup only if a thread actually went to sleep
+ * on it; waiters poll for a while first and only then register and sleep.
+ *
+ * How long waiters poll adapts, process wide: it grows while polling
+ * catches completions and shrinks while it doesn't.
+ */
+class Completion {
+ public:
+  Completion() :
+      state_(COMPLETION_PENDING)
+  {}
+
+  inline bool
+  ready() {
+    return state_.value().load(std::memory_order_acquire)
+        == COMPLETION_DONE;
+  }
+
+  /**
+   * mark as complete and wake any waiters, call once
+   */
+  inline void
+  complete() {
+    state_.exchange_wake(COMPLETION_DONE, COMPLETION_WAITING);
+  }
+
+  inline void
+  wait() {
+    wait_for(0);
+  }
+
+  /**
+   * @param timeout microseconds, 0 waits forever
+   *
+   * @return false if the timeout expired first
+   */
+  bool
+  wait_for(
+      uint64_t timeout) {
+    if (ready() || spin()) {
+      return true;
+    }
+
+    std::chrono::steady_clock::time_point deadline
+        = std::chrono::steady_clock::now()
+          + std::chrono::microseconds(timeout);
+
+    uint32_t state = COMPLETION_PENDING;
+    if (!state_.value().compare_exchange_strong(
+            state,
+            COMPLETION_WAITING,
+            std::memory_order_acq_rel)
+        && state == COMPLETION_DONE) {
+      return true;
+    }
+
+    for (;;) {
+      uint64_t left = 0;
+      if (timeout) {
+        int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (us <= 0) {
+          if (ready()) {
+            state_.sync();
+            return true;
+          }
+          return false;
+        }
+        left = us;
+      }
+
+      state_.wait(COMPLETION_WAITING, left);
+      if (ready()) {
+        state_.sync();
+        return true;
+      }
+    }
+  }
+
+ private:
+  enum {
+    COMPLETION_PENDING = 0,
+    COMPLETION_WAITING = 1,
+    COMPLETION_DONE    = 2
+  };
+
+  bool
+  spin() {
+    std::atomic<uint32_t>& budget = spin_budget();
+    uint32_t               limit  = budget.load(std::memory_order_relaxed);
+
+    for (uint32_t i = 0; i < limit; ++i) {
+      if (ready()) {
+        budget.store(
+            std::min<uint32_t>(CQL_COMPLETION_SPIN_MAX, limit + limit / 8 + 1),
+            std::memory_order_relaxed);
+        return true;
+      }
+      cpu_relax();
+    }
+
+    budget.store(
+        std::max<uint32_t>(CQL_COMPLETION_SPIN_MIN, limit - limit / 8),
+        std::memory_order_relaxed);
+    return false;
+  }
+
+  static std::atomic<uint32_t>&
+  spin_budget() {
+    static std::atomic<uint32_t> budget(CQL_COMPLETION_SPIN_MIN * 16);
+    return budget;
+  }
+
+  Futex state_;
+
+  Completion(const Completion&);
+  void operator=(const Completion&);
+};
+}
+#endif
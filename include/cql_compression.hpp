@@ -0,0 +1,215 @@
+/*
+  Copyright 2014 DataStax
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef __CQL_COMPRESSION_HPP_INCLUDED__
+#define __CQL_COMPRESSION_HPP_INCLUDED__
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#ifdef CQL_USE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef CQL_USE_SNAPPY
+#include <snappy-c.h>
+#endif
+
+#include "cql.h"
+
+// frame bodies smaller than this are sent uncompressed
+#define CQL_COMPRESSION_MIN_SIZE 512
+
+namespace cql {
+
+/**
+ * the name used to negotiate the algorithm in OPTIONS/STARTUP
+ *
+ * @param algorithm one of CQL_OPTION_COMPRESSION_*
+ *
+ * @return
+ */
+inline const char*
+compression_name(
+    int algorithm) {
+  switch (algorithm) {
+    case CQL_OPTION_COMPRESSION_SNAPPY:
+      return "snappy";
+    case CQL_OPTION_COMPRESSION_LZ4:
+      return "lz4";
+  }
+  return "";
+}
+
+/**
+ * whether support for algorithm was compiled in
+ *
+ * @param algorithm
+ *
+ * @return
+ */
+inline bool
+compression_available(
+    int algorithm) {
+  switch (algorithm) {
+#ifdef CQL_USE_SNAPPY
+    case CQL_OPTION_COMPRESSION_SNAPPY:
+      return true;
+#endif
+#ifdef CQL_USE_LZ4
+    case CQL_OPTION_COMPRESSION_LZ4:
+      return true;
+#endif
+  }
+  return false;
+}
+
+/**
+ * compress a frame body, output is allocated with new char[]. the LZ4
+ * format is prefixed with the big endian uncompressed size.
+ *
+ * @param algorithm
+ * @param input
+ * @param size
+ * @param output
+ * @param output_size
+ *
+ * @return false if the algorithm isn't available or compression failed
+ */
+inline bool
+compress(
+    int         algorithm,
+    const char* input,
+    size_t      size,
+    char**      output,
+    size_t&     output_size) {
+  (void) input;
+  (void) size;
+  (void) output;
+  (void) output_size;
+
+  switch (algorithm) {
+#ifdef CQL_USE_SNAPPY
+    case CQL_OPTION_COMPRESSION_SNAPPY: {
+      output_size = snappy_max_compressed_length(size);
+      *output     = new char[output_size];
+      if (snappy_compress(input, size, *output, &output_size) == SNAPPY_OK) {
+        return true;
+      }
+      delete[] *output;
+      *output = NULL;
+      return false;
+    }
+#endif
+
+#ifdef CQL_USE_LZ4
+    case CQL_OPTION_COMPRESSION_LZ4: {
+      int bound = LZ4_compressBound(size);
+      *output   = new char[sizeof(int32_t) + bound];
+
+      int32_t net_size = htonl(size);
+      memcpy(*output, &net_size, sizeof(int32_t));
+
+      int compressed = LZ4_compress_default(
+          input,
+          *output + sizeof(int32_t),
+          size,
+          bound);
+      if (compressed > 0) {
+        output_size = sizeof(int32_t) + compressed;
+        return true;
+      }
+      delete[] *output;
+      *output = NULL;
+      return false;
+    }
+#endif
+  }
+  return false;
+}
+
+/**
+ * decompress a frame body, output is allocated with new char[]
+ *
+ * @param algorithm
+ * @param input
+ * @param size
+ * @param output
+ * @param output_size
+ *
+ * @return false if the algorithm isn't available or the input is corrupt
+ */
+inline bool
+decompress(
+    int         algorithm,
+    const char* input,
+    size_t      size,
+    char**      output,
+    size_t&     output_size) {
+  (void) input;
+  (void) size;
+  (void) output;
+  (void) output_size;
+
+  switch (algorithm) {
+#ifdef CQL_USE_SNAPPY
+    case CQL_OPTION_COMPRESSION_SNAPPY: {
+      if (snappy_uncompressed_length(input, size, &output_size) != SNAPPY_OK) {
+        return false;
+      }
+      *output = new char[output_size];
+      if (snappy_uncompress(input, size, *output, &output_size) == SNAPPY_OK) {
+        return true;
+      }
+      delete[] *output;
+      *output = NULL;
+      return false;
+    }
+#endif
+
+#ifdef CQL_USE_LZ4
+    case CQL_OPTION_COMPRESSION_LZ4: {
+      if (size < sizeof(int32_t)) {
+        return false;
+      }
+
+      int32_t net_size = 0;
+      memcpy(&net_size, input, sizeof(int32_t));
+      int32_t uncompressed = ntohl(net_size);
+      if (uncompressed < 0) {
+        return false;
+      }
+
+      *output = new char[uncompressed];
+      int decompressed = LZ4_decompress_safe(
+          input + sizeof(int32_t),
+          *output,
+          size - sizeof(int32_t),
+          uncompressed);
+      if (decompressed == uncompressed) {
+        output_size = uncompressed;
+        return true;
+      }
+      delete[] *output;
+      *output = NULL;
+      return false;
+    }
+#endif
+  }
+  return false;
+}
+}
+#endif
@@ -0,0 +1,569 @@
+/*
+  Copyright 2014 DataStax
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef __CQL_CONTROL_CONNECTION_HPP_INCLUDED__
+#define __CQL_CONTROL_CONNECTION_HPP_INCLUDED__
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+
+#include <functional>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "cql_client_connection.hpp"
+#include "cql_host.hpp"
+#include "cql_pool.hpp"
+#include "cql_timing_wheel.hpp"
+
+// milliseconds between topology refreshes
+#define CQL_CONTROL_CONNECTION_REFRESH 60000
+// milliseconds to wait on a topology query
+#define CQL_CONTROL_CONNECTION_TIMEOUT 10000
+
+#define CQL_CONTROL_LOCAL_QUERY \
+  "SELECT data_center, rack, tokens, rpc_address FROM system.local " \
+  "WHERE key='local'"
+#define CQL_CONTROL_PEERS_QUERY \
+  "SELECT peer, data_center, rack, tokens, rpc_address FROM system.peers"
+
+namespace cql {
+
+/**
+ * A connection of its own to one node, used to learn which hosts make up
+ * the cluster. system.local and system.peers are read once connected and
+ * again every CQL_CONTROL_CONNECTION_REFRESH; each complete read is
+ * handed to the topology callback. If the node goes away the next host
+ * known is tried, then the contact points.
+ *
+ * Lives on one IO loop and is only touched from it.
+ */
+class ControlConnection {
+  // hands the control connection connections which never went through
+  // a handshake
+  friend struct ControlConnectionTest;
+
+ public:
+  typedef std::function<void(const std::vector<Host>&)> TopologyCallback;
+
+  /**
+   * @param loop
+   * @param ssl_context
+   * @param timing_wheel times the queries and drives the refresh
+   * @param options connection settings, the keyspace is ignored
+   * @param timeout milliseconds to wait on each query
+   * @param callback
+   */
+  ControlConnection(
+      uv_loop_t*         loop,
+      SSLContext*        ssl_context,
+      TimingWheel*       timing_wheel,
+      const PoolOptions& options,
+      uint64_t           timeout,
+      TopologyCallback   callback) :
+      loop_(loop),
+      ssl_context_(ssl_context),
+      timing_wheel_(timing_wheel),
+      options_(options),
+      timeout_(timeout ? timeout : CQL_CONTROL_CONNECTION_TIMEOUT),
+      callback_(callback),
+      connection_(NULL),
+      generation_(0),
+      connected_(false),
+      querying_(false),
+      closing_(false),
+      next_candidate_(0) {
+    refresh_timer_.data = this;
+  }
+
+  ~ControlConnection() {
+    timing_wheel_->cancel(&refresh_timer_);
+    delete connection_;
+    for (std::list<ClientConnection*>::iterator it = defunct_.begin();
+         it != defunct_.end();
+         ++it) {
+      delete *it;
+    }
+  }
+
+  /**
+   * @param contact_points tried in order, and again whenever none of the
+   *   hosts found since can be reached
+   */
+  void
+  connect(
+      const std::list<std::string>& contact_points) {
+    contact_points_.assign(contact_points.begin(), contact_points.end());
+    candidates_     = contact_points_;
+    next_candidate_ = 0;
+    open_next();
+    timing_wheel_->schedule(
+        &refresh_timer_,
+        CQL_CONTROL_CONNECTION_REFRESH,
+        ControlConnection::on_refresh);
+  }
+
+  /**
+   * stop refreshing and close the connections, the requests on them
+   * fail. can be deleted once is_closed.
+   */
+  void
+  close() {
+    closing_ = true;
+    timing_wheel_->cancel(&refresh_timer_);
+    retire();
+    for (std::list<ClientConnection*>::iterator it = defunct_.begin();
+         it != defunct_.end();
+         ++it) {
+      (*it)->close();
+    }
+  }
+
+  bool
+  is_closed() {
+    reap();
+    return closing_ && !connection_ && defunct_.empty();
+  }
+
+  /**
+   * read the rows of a system.local or system.peers query. a host's
+   * address is its rpc_address, unless that's unset or the wildcard, in
+   * which case it's the peer column or for the local node the address
+   * the connection was opened to.
+   *
+   * @param response
+   * @param connected_address
+   * @param output appended to
+   *
+   * @return false if the response isn't a set of rows
+   */
+  static bool
+  parse_hosts(
+      Message*           response,
+      const std::string& connected_address,
+      std::vector<Host>& output) {
+    if (response->opcode != CQL_OPCODE_RESULT) {
+      return false;
+    }
+
+    BodyResult* result = static_cast<BodyResult*>(response->body.get());
+    if (result->kind != CQL_RESULT_KIND_ROWS) {
+      return false;
+    }
+
+    bool int_lengths = (response->version & ~CQL_PROTOCOL_DIRECTION)
+        >= CQL_PROTOCOL_VERSION_V3;
+    int  peer        = column(result, "peer");
+    int  rpc_address = column(result, "rpc_address");
+    int  datacenter  = column(result, "data_center");
+    int  rack        = column(result, "rack");
+    int  tokens      = column(result, "tokens");
+
+    if (result->row_count <= 0) {
+      return true;
+    }
+
+    ResultIterator it(result);
+    do {
+      Host host;
+      if (!decode_inet(it.row, rpc_address, host.address)
+          || host.address == "0.0.0.0"
+          || host.address == "::") {
+        host.address.clear();
+        if (peer < 0) {
+          host.address = connected_address;
+        } else {
+          decode_inet(it.row, peer, host.address);
+        }
+      }
+
+      if (host.address.empty()) {
+        continue;
+      }
+
+      decode_text(it.row, datacenter, host.datacenter);
+      decode_text(it.row, rack, host.rack);
+      if (tokens >= 0 && it.row[tokens].first) {
+        std::vector<std::string> values;
+        if (!decode_string_collection(
+                it.row[tokens].first,
+                it.row[tokens].second,
+                int_lengths,
+                values)) {
+          return false;
+        }
+        host.tokens.reserve(values.size());
+        for (std::vector<std::string>::const_iterator token = values.begin();
+             token != values.end();
+             ++token) {
+          host.tokens.push_back(strtoll(token->c_str(), NULL, 10));
+        }
+      }
+      output.push_back(host);
+    } while (it.next());
+    return true;
+  }
+
+ private:
+  typedef void (ControlConnection::*ResponseHandler)(CallerRequest*);
+
+  /**
+   * drop everything learned from the last connection and refresh from the
+   * next host known, or the contact points
+   */
+  void
+  start_over() {
+    candidates_ = known_;
+    candidates_.insert(
+        candidates_.end(),
+        contact_points_.begin(),
+        contact_points_.end());
+    next_candidate_ = 0;
+    open_next();
+  }
+
+  static int
+  column(
+      BodyResult* result,
+      const char* name) {
+    BodyResult::MetaDataIndex::const_iterator it
+        = result->column_index.find(name);
+    return it == result->column_index.end() ? -1 : it->second;
+  }
+
+  static bool
+  decode_inet(
+      const std::vector<ResultIterator::Column>& row,
+      int                                        index,
+      std::string&                               output) {
+    if (index < 0 || !row[index].first) {
+      return false;
+    }
+
+    char name[INET6_ADDRSTRLEN];
+    int  family = row[index].second == 4 ? AF_INET : AF_INET6;
+    if ((row[index].second != 4 && row[index].second != 16)
+        || !inet_ntop(family, row[index].first, name, sizeof(name))) {
+      return false;
+    }
+    output = name;
+    return true;
+  }
+
+  static void
+  decode_text(
+      const std::vector<ResultIterator::Column>& row,
+      int                                        index,
+      std::string&                               output) {
+    if (index >= 0 && row[index].first) {
+      output.assign(row[index].first, row[index].second);
+    }
+  }
+
+  static void
+  on_refresh(
+      TimerNode* timer) {
+    ControlConnection* control
+        = reinterpret_cast<ControlConnection*>(timer->data);
+    control->refresh();
+    control->timing_wheel_->schedule(
+        timer,
+        CQL_CONTROL_CONNECTION_REFRESH,
+        ControlConnection::on_refresh);
+  }
+
+  void
+  refresh() {
+    reap();
+    if (connection_) {
+      // still connecting, or the last refresh hasn't finished
+      if (connected_ && !querying_) {
+        query(CQL_CONTROL_LOCAL_QUERY, &ControlConnection::on_local);
+      }
+      return;
+    }
+
+    // every host known ran out, start over with all of them
+    start_over();
+  }
+
+  void
+  open_next() {
+    if (closing_ || next_candidate_ >= candidates_.size()) {
+      // wait for the next refresh
+      return;
+    }
+
+    ClientConnection* connection = new ClientConnection(
+        loop_,
+        ssl_context_ ? ssl_context_->session_new() : NULL,
+        NULL,
+        timing_wheel_);
+    connection->hostname_    = candidates_[next_candidate_++];
+    connection->port_        = options_.port;
+    connection->cql_version_ = options_.cql_version;
+    connection->compression(
+        static_cast<ClientConnection::Compression>(options_.compression));
+    connection->protocol_version(options_.protocol_version);
+    connection->request_timeout(timeout_);
+    adopt(connection);
+    connection->init(
+        std::bind(
+            &ControlConnection::on_connect,
+            this,
+            std::placeholders::_1,
+            std::placeholders::_2));
+  }
+
+  /**
+   * make connection the one queries go to
+   *
+   * @param connection
+   */
+  void
+  adopt(
+      ClientConnection* connection) {
+    connection_ = connection;
+    connected_  = false;
+    ++generation_;
+    connection->close_callback(
+        std::bind(
+            &ControlConnection::on_close,
+            this,
+            std::placeholders::_1));
+  }
+
+  void
+  on_connect(
+      ClientConnection* connection,
+      cql::Error*       error) {
+    if (connection != connection_) {
+      delete error;
+      return;
+    }
+
+    if (error) {
+      delete error;
+      reconnect();
+      return;
+    }
+
+    connected_ = true;
+    query(CQL_CONTROL_LOCAL_QUERY, &ControlConnection::on_local);
+  }
+
+  /**
+   * the socket closed. the server hung up if it's still the current
+   * connection, retired ones were closed on purpose.
+   *
+   * @param connection
+   */
+  void
+  on_close(
+      ClientConnection* connection) {
+    if (connection == connection_) {
+      reconnect();
+    }
+  }
+
+  /**
+   * give up on the current connection and move on to the next host. runs
+   * from the connection's callbacks, so it must not reap it.
+   */
+  void
+  reconnect() {
+    bool was_connected = connected_;
+    retire();
+    if (was_connected) {
+      // the node went away, try the others from the start
+      start_over();
+    } else {
+      open_next();
+    }
+  }
+
+  /**
+   * stop using the current connection, it's freed once closed
+   */
+  void
+  retire() {
+    if (!connection_) {
+      return;
+    }
+    connection_->close();
+    defunct_.push_back(connection_);
+    connection_ = NULL;
+    connected_  = false;
+    querying_   = false;
+  }
+
+  void
+  reap() {
+    std::list<ClientConnection*>::iterator it = defunct_.begin();
+    while (it != defunct_.end()) {
+      if ((*it)->is_closed() && !(*it)->waiting_requests()) {
+        delete *it;
+        it = defunct_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  void
+  query(
+      const char*     statement,
+      ResponseHandler handler) {
+    Message    message(CQL_OPCODE_QUERY);
+    BodyQuery* body = static_cast<BodyQuery*>(message.body.get());
+    body->query_string(statement);
+    body->consistency(CQL_CONSISTENCY_ONE);
+
+    // answered on this loop, the handler may retire the connection
+    CallerRequest* request = connection_->new_request();
+    request->use_local_loop = true;
+    request->callback       = std::bind(
+        &ControlConnection::on_response,
+        this,
+        generation_,
+        handler,
+        std::placeholders::_1);
+    querying_               = true;
+
+    Error* err = connection_->send_message(&message, request);
+    if (err) {
+      request->error = err;
+      request->notify(loop_);
+    }
+  }
+
+  /**
+   * pass the response on to handler, unless the connection the query was
+   * sent on has been replaced or retired since
+   *
+   * @param generation of the connection the query was sent on
+   * @param handler
+   * @param request
+   */
+  void
+  on_response(
+      uint64_t        generation,
+      ResponseHandler handler,
+      CallerRequest*  request) {
+    if (generation != generation_ || !connection_) {
+      delete request->error;
+      delete request->result;
+      delete request;
+      return;
+    }
+    (this->*handler)(request);
+  }
+
+  /**
+   * @param request
+   *
+   * @return false if the query failed, in which case the request is
+   *   freed and the next host tried
+   */
+  bool
+  check_response(
+      CallerRequest* request) {
+    if (!request->error && request->result) {
+      return true;
+    }
+
+    delete request->error;
+    delete request->result;
+    delete request;
+    reconnect();
+    return false;
+  }
+
+  void
+  on_local(
+      CallerRequest* request) {
+    if (!check_response(request)) {
+      return;
+    }
+
+    hosts_.clear();
+    bool parsed = parse_hosts(request->result, connection_->hostname_, hosts_);
+    delete request->result;
+    delete request;
+    if (!parsed) {
+      retire();
+      return;
+    }
+    query(CQL_CONTROL_PEERS_QUERY, &ControlConnection::on_peers);
+  }
+
+  void
+  on_peers(
+      CallerRequest* request) {
+    if (!check_response(request)) {
+      return;
+    }
+
+    bool parsed = parse_hosts(request->result, std::string(), hosts_);
+    delete request->result;
+    delete request;
+    querying_ = false;
+    if (!parsed || hosts_.empty()) {
+      retire();
+      return;
+    }
+
+    known_.clear();
+    for (std::vector<Host>::const_iterator it = hosts_.begin();
+         it != hosts_.end();
+         ++it) {
+      known_.push_back(it->address);
+    }
+    callback_(hosts_);
+  }
+
+  uv_loop_t*                   loop_;
+  SSLContext*                  ssl_context_;
+  TimingWheel*                 timing_wheel_;
+  PoolOptions                  options_;
+  uint64_t                     timeout_;
+  TopologyCallback             callback_;
+  ClientConnection*            connection_;
+  // bumped for every connection adopted, queries carry it so answers
+  // from one since replaced are dropped
+  uint64_t                     generation_;
+  // the connection finished its handshake
+  bool                         connected_;
+  // a refresh is on its way
+  bool                         querying_;
+  // shutting down, no new connections
+  bool                         closing_;
+  std::list<ClientConnection*> defunct_;
+  std::vector<std::string>     contact_points_;
+  // addresses found by the last refresh
+  std::vector<std::string>     known_;
+  std::vector<std::string>     candidates_;
+  size_t                       next_candidate_;
+  // the refresh being read
+  std::vector<Host>            hosts_;
+  TimerNode                    refresh_timer_;
+
+  ControlConnection(const ControlConnection&);
+  void operator=(const ControlConnection&);
+};
+}
+#endif
@@ -0,0 +1,200 @@
+/*
+  Copyright 2014 DataStax
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef __CQL_FRAME_WRITER_HPP_INCLUDED__
+#define __CQL_FRAME_WRITER_HPP_INCLUDED__
+
+#include <string.h>
+#include <uv.h>
+#include <vector>
+
+// values at least this big are referenced instead of copied
+#define CQL_FRAME_WRITER_REFERENCE_MIN 1024
+
+namespace cql {
+
+struct FrameSegment {
+  char*  base;    // NULL when the bytes live in the scratch buffer
+  size_t offset;  // position in the scratch buffer
+  size_t len;
+  bool   owned;   // base was allocated with new char[] and must be freed
+};
+
+typedef std::vector<FrameSegment> FrameSegmentCollection;
+
+/**
+ * Encodes frames as a list of segments instead of one contiguous buffer.
+ * Headers, length prefixes and small values are appended to a reusable
+ * scratch buffer, large values are referenced where they are. Because the
+ * scratch buffer may grow while a frame is encoded, scratch segments are
+ * tracked by offset and only turned into pointers by resolve().
+ */
+class FrameWriter {
+ public:
+  FrameWriter(
+      std::vector<char>&      scratch,
+      FrameSegmentCollection& segments,
+      size_t                  reference_min = CQL_FRAME_WRITER_REFERENCE_MIN) :
+      scratch_(scratch),
+      segments_(segments),
+      reference_min_(reference_min),
+      size_(0)
+  {}
+
+  /**
+   * reserve space in the scratch buffer, the pointer is only valid until
+   * the next call to reserve
+   *
+   * @param size
+   *
+   * @return
+   */
+  char*
+  reserve(
+      size_t size) {
+    size_t offset = scratch_.size();
+    if (size == 0) {
+      return NULL;
+    }
+
+    scratch_.resize(offset + size);
+    size_ += size;
+
+    if (!segments_.empty()
+        && segments_.back().base == NULL
+        && segments_.back().offset + segments_.back().len == offset) {
+      segments_.back().len += size;
+    } else {
+      FrameSegment segment = { NULL, offset, size, false };
+      segments_.push_back(segment);
+    }
+    return &scratch_[offset];
+  }
+
+  /**
+   * the offset the next reserve will start at, use with scratch() to
+   * patch bytes written earlier
+   *
+   * @return
+   */
+  inline size_t
+  scratch_offset() {
+    return scratch_.size();
+  }
+
+  inline char*
+  scratch(
+      size_t offset) {
+    return &scratch_[offset];
+  }
+
+  /**
+   * point at memory owned by somebody else, it has to stay valid until
+   * the write completes
+   *
+   * @param data
+   * @param size
+   */
+  void
+  reference(
+      const char* data,
+      size_t      size) {
+    if (size == 0) {
+      return;
+    }
+    FrameSegment segment = { const_cast<char*>(data), 0, size, false };
+    segments_.push_back(segment);
+    size_ += size;
+  }
+
+  /**
+   * hand over a buffer allocated with new char[]
+   *
+   * @param data
+   * @param size
+   */
+  void
+  append_owned(
+      char*  data,
+      size_t size) {
+    if (size == 0) {
+      delete[] data;
+      return;
+    }
+    FrameSegment segment = { data, 0, size, true };
+    segments_.push_back(segment);
+    size_ += size;
+  }
+
+  /**
+   * copy small values into the scratch buffer, reference large ones
+   *
+   * @param data
+   * @param size
+   */
+  void
+  append(
+      const char* data,
+      size_t      size) {
+    if (size >= reference_min_) {
+      reference(data, size);
+    } else if (size) {
+      memcpy(reserve(size), data, size);
+    }
+  }
+
+  inline size_t
+  size() {
+    return size_;
+  }
+
+  /**
+   * turn segments into buffers suitable for uv_write
+   *
+   * @param scratch the scratch buffer the segments were written against
+   * @param segments
+   * @param output
+   * @param owned buffers that have to be freed once written
+   */
+  static void
+  resolve(
+      std::vector<char>&            scratch,
+      const FrameSegmentCollection& segments,
+      std::vector<uv_buf_t>&        output,
+      std::vector<char*>&           owned) {
+    output.reserve(output.size() + segments.size());
+    for (FrameSegmentCollection::const_iterator it = segments.begin();
+         it != segments.end();
+         ++it) {
+      if (it->base) {
+        output.push_back(uv_buf_init(it->base, it->len));
+        if (it->owned) {
+          owned.push_back(it->base);
+        }
+      } else {
+        output.push_back(uv_buf_init(&scratch[it->offset], it->len));
+      }
+    }
+  }
+
+ private:
+  std::vector<char>&      scratch_;
+  FrameSegmentCollection& segments_;
+  size_t                  reference_min_;
+  size_t                  size_;
+};
+}
+#endif
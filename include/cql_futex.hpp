@@ -0,0 +1,203 @@
+/*
+  Copyright 2014 DataStax
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef __CQL_FUTEX_HPP_INCLUDED__
+#define __CQL_FUTEX_HPP_INCLUDED__
+
+#include <limits.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#ifdef __linux__
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#else
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#endif
+
+namespace cql {
+
+/**
+ * A 32 bit word threads can sleep on until it changes. On Linux this is a
+ * private futex, the kernel only gets involved when somebody actually
+ * sleeps or has to be woken. Elsewhere it falls back to a condition
+ * variable.
+ *
+ * Wakers change the value first and call wake() after, sleepers pass the
+ * value they last saw to wait(), which returns straight away if it has
+ * already moved on.
+ */
+class Futex {
+ public:
+  Futex(
+      uint32_t value = 0) :
+      value_(value)
+  {}
+
+  inline std::atomic<uint32_t>&
+  value() {
+    return value_;
+  }
+
+  /**
+   * sleep while the value equals expected. may return spuriously, callers
+   * recheck their condition.
+   *
+   * @param expected
+   * @param timeout microseconds, 0 waits forever
+   *
+   * @return false if the timeout expired
+   */
+  bool
+  wait(
+      uint32_t expected,
+      uint64_t timeout = 0) {
+#ifdef __linux__
+    struct timespec  ts;
+    struct timespec* tsp = NULL;
+    if (timeout) {
+      ts.tv_sec  = timeout / 1000000;
+      ts.tv_nsec = (timeout % 1000000) * 1000;
+      tsp        = &ts;
+    }
+
+    long rc = syscall(
+        SYS_futex,
+        reinterpret_cast<uint32_t*>(&value_),
+        FUTEX_WAIT_PRIVATE,
+        expected,
+        tsp,
+        NULL,
+        0);
+    return !(rc == -1 && errno == ETIMEDOUT);
+#else
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (value_.load(std::memory_order_acquire) != expected) {
+      return true;
+    }
+
+    if (timeout) {
+      return condition_.wait_for(lock, std::chrono::microseconds(timeout))
+          == std::cv_status::no_timeout;
+    }
+    condition_.wait(lock);
+    return true;
+#endif
+  }
+
+  /**
+   * wake up to count sleepers
+   *
+   * @param count
+   */
+  void
+  wake(
+      int count = 1) {
+#ifdef __linux__
+    syscall(
+        SYS_futex,
+        reinterpret_cast<uint32_t*>(&value_),
+        FUTEX_WAKE_PRIVATE,
+        count,
+        NULL,
+        NULL,
+        0);
+#else
+    // taking the lock orders the wakeup after a sleeper's check of value
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (count == 1) {
+      condition_.notify_one();
+    } else {
+      condition_.notify_all();
+    }
+#endif
+  }
+
+  inline void
+  wake_all() {
+    wake(INT_MAX);
+  }
+
+  /**
+   * store value and, if the previous value was sleeping, wake every
+   * sleeper. a sleeper which sees the new value has to call sync() before
+   * destroying the futex.
+   *
+   * @param value
+   * @param sleeping the value sleepers wait on
+   *
+   * @return the previous value
+   */
+  uint32_t
+  exchange_wake(
+      uint32_t value,
+      uint32_t sleeping) {
+#ifdef __linux__
+    uint32_t previous = value_.exchange(value, std::memory_order_acq_rel);
+    if (previous == sleeping) {
+      // the sleeper may already have freed the word, which the kernel
+      // tolerates; at worst an unrelated futex sees a spurious wakeup
+      wake_all();
+    }
+    return previous;
+#else
+    uint32_t previous = value_.load(std::memory_order_acquire);
+    while (previous != sleeping) {
+      if (value_.compare_exchange_weak(
+              previous,
+              value,
+              std::memory_order_acq_rel)) {
+        return previous;
+      }
+    }
+
+    // change the value under the lock, sync() then can't return until
+    // we're done with the condition variable
+    std::lock_guard<std::mutex> lock(mutex_);
+    previous = value_.exchange(value, std::memory_order_acq_rel);
+    condition_.notify_all();
+    return previous;
+#endif
+  }
+
+  /**
+   * wait out a concurrent exchange_wake, see above
+   */
+  inline void
+  sync() {
+#ifndef __linux__
+    std::lock_guard<std::mutex> lock(mutex_);
+#endif
+  }
+
+ private:
+  std::atomic<uint32_t>   value_;
+#ifndef __linux__
+  std::mutex              mutex_;
+  std::condition_variable condition_;
+#endif
+
+  Futex(const Futex&);
+  void operator=(const Futex&);
+};
+}
+#endif
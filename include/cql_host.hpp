@@ -0,0 +1,56 @@
+/*
+  Copyright 2014 DataStax
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef __CQL_HOST_HPP_INCLUDED__
+#define __CQL_HOST_HPP_INCLUDED__
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "cql_host_latency.hpp"
+
+namespace cql {
+
+// a position on the Murmur3Partitioner ring
+typedef int64_t Token;
+
+/**
+ * What the driver knows about a node of the cluster. The latency is the
+ * only part which changes in place; copies of a host share it, and the
+ * metadata hands it on when a host is replaced by a newer view of itself.
+ */
+struct Host {
+  std::string                  address;
+  std::string                  datacenter;
+  std::string                  rack;
+  std::vector<Token>           tokens;
+  std::shared_ptr<HostLatency> latency;
+
+  Host() :
+      latency(new HostLatency())
+  {}
+
+  explicit
+  Host(
+      const std::string& address) :
+      address(address),
+      latency(new HostLatency())
+  {}
+};
+}
+#endif
@@ -0,0 +1,221 @@
+/*
+  Copyright 2014 DataStax
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+
+#ifndef __CQL_HOST_LATENCY_HPP_INCLUDED__
+#define __CQL_HOST_LATENCY_HPP_INCLUDED__
+
+#include <stdint.h>
+#include <atomic>
+
+// milliseconds after which the average has mostly forgotten a sample
+#define CQL_HOST_LATENCY_SCALE        100
+// samples after which a histogram's counts are halved
+#define CQL_LATENCY_HISTOGRAM_WINDOW  8192
+// four per power of two up to 2^63
+#define CQL_LATENCY_HISTOGRAM_BUCKETS 252
+
+namespace cql {
+
+/**
+ * Counts of response times in logarithmic buckets, four to each power of
+ * two, so a percentile is off by at most a quarter. Every window samples
+ * the counts are halved, which keeps the histogram to recent traffic.
+ * Lock free, like HostLatency.
+ */
+class LatencyHistogram {
+ public:
+  LatencyHistogram() :
+      count_(0) {
+    for (size_t i = 0; i < CQL_LATENCY_HISTOGRAM_BUCKETS; ++i) {
+      buckets_[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * @param latency nanoseconds
+   */
+  void
+  record(
+      uint64_t latency) {
+    buckets_[bucket(latency)].fetch_add(1, std::memory_order_relaxed);
+    // exactly one sample lands on the window, that one halves the counts
+    if (count_.fetch_add(1, std::memory_order_relaxed) + 1
+        == CQL_LATENCY_HISTOGRAM_WINDOW) {
+      uint64_t removed = 0;
+      for (size_t i = 0; i < CQL_LATENCY_HISTOGRAM_BUCKETS; ++i) {
+        uint64_t half = buckets_[i].load(std::memory_order_relaxed) / 2;
+        buckets_[i].fetch_sub(half, std::memory_order_relaxed);
+        removed += half;
+      }
+      count_.fetch_sub(removed, std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * @param percentile between 0 and 1
+   * @param min_samples
+   *
+   * @return nanoseconds, the upper bound of the bucket the percentile
+   *   falls in; 0 with fewer than min_samples samples
+   */
+  uint64_t
+  percentile(
+      double   percentile,
+      uint64_t min_samples = 1) const {
+    uint64_t counts[CQL_LATENCY_HISTOGRAM_BUCKETS];
+    uint64_t total = 0;
+    for (size_t i = 0; i < CQL_LATENCY_HISTOGRAM_BUCKETS; ++i) {
+      counts[i] = buckets_[i].load(std::memory_order_relaxed);
+      total    += counts[i];
+    }
+
+    if (total == 0 || total < min_samples) {
+      return 0;
+    }
+
+    uint64_t target = static_cast<uint64_t>(percentile * total + 0.5);
+    if (target == 0) {
+      target = 1;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < CQL_LATENCY_HISTOGRAM_BUCKETS; ++i) {
+      seen += counts[i];
+      if (seen >= target) {
+        return upper_bound(i);
+      }
+    }
+    return upper_bound(CQL_LATENCY_HISTOGRAM_BUCKETS - 1);
+  }
+
+  static inline size_t
+  bucket(
+      uint64_t value) {
+    if (value < 4) {
+      return value;
+    }
+
+    size_t msb = 63 - __builtin_clzll(value);
+    return (msb - 1) * 4 + ((value >> (msb - 2)) & 3);
+  }
+
+  static inline uint64_t
+  upper_bound(
+      size_t bucket) {
+    if (bucket < 4) {
+      return bucket;
+    }
+
+    size_t msb = bucket / 4 + 1;
+    return ((4 + bucket % 4 + 1) << (msb - 2)) - 1;
+  }
+
+ private:
+  std::atomic<uint64_t> buckets_[CQL_LATENCY_HISTOGRAM_BUCKETS];
+  std::atomic<uint64_t> count_;
+
+  LatencyHistogram(const LatencyHistogram&);
+  void operator=(const LatencyHistogram&);
+};
+
+/**
+ * Average response time of a host across every IO loop. The weight of a
+ * new sample grows with the time since the previous one, so the average
+ * follows a change in the host's latency within a few scales however
+ * many requests it serves. Lock free; two samples racing may lose one of
+ * them, which the average absorbs. The same samples feed a histogram for
+ * percentiles.
+ */
+class HostLatency {
+ public:
+  explicit
+  HostLatency(
+      uint64_t scale = CQL_HOST_LATENCY_SCALE) :
+      scale_(scale * 1000000),
+      average_(0),
+      samples_(0),
+      updated_(0)
+  {}
+
+  /**
+   * @param now nanoseconds, from uv_hrtime
+   * @param latency nanoseconds
+   */
+  void
+  update(
+      uint64_t now,
+      uint64_t latency) {
+    uint64_t last    = updated_.exchange(now, std::memory_order_relaxed);
+    uint64_t elapsed = now > last ? now - last : 0;
+    // 1 - e^-x, without the exp
+    double   weight  = scale_
+        ? static_cast<double>(elapsed) / (elapsed + scale_)
+        : 1.0;
+
+    uint64_t average = average_.load(std::memory_order_relaxed);
+    uint64_t next    = latency;
+    do {
+      if (average) {
+        next = average + static_cast<int64_t>(
+            (static_cast<double>(latency) - average) * weight);
+      }
+    } while (!average_.compare_exchange_weak(
+        average,
+        next,
+        std::memory_order_relaxed));
+    samples_.fetch_add(1, std::memory_order_relaxed);
+    histogram_.record(latency);
+  }
+
+  /**
+   * @return nanoseconds, 0 until the first sample
+   */
+  inline uint64_t
+  average() const {
+    return average_.load(std::memory_order_relaxed);
+  }
+
+  inline uint64_t
+  samples() const {
+    return samples_.load(std::memory_order_relaxed);
+  }
+
+  inline const LatencyHistogram&
+  histogram() const {
+    return histogram_;
+  }
+
+  /**
+   * @return when the last sample came in, on the uv_hrtime clock
+   */
+  inline uint64_t
+  updated() const {
+    return updated_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  uint64_t              scale_;
+  std::atomic<uint64_t> average_;
+  std::atomic<uint64_t> samples_;
+  std::atomic<uint64_t> updated_;
+  LatencyHistogram      histogram_;
+
+  HostLatency(const HostLatency&);
+  void operator=(const HostLatency&);
+};
+}
+#endif
@@ -0,0 +1,436 @@
+/*
+  Copyright 2014 DataStax
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef __CQL_LOAD_BALANCING_HPP_INCLUDED__
+#define __CQL_LOAD_BALANCING_HPP_INCLUDED__
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "cql_common.hpp"
+#include "cql_metadata.hpp"
+
+// a host this many times slower than the fastest one is tried last
+#define CQL_LATENCY_AWARE_EXCLUSION_THRESHOLD 2.0
+// milliseconds an excluded host goes without samples before it's given
+// requests again
+#define CQL_LATENCY_AWARE_RETRY_PERIOD        10000
+// samples a host needs before its average is trusted
+#define CQL_LATENCY_AWARE_MIN_MEASURED        50
+
+namespace cql {
+
+// hosts to try for a request, best first. points into the metadata the
+// plan was made from.
+typedef std::vector<const Host*> QueryPlan;
+
+/**
+ * Decides which hosts a request goes to. One policy serves every IO loop
+ * of a session, so implementations have to be thread safe; a plan is
+ * only valid as long as the metadata it was made from.
+ */
+class LoadBalancingPolicy {
+ public:
+  virtual
+  ~LoadBalancingPolicy()
+  {}
+
+  /**
+   * @param metadata
+   * @param token the request's partition, NULL if it has no routing key
+   * @param output appended to, the caller clears it
+   */
+  virtual void
+  plan(
+      const Metadata& metadata,
+      const Token*    token,
+      QueryPlan&      output) = 0;
+
+  /**
+   * how far away a host is, which decides how many connections it gets.
+   * IGNORED hosts get none and must never be in a plan.
+   *
+   * @param metadata
+   * @param host
+   *
+   * @return
+   */
+  virtual HostDistance
+  distance(
+      const Metadata& metadata,
+      const Host&     host) {
+    (void) metadata;
+    (void) host;
+    return LOCAL;
+  }
+};
+
+/**
+ * Every host in turn, each plan starting one host further along
+ */
+class RoundRobinPolicy
+    : public LoadBalancingPolicy {
+ public:
+  RoundRobinPolicy() :
+      next_(0)
+  {}
+
+  void
+  plan(
+      const Metadata& metadata,
+      const Token*    token,
+      QueryPlan&      output) {
+    (void) token;
+    const std::vector<Host>& hosts = metadata.hosts();
+    if (hosts.empty()) {
+      return;
+    }
+
+    size_t start = next_.fetch_add(1, std::memory_order_relaxed);
+    for (size_t i = 0; i < hosts.size(); ++i) {
+      output.push_back(&hosts[(start + i) % hosts.size()]);
+    }
+  }
+
+ private:
+  std::atomic<size_t> next_;
+
+  RoundRobinPolicy(const RoundRobinPolicy&);
+  void operator=(const RoundRobinPolicy&);
+};
+
+/**
+ * Round robin over the hosts of the local datacenter, followed by a few
+ * hosts of every other datacenter for when none of the local ones can
+ * take the request. The local datacenter is the one given, or else the
+ * one of the node the driver first reached. Hosts whose datacenter isn't
+ * known yet, such as contact points before the topology is read, count
+ * as local.
+ *
+ * Only the first used_hosts_per_remote_dc hosts of a remote datacenter
+ * are REMOTE, the rest are IGNORED, so the same few hosts keep their
+ * connections open.
+ */
+class DCAwareRoundRobinPolicy
+    : public LoadBalancingPolicy {
+ public:
+  explicit
+  DCAwareRoundRobinPolicy(
+      const std::string& local_datacenter = "",
+      size_t             used_hosts_per_remote_dc = 0) :
+      local_datacenter_(local_datacenter),
+      used_hosts_per_remote_dc_(used_hosts_per_remote_dc),
+      next_(0)
+  {}
+
+  void
+  plan(
+      const Metadata& metadata,
+      const Token*    token,
+      QueryPlan&      output) {
+    (void) token;
+    const std::string& local = local_datacenter(metadata);
+    size_t             start = next_.fetch_add(1, std::memory_order_relaxed);
+
+    append(metadata, metadata.datacenter(local), start, output);
+    if (!local.empty()) {
+      append(metadata, metadata.datacenter(""), start, output);
+    }
+
+    if (used_hosts_per_remote_dc_ == 0) {
+      return;
+    }
+
+    const Metadata::DatacenterCollection& datacenters = metadata.datacenters();
+    for (Metadata::DatacenterCollection::const_iterator it
+             = datacenters.begin();
+         it != datacenters.end();
+         ++it) {
+      if (it->first.empty() || it->first == local) {
+        continue;
+      }
+
+      size_t count = std::min(used_hosts_per_remote_dc_, it->second.size());
+      for (size_t i = 0; i < count; ++i) {
+        output.push_back(
+            &metadata.hosts()[it->second[(start + i) % count]]);
+      }
+    }
+  }
+
+  HostDistance
+  distance(
+      const Metadata& metadata,
+      const Host&     host) {
+    if (host.datacenter.empty()
+        || host.datacenter == local_datacenter(metadata)) {
+      return LOCAL;
+    }
+
+    const Metadata::HostIndexes* indexes = metadata.datacenter(
+        host.datacenter);
+    if (!indexes) {
+      return IGNORED;
+    }
+
+    size_t count = std::min(used_hosts_per_remote_dc_, indexes->size());
+    for (size_t i = 0; i < count; ++i) {
+      if (metadata.hosts()[(*indexes)[i]].address == host.address) {
+        return REMOTE;
+      }
+    }
+    return IGNORED;
+  }
+
+ private:
+  inline const std::string&
+  local_datacenter(
+      const Metadata& metadata) const {
+    return local_datacenter_.empty()
+        ? metadata.local_datacenter()
+        : local_datacenter_;
+  }
+
+  static void
+  append(
+      const Metadata&              metadata,
+      const Metadata::HostIndexes* indexes,
+      size_t                       start,
+      QueryPlan&                   output) {
+    if (!indexes) {
+      return;
+    }
+
+    for (size_t i = 0; i < indexes->size(); ++i) {
+      output.push_back(
+          &metadata.hosts()[(*indexes)[(start + i) % indexes->size()]]);
+    }
+  }
+
+  std::string         local_datacenter_;
+  size_t              used_hosts_per_remote_dc_;
+  std::atomic<size_t> next_;
+
+  DCAwareRoundRobinPolicy(const DCAwareRoundRobinPolicy&);
+  void operator=(const DCAwareRoundRobinPolicy&);
+};
+
+/**
+ * Puts the replicas of a request's partition at the front of the plan,
+ * so the host that gets the request can answer it without a hop to
+ * another node. Replicas take turns being first. Only replicas the
+ * wrapped policy considers LOCAL are moved up, a replica in another
+ * datacenter keeps its place behind the local hosts. The rest of the
+ * plan, and the whole plan for requests without a routing key, comes from
+ * the wrapped policy.
+ */
+class TokenAwarePolicy
+    : public LoadBalancingPolicy {
+ public:
+  /**
+   * @param child takes ownership
+   */
+  explicit
+  TokenAwarePolicy(
+      LoadBalancingPolicy* child) :
+      child_(child),
+      next_(0)
+  {}
+
+  ~TokenAwarePolicy() {
+    delete child_;
+  }
+
+  void
+  plan(
+      const Metadata& metadata,
+      const Token*    token,
+      QueryPlan&      output) {
+    const TokenMap::Replicas* replicas = token
+        ? metadata.token_map().replicas(*token)
+        : NULL;
+    if (!replicas || replicas->empty()) {
+      child_->plan(metadata, token, output);
+      return;
+    }
+
+    const std::vector<Host>& hosts = metadata.hosts();
+    size_t                   first = output.size();
+    size_t                   start = next_.fetch_add(
+        1,
+        std::memory_order_relaxed);
+    for (size_t i = 0; i < replicas->size(); ++i) {
+      const Host& host = hosts[(*replicas)[(start + i) % replicas->size()]];
+      if (child_->distance(metadata, host) == LOCAL) {
+        output.push_back(&host);
+      }
+    }
+
+    // the replicas are already in the plan, drop them from the rest
+    size_t rest = output.size();
+    child_->plan(metadata, token, output);
+    QueryPlan::iterator end = std::remove_if(
+        output.begin() + rest,
+        output.end(),
+        InPlan(output.begin() + first, output.begin() + rest));
+    output.erase(end, output.end());
+  }
+
+  HostDistance
+  distance(
+      const Metadata& metadata,
+      const Host&     host) {
+    return child_->distance(metadata, host);
+  }
+
+ private:
+  struct InPlan {
+    QueryPlan::const_iterator begin;
+    QueryPlan::const_iterator end;
+
+    InPlan(
+        QueryPlan::const_iterator begin,
+        QueryPlan::const_iterator end) :
+        begin(begin),
+        end(end)
+    {}
+
+    bool
+    operator()(
+        const Host* host) const {
+      return std::find(begin, end, host) != end;
+    }
+  };
+
+  LoadBalancingPolicy* child_;
+  std::atomic<size_t>  next_;
+
+  TokenAwarePolicy(const TokenAwarePolicy&);
+  void operator=(const TokenAwarePolicy&);
+};
+/**
+ * Moves hosts whose recent latency is far above that of the fastest host
+ * in the plan to the back of it, keeping the wrapped policy's order
+ * otherwise. A host only counts once it has enough samples, and only
+ * while they're recent: an excluded host gets no requests and so no new
+ * samples, after the retry period it's tried again and either proves it
+ * recovered or is excluded anew.
+ */
+class LatencyAwarePolicy
+    : public LoadBalancingPolicy {
+ public:
+  /**
+   * @param child takes ownership
+   * @param exclusion_threshold
+   * @param retry_period milliseconds
+   * @param min_measured
+   */
+  explicit
+  LatencyAwarePolicy(
+      LoadBalancingPolicy* child,
+      double               exclusion_threshold
+          = CQL_LATENCY_AWARE_EXCLUSION_THRESHOLD,
+      uint64_t             retry_period = CQL_LATENCY_AWARE_RETRY_PERIOD,
+      uint64_t             min_measured = CQL_LATENCY_AWARE_MIN_MEASURED) :
+      child_(child),
+      exclusion_threshold_(exclusion_threshold),
+      retry_period_(retry_period * 1000000),
+      min_measured_(min_measured)
+  {}
+
+  ~LatencyAwarePolicy() {
+    delete child_;
+  }
+
+  void
+  plan(
+      const Metadata& metadata,
+      const Token*    token,
+      QueryPlan&      output) {
+    size_t first = output.size();
+    child_->plan(metadata, token, output);
+    reorder(uv_hrtime(), output, first);
+  }
+
+  /**
+   * move the hosts to exclude to the back of output[first, end)
+   *
+   * @param now nanoseconds, from uv_hrtime
+   * @param output
+   * @param first
+   */
+  void
+  reorder(
+      uint64_t   now,
+      QueryPlan& output,
+      size_t     first) {
+    size_t   end     = output.size();
+    uint64_t fastest = 0;
+    for (size_t i = first; i < end; ++i) {
+      const HostLatency& latency = *output[i]->latency;
+      if (measured(now, latency)
+          && (fastest == 0 || latency.average() < fastest)) {
+        fastest = latency.average();
+      }
+    }
+
+    if (fastest == 0) {
+      return;
+    }
+
+    // the excluded hosts are appended past the end while the others are
+    // compacted, then moved down behind them
+    double limit = exclusion_threshold_ * fastest;
+    size_t kept  = first;
+    for (size_t i = first; i < end; ++i) {
+      const HostLatency& latency = *output[i]->latency;
+      if (measured(now, latency) && latency.average() > limit) {
+        output.push_back(output[i]);
+      } else {
+        output[kept++] = output[i];
+      }
+    }
+    std::copy(output.begin() + end, output.end(), output.begin() + kept);
+    output.resize(end);
+  }
+
+  HostDistance
+  distance(
+      const Metadata& metadata,
+      const Host&     host) {
+    return child_->distance(metadata, host);
+  }
+
+ private:
+  inline bool
+  measured(
+      uint64_t           now,
+      const HostLatency& latency) const {
+    return latency.samples() >= min_measured_
+        && latency.updated() + retry_period_ > now;
+  }
+
+  LoadBalancingPolicy* child_;
+  double               exclusion_threshold_;
+  uint64_t             retry_period_;
+  uint64_t             min_measured_;
+
+  LatencyAwarePolicy(const LatencyAwarePolicy&);
+  void operator=(const LatencyAwarePolicy&);
+};
+}
+#endif
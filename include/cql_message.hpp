@@ -17,6 +17,8 @@
 #ifndef __MESSAGE_HPP_INCLUDED__
 #define __MESSAGE_HPP_INCLUDED__
 
+#include <algorithm>
+
 #include "cql_body_error.hpp"
 #include "cql_body_options.hpp"
 #include "cql_body_prepare.hpp"
@@ -25,29 +27,68 @@
 #include "cql_body_result.hpp"
 #include "cql_body_startup.hpp"
 #include "cql_body_supported.hpp"
+#include "cql_compression.hpp"
+#include "cql_ref_buffer.hpp"
+
+#define CQL_HEADER_SIZE    8
+#define CQL_HEADER_SIZE_V3 9
 
-#define CQL_HEADER_SIZE 8
+#define CQL_PROTOCOL_VERSION_V2  0x02
+#define CQL_PROTOCOL_VERSION_V3  0x03
+#define CQL_PROTOCOL_VERSION_MIN CQL_PROTOCOL_VERSION_V2
+#define CQL_PROTOCOL_VERSION_MAX CQL_PROTOCOL_VERSION_V3
+#define CQL_PROTOCOL_DIRECTION   0x80
+
+#define CQL_FLAG_COMPRESSION 0x01
+#define CQL_FLAG_TRACING     0x02
 
 namespace cql {
 
-struct Message {
+struct Message
+    : public PoolAllocated {
   uint8_t               version;
   int8_t                flags;
-  int8_t                stream;
+  int16_t               stream;
   uint8_t               opcode;
   int32_t               length;
   int32_t               received;
   bool                  header_received;
-  char                  header_buffer[CQL_HEADER_SIZE];
+  char                  header_buffer[CQL_HEADER_SIZE_V3];
   char*                 header_buffer_pos;
   std::unique_ptr<Body> body;
   std::unique_ptr<char> body_buffer;
   char*                 body_buffer_pos;
+  RefBuffer*            body_ref;
+  ObjectPool*           body_pool;
+  int                   compression;
   bool                  body_ready;
   bool                  body_error;
+  // encode bound values into the frame instead of referencing them, for
+  // messages which may still be written after their request completed
+  bool                  copy_values;
 
   Message() :
-      version(0x02),
+      version(CQL_PROTOCOL_VERSION_V2),
+      flags(0),
+      stream(0),
+      opcode(0),
+      length(0),
+      received(0),
+      header_received(false),
+      header_buffer_pos(header_buffer),
+      body_buffer_pos(NULL),
+      body_ref(NULL),
+      body_pool(NULL),
+      compression(CQL_OPTION_COMPRESSION_NONE),
+      body_ready(false),
+      body_error(false),
+      copy_values(false)
+  {}
+
+  explicit
+  Message(
+      ObjectPool* body_pool) :
+      version(CQL_PROTOCOL_VERSION_V2),
       flags(0),
       stream(0),
       opcode(0),
@@ -55,12 +96,18 @@ struct Message {
       received(0),
       header_received(false),
       header_buffer_pos(header_buffer),
-      body_ready(false)
+      body_buffer_pos(NULL),
+      body_ref(NULL),
+      body_pool(body_pool),
+      compression(CQL_OPTION_COMPRESSION_NONE),
+      body_ready(false),
+      body_error(false),
+      copy_values(false)
   {}
 
   Message(
       uint8_t  opcode) :
-      version(0x02),
+      version(CQL_PROTOCOL_VERSION_V2),
       flags(0),
       stream(0),
       opcode(opcode),
@@ -69,40 +116,84 @@ struct Message {
       header_received(false),
       header_buffer_pos(header_buffer),
       body(allocate_body(opcode)),
-      body_ready(false)
+      body_buffer_pos(NULL),
+      body_ref(NULL),
+      body_pool(NULL),
+      compression(CQL_OPTION_COMPRESSION_NONE),
+      body_ready(false),
+      body_error(false),
+      copy_values(false)
   {}
 
+  ~Message() {
+    // the body may point into body_ref so it has to go first
+    body.reset();
+    if (body_ref) {
+      body_ref->release();
+    }
+  }
+
+  /**
+   * allocate an empty body for opcode, from pool if one is supplied
+   *
+   * @param opcode
+   * @param pool
+   *
+   * @return
+   */
   inline static Body*
   allocate_body(
-      uint8_t  opcode) {
+      uint8_t     opcode,
+      ObjectPool* pool = NULL) {
     switch (opcode) {
       case CQL_OPCODE_RESULT:
-        return static_cast<Body*>(new BodyResult());
+        return static_cast<Body*>(new (pool) BodyResult());
 
       case CQL_OPCODE_PREPARE:
-        return static_cast<Body*>(new BodyPrepare());
+        return static_cast<Body*>(new (pool) BodyPrepare());
 
       case CQL_OPCODE_ERROR:
-        return static_cast<Body*>(new BodyError());
+        return static_cast<Body*>(new (pool) BodyError());
 
       case CQL_OPCODE_OPTIONS:
-        return static_cast<Body*>(new BodyOptions());
+        return static_cast<Body*>(new (pool) BodyOptions());
 
       case CQL_OPCODE_STARTUP:
-        return static_cast<Body*>(new BodyStartup());
+        return static_cast<Body*>(new (pool) BodyStartup());
 
       case CQL_OPCODE_SUPPORTED:
-        return static_cast<Body*>(new BodySupported());
+        return static_cast<Body*>(new (pool) BodySupported());
 
       case CQL_OPCODE_QUERY:
-        return static_cast<Body*>(new BodyQuery());
+        return static_cast<Body*>(new (pool) BodyQuery());
 
       case CQL_OPCODE_READY:
-        return static_cast<Body*>(new BodyReady());
+        return static_cast<Body*>(new (pool) BodyReady());
 
       default:
         assert(false);
     }
+    return NULL;
+  }
+
+  /**
+   * the slot size needed to pool any of the bodies from allocate_body
+   *
+   * @return
+   */
+  inline static size_t
+  body_size_max() {
+    size_t sizes[] = {
+      sizeof(BodyResult),
+      sizeof(BodyPrepare),
+      sizeof(BodyError),
+      sizeof(BodyOptions),
+      sizeof(BodyStartup),
+      sizeof(BodySupported),
+      sizeof(BodyQuery),
+      sizeof(BodyReady)
+    };
+    return *std::max_element(sizes, sizes + sizeof(sizes) / sizeof(sizes[0]));
   }
 
   bool
@@ -111,95 +202,297 @@ struct Message {
       size_t& size) {
     size = 0;
     if (body.get()) {
-      body->prepare(CQL_HEADER_SIZE, output, size);
+      size_t header = header_size(version);
+      body->prepare(header, output, size);
 
       if (!size) {
-        *output = new char[CQL_HEADER_SIZE];
-        size = CQL_HEADER_SIZE;
+        *output = new char[header];
+        size = header;
       } else {
-        length = size - CQL_HEADER_SIZE;
+        length = size - header;
       }
-
-      uint8_t* buffer = reinterpret_cast<uint8_t*>(*output);
-      buffer[0]       = version;
-      buffer[1]       = flags;
-      buffer[2]       = stream;
-      buffer[3]       = opcode;
-      encode_int(reinterpret_cast<char*>(buffer + 4), length);
+      encode_header(*output);
       return true;
     }
     return false;
   }
 
   /**
+   * encode the message into writer, large values bound to the body are
+   * referenced rather than copied and have to outlive the write.
+   *
+   * if algorithm is set, bodies of at least threshold bytes are gathered
+   * and compressed and the compression flag is set on the frame.
+   *
+   * @param writer
+   * @param algorithm one of CQL_OPTION_COMPRESSION_*
+   * @param threshold
+   *
+   * @return
+   */
+  bool
+  prepare(
+      FrameWriter& writer,
+      int          algorithm = CQL_OPTION_COMPRESSION_NONE,
+      size_t       threshold = CQL_COMPRESSION_MIN_SIZE) {
+    if (!body.get()) {
+      return false;
+    }
+
+    size_t header = writer.scratch_offset();
+    size_t start  = writer.size();
+    writer.reserve(header_size(version));
+
+    flags &= ~CQL_FLAG_COMPRESSION;
+    if (algorithm == CQL_OPTION_COMPRESSION_NONE) {
+      if (!body->encode(writer)) {
+        return false;
+      }
+    } else if (!prepare_compressed(writer, algorithm, threshold)) {
+      return false;
+    }
+    length = writer.size() - start - header_size(version);
+    encode_header(writer.scratch(header));
+    return true;
+  }
+
+  bool
+  prepare_compressed(
+      FrameWriter& writer,
+      int          algorithm,
+      size_t       threshold) {
+    char*  output = NULL;
+    size_t size   = 0;
+    if (!body->prepare(0, &output, size)) {
+      return false;
+    }
+
+    char*  compressed      = NULL;
+    size_t compressed_size = 0;
+    if (size >= threshold
+        && compress(algorithm, output, size, &compressed, compressed_size)) {
+      if (compressed_size < size) {
+        flags |= CQL_FLAG_COMPRESSION;
+        writer.append_owned(compressed, compressed_size);
+        delete[] output;
+        return true;
+      }
+      delete[] compressed;
+    }
+    writer.append_owned(output, size);
+    return true;
+  }
+
+  /**
+   * the compression flag only has meaning once an algorithm has been
+   * negotiated for the connection
    *
+   * @return
+   */
+  inline bool
+  compressed() {
+    return (flags & CQL_FLAG_COMPRESSION)
+        && compression != CQL_OPTION_COMPRESSION_NONE;
+  }
+
+  /**
+   * hand a complete body to the parser, decompressing it first if the
+   * frame is flagged as compressed
    *
-   * @param buf the source buffer
+   * @param buffer
+   * @param size
    *
-   * @return how many bytes copied
+   * @return
+   */
+  bool
+  consume_body(
+      char*  buffer,
+      size_t size) {
+    if (compressed()) {
+      char*  output      = NULL;
+      size_t output_size = 0;
+      if (!decompress(compression, buffer, size, &output, output_size)) {
+        return false;
+      }
+      body_buffer.reset(output);
+      return body->consume(output, output_size);
+    }
+    return body->consume(buffer, size);
+  }
+
+  /**
+   * v3 widened the stream id to 16 bits, earlier versions use 8. the
+   * direction bit of the version byte is ignored.
+   *
+   * @param version
+   *
+   * @return
+   */
+  inline static size_t
+  header_size(
+      uint8_t version) {
+    return (version & ~CQL_PROTOCOL_DIRECTION) >= CQL_PROTOCOL_VERSION_V3
+        ? CQL_HEADER_SIZE_V3
+        : CQL_HEADER_SIZE;
+  }
+
+  inline void
+  encode_header(
+      char* buffer) {
+    *(buffer++) = version;
+    *(buffer++) = flags;
+    if (header_size(version) == CQL_HEADER_SIZE_V3) {
+      buffer = encode_short(buffer, stream);
+    } else {
+      *(buffer++) = static_cast<int8_t>(stream);
+    }
+    *(buffer++) = opcode;
+    encode_int(buffer, length);
+  }
+
+  inline void
+  decode_header(
+      char* buffer) {
+    version = *(buffer++);
+    flags   = *(buffer++);
+    if (header_size(version) == CQL_HEADER_SIZE_V3) {
+      buffer = decode_short(buffer, stream);
+    } else {
+      stream = static_cast<int8_t>(*(buffer++));
+    }
+    opcode  = *(buffer++);
+    memcpy(&length, buffer, sizeof(int32_t));
+    length  = ntohl(length);
+  }
+
+  /**
+   * decode a frame which sits entirely within the input, the body is
+   * parsed in place and the message keeps a reference to the owner of
+   * the input instead of copying it
+   *
+   * @param input
+   * @param size
+   * @param owner the buffer which contains input
+   *
+   * @return bytes consumed, 0 if the frame isn't complete
+   */
+  int
+  consume_in_place(
+      char*      input,
+      size_t     size,
+      RefBuffer* owner) {
+    if (size == 0) {
+      return 0;
+    }
+
+    size_t header = header_size(input[0]);
+    if (size < header) {
+      return 0;
+    }
+
+    int32_t frame_length = 0;
+    memcpy(&frame_length, input + header - sizeof(int32_t), sizeof(int32_t));
+    frame_length = ntohl(frame_length);
+    if (size - header < static_cast<size_t>(frame_length)) {
+      return 0;
+    }
+
+    decode_header(input);
+    header_buffer_pos = header_buffer + header;
+    header_received   = true;
+    received          = header + length;
+
+    body.reset(allocate_body(opcode, body_pool));
+    if (body == NULL) {
+      return -1;
+    }
+
+    // compressed bodies are decoded from their decompressed copy
+    if (!compressed()) {
+      owner->retain();
+      body_ref = owner;
+    }
+
+    if (!consume_body(input + header, length)) {
+      body_error = true;
+    }
+    body_ready = true;
+    return header + length;
+  }
+
+  /**
+   * consume a chunk of the input stream. if owner is supplied and the
+   * whole frame is present in input the body is decoded in place,
+   * otherwise the frame is copied into a buffer owned by the message.
+   *
+   * @param input the source buffer
+   * @param size
+   * @param owner optional reference counted buffer which contains input
+   *
+   * @return how many bytes consumed
    */
   int
   consume(
-      char*  input,
-      size_t size) {
-    char* input_pos  = input;
-    received        += size;
+      char*      input,
+      size_t     size,
+      RefBuffer* owner = NULL) {
+    if (owner && received == 0) {
+      int consumed = consume_in_place(input, size, owner);
+      if (consumed != 0) {
+        return consumed;
+      }
+    }
+
+    char*  input_pos = input;
+    size_t remaining = size;
 
     if (!header_received) {
-      if (received >= CQL_HEADER_SIZE) {
-        // we've received more data then we need, just copy what we need
-        size_t overage = received - CQL_HEADER_SIZE;
-        size_t needed  = size - overage;
-        memcpy(header_buffer_pos, input_pos, needed);
-
-        char* buffer       = header_buffer;
-        version            = *(buffer++);
-        flags              = *(buffer++);
-        stream             = *(buffer++);
-        opcode             = *(buffer++);
-        memcpy(&length, buffer, sizeof(int32_t));
-        length = ntohl(length);
-
-        input_pos         += needed;
-        header_buffer_pos  = header_buffer + CQL_HEADER_SIZE;
-        header_received    = true;
-
-        body_buffer.reset(new char[length]);
-        body_buffer_pos = body_buffer.get();
-        body.reset(allocate_body(opcode));
-        if (body == NULL) {
-          return -1;
-        }
-      } else {
-        // we haven't received all the data yet
-        // copy the entire input to our buffer
-        memcpy(header_buffer_pos, input_pos, size);
-        header_buffer_pos += size;
-        input_pos += size;
-        return size;
+      if (remaining == 0) {
+        return 0;
+      }
+
+      // the first byte of the frame tells us how long the header is
+      size_t have   = header_buffer_pos - header_buffer;
+      size_t header = header_size(have ? header_buffer[0] : input_pos[0]);
+      size_t needed = std::min(header - have, remaining);
+
+      memcpy(header_buffer_pos, input_pos, needed);
+      header_buffer_pos += needed;
+      input_pos         += needed;
+      remaining         -= needed;
+      received          += needed;
+
+      if (have + needed < header) {
+        // we haven't received the whole header yet
+        return input_pos - input;
+      }
+
+      decode_header(header_buffer);
+      header_received = true;
+
+      body_buffer.reset(new char[length]);
+      body_buffer_pos = body_buffer.get();
+      body.reset(allocate_body(opcode, body_pool));
+      if (body == NULL) {
+        return -1;
       }
     }
 
-    if (received - CQL_HEADER_SIZE >= length) {
-      // we've received more data then we need, just copy what we need
-      size_t overage = received - length - CQL_HEADER_SIZE;
-      size_t needed = (size - (input_pos - input)) - overage;
+    // copy what's left of the body, leave anything past it for the next
+    // message
+    size_t have   = body_buffer_pos - body_buffer.get();
+    size_t needed = std::min(static_cast<size_t>(length) - have, remaining);
 
-      memcpy(body_buffer_pos, input_pos, needed);
-      body_buffer_pos += needed;
-      input_pos       += needed;
+    memcpy(body_buffer_pos, input_pos, needed);
+    body_buffer_pos += needed;
+    input_pos       += needed;
+    received        += needed;
 
-      if (!body->consume(body_buffer.get(), length)) {
+    if (have + needed == static_cast<size_t>(length)) {
+      if (!consume_body(body_buffer.get(), length)) {
         body_error = true;
       }
       body_ready = true;
-    } else {
-      // we haven't received all the data yet
-      // copy the entire input to our buffer
-      memcpy(body_buffer_pos, input_pos, size - (input_pos - input));
-      input_pos       += size;
-      body_buffer_pos += size;
-      return size;
     }
     return input_pos - input;
   }
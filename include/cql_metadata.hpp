@@ -0,0 +1,202 @@
+/*
+  Copyright 2014 DataStax
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef __CQL_METADATA_HPP_INCLUDED__
+#define __CQL_METADATA_HPP_INCLUDED__
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "cql_host.hpp"
+#include "cql_token_map.hpp"
+
+// copies of each partition assumed when routing by token
+#define CQL_METADATA_REPLICATION_FACTOR 1
+
+namespace cql {
+
+/**
+ * The hosts of the cluster and the token ring they make up. A session
+ * never changes the copy the IO loops are reading, updates are made to a
+ * copy which then replaces it.
+ */
+class Metadata {
+ public:
+  explicit
+  Metadata(
+      size_t replication_factor = CQL_METADATA_REPLICATION_FACTOR) :
+      replication_factor_(replication_factor)
+  {}
+
+  inline const std::vector<Host>&
+  hosts() const {
+    return hosts_;
+  }
+
+  inline const TokenMap&
+  token_map() const {
+    return token_map_;
+  }
+
+  inline size_t
+  replication_factor() const {
+    return replication_factor_;
+  }
+
+  typedef std::vector<size_t>                HostIndexes;
+  typedef std::map<std::string, HostIndexes> DatacenterCollection;
+
+  /**
+   * the hosts of each datacenter, as indexes into hosts()
+   *
+   * @return
+   */
+  inline const DatacenterCollection&
+  datacenters() const {
+    return datacenters_;
+  }
+
+  /**
+   * @param name
+   *
+   * @return NULL if no host is in the datacenter
+   */
+  const HostIndexes*
+  datacenter(
+      const std::string& name) const {
+    DatacenterCollection::const_iterator it = datacenters_.find(name);
+    return it == datacenters_.end() ? NULL : &it->second;
+  }
+
+  /**
+   * the datacenter of the node the driver first reached, used as the
+   * local one unless the application names it
+   *
+   * @return
+   */
+  inline const std::string&
+  local_datacenter() const {
+    return local_datacenter_;
+  }
+
+  inline void
+  local_datacenter(
+      const std::string& name) {
+    local_datacenter_ = name;
+  }
+
+  /**
+   * @param address
+   *
+   * @return NULL if the host isn't known
+   */
+  const Host*
+  find_host(
+      const std::string& address) const {
+    for (std::vector<Host>::const_iterator it = hosts_.begin();
+         it != hosts_.end();
+         ++it) {
+      if (it->address == address) {
+        return &*it;
+      }
+    }
+    return NULL;
+  }
+
+  /**
+   * add a host or replace what's known about it
+   *
+   * @param host
+   */
+  void
+  update_host(
+      const Host& host) {
+    for (std::vector<Host>::iterator it = hosts_.begin();
+         it != hosts_.end();
+         ++it) {
+      if (it->address == host.address) {
+        std::shared_ptr<HostLatency> latency = it->latency;
+        *it         = host;
+        it->latency = latency;
+        rebuild();
+        return;
+      }
+    }
+    hosts_.push_back(host);
+    rebuild();
+  }
+
+  /**
+   * replace every host at once, the ring is only rebuilt once. hosts
+   * which were known before keep their latency.
+   *
+   * @param hosts
+   */
+  void
+  hosts(
+      const std::vector<Host>& hosts) {
+    std::vector<Host> replaced(hosts);
+    for (std::vector<Host>::iterator it = replaced.begin();
+         it != replaced.end();
+         ++it) {
+      const Host* known = find_host(it->address);
+      if (known) {
+        it->latency = known->latency;
+      }
+    }
+    hosts_.swap(replaced);
+    rebuild();
+  }
+
+  /**
+   * @param address
+   *
+   * @return false if the host wasn't known
+   */
+  bool
+  remove_host(
+      const std::string& address) {
+    for (std::vector<Host>::iterator it = hosts_.begin();
+         it != hosts_.end();
+         ++it) {
+      if (it->address == address) {
+        hosts_.erase(it);
+        rebuild();
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  void
+  rebuild() {
+    token_map_.build(hosts_, replication_factor_);
+    datacenters_.clear();
+    for (size_t i = 0; i < hosts_.size(); ++i) {
+      datacenters_[hosts_[i].datacenter].push_back(i);
+    }
+  }
+
+  size_t               replication_factor_;
+  std::vector<Host>    hosts_;
+  TokenMap             token_map_;
+  DatacenterCollection datacenters_;
+  std::string          local_datacenter_;
+};
+}
+#endif
@@ -25,9 +25,16 @@
 #include <atomic>
 #include <assert.h>
 
+#include "cql_wait_strategy.hpp"
+
 namespace cql {
 
-template<typename T>
+/**
+ * Padded keeps the head and tail sequences on separate cache lines. It's
+ * only turned off to measure what false sharing costs.
+ */
+template<typename T,
+         bool     Padded = true>
 class MpmcQueue {
  public:
   MpmcQueue(
@@ -135,7 +142,169 @@ class MpmcQueue {
     return false;
   }
 
+  /**
+   * enqueue all of items or none of them, the items occupy consecutive
+   * slots claimed with a single CAS
+   *
+   * @param items
+   * @param count
+   *
+   * @return false if there isn't room for every item
+   */
+  bool
+  enqueue_bulk(
+      const T* items,
+      size_t   count) {
+    size_t head_seq = 0;
+    if (count == 0) {
+      return true;
+    }
+    if (claim(head_seq_, 0, count, false, head_seq) != count) {
+      return false;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+      Node* node = &buffer_[(head_seq + i) & mask_];
+      node->data = items[i];
+      node->seq.store(head_seq + i + 1, std::memory_order_release);
+    }
+    return true;
+  }
+
+  /**
+   * dequeue exactly count items or none
+   *
+   * @param output
+   * @param count
+   *
+   * @return false if fewer than count items are ready
+   */
+  bool
+  dequeue_bulk(
+      T*     output,
+      size_t count) {
+    if (count == 0) {
+      return true;
+    }
+    return dequeue_range(output, count, false) == count;
+  }
+
+  /**
+   * dequeue whatever is ready, up to max items, with a single CAS. meant
+   * for consumers draining the queue after a wakeup.
+   *
+   * @param output
+   * @param max
+   *
+   * @return the number of items written to output
+   */
+  size_t
+  try_dequeue_up_to(
+      T*     output,
+      size_t max) {
+    if (max == 0) {
+      return 0;
+    }
+    return dequeue_range(output, max, true);
+  }
+
+  /**
+   * number of items in the queue, only a hint while other threads are
+   * enqueueing or dequeueing
+   *
+   * @return
+   */
+  size_t
+  size_approx() {
+    size_t tail_seq = tail_seq_.load(std::memory_order_relaxed);
+    size_t head_seq = head_seq_.load(std::memory_order_relaxed);
+    return head_seq > tail_seq ? head_seq - tail_seq : 0;
+  }
+
  private:
+  size_t
+  dequeue_range(
+      T*     output,
+      size_t count,
+      bool   partial) {
+    size_t tail_seq = 0;
+    size_t claimed  = claim(tail_seq_, 1, count, partial, tail_seq);
+
+    for (size_t i = 0; i < claimed; ++i) {
+      Node* node = &buffer_[(tail_seq + i) & mask_];
+      output[i]  = node->data;
+      node->seq.store(tail_seq + i + mask_ + 1, std::memory_order_release);
+    }
+    return claimed;
+  }
+
+  /**
+   * claim a run of consecutive slots by moving seq forward once. a slot
+   * is available when its sequence is its position plus offset, 0 for
+   * producers looking for empty slots and 1 for consumers looking for
+   * full ones. once the CAS succeeds nobody else can touch the slots
+   * until we release them, so the run we counted is still ours.
+   *
+   * @param seq head_seq_ or tail_seq_
+   * @param offset
+   * @param count
+   * @param partial accept a shorter run than count
+   * @param start set to the first claimed position
+   *
+   * @return the number of slots claimed
+   */
+  size_t
+  claim(
+      std::atomic<size_t>& seq,
+      size_t               offset,
+      size_t               count,
+      bool                 partial,
+      size_t&              start) {
+    if (count > size_) {
+      if (!partial) {
+        return 0;
+      }
+      count = size_;
+    }
+
+    size_t position = seq.load(std::memory_order_relaxed);
+    for (;;) {
+      size_t available = 0;
+      while (available < count) {
+        Node*    node     = &buffer_[(position + available) & mask_];
+        size_t   node_seq = node->seq.load(std::memory_order_acquire);
+        intptr_t dif      = (intptr_t) node_seq
+                            - (intptr_t)(position + available + offset);
+        if (dif != 0) {
+          if (dif > 0 && available == 0) {
+            // another thread moved seq past this slot, start over
+            available = count + 1;
+          }
+          break;
+        }
+        ++available;
+      }
+
+      if (available > count) {
+        position = seq.load(std::memory_order_relaxed);
+        continue;
+      }
+
+      if (available == 0 || (available < count && !partial)) {
+        return 0;
+      }
+
+      // on failure position is reloaded with the current value
+      if (seq.compare_exchange_weak(
+              position,
+              position + available,
+              std::memory_order_relaxed)) {
+        start = position;
+        return available;
+      }
+    }
+  }
+
   struct Node {
     T                     data;
     std::atomic<size_t>   seq;
@@ -147,7 +316,7 @@ class MpmcQueue {
   AlignedNode;
 
   // it's either 32 or 64 so 64 is good enough
-  typedef char CachePad[64];
+  typedef char CachePad[Padded ? 64 : 1];
 
   CachePad            pad0_;
   const size_t        size_;
@@ -162,5 +331,159 @@ class MpmcQueue {
   MpmcQueue(const MpmcQueue&) {}
   void operator=(const MpmcQueue&) {}
 };
+
+/**
+ * MpmcQueue whose consumers can block until an item arrives instead of
+ * polling. How they wait is up to the WaitStrategy, see
+ * cql_wait_strategy.hpp; producers only pay for a wakeup when a consumer
+ * is parked.
+ */
+template<typename T,
+         typename WaitStrategy = ParkWaitStrategy>
+class BlockingMpmcQueue {
+ public:
+  BlockingMpmcQueue(
+      size_t size) :
+      queue_(size)
+  {}
+
+  bool
+  enqueue(
+      const T& data) {
+    if (queue_.enqueue(data)) {
+      wait_.notify();
+      return true;
+    }
+    return false;
+  }
+
+  bool
+  enqueue_bulk(
+      const T* items,
+      size_t   count) {
+    if (queue_.enqueue_bulk(items, count)) {
+      if (count > 1) {
+        wait_.notify_all();
+      } else {
+        wait_.notify();
+      }
+      return true;
+    }
+    return false;
+  }
+
+  inline bool
+  dequeue(
+      T& data) {
+    return queue_.dequeue(data);
+  }
+
+  inline size_t
+  try_dequeue_up_to(
+      T*     output,
+      size_t max) {
+    return queue_.try_dequeue_up_to(output, max);
+  }
+
+  /**
+   * block until an item is available
+   *
+   * @param data
+   * @param timeout microseconds, 0 waits forever
+   *
+   * @return false if the timeout expired
+   */
+  bool
+  dequeue_wait(
+      T&       data,
+      uint64_t timeout = 0) {
+    return wait_.wait(Dequeue(queue_, data), timeout);
+  }
+
+  /**
+   * block until at least one item is available, then take up to max
+   *
+   * @param output
+   * @param max
+   * @param timeout microseconds, 0 waits forever
+   *
+   * @return the number of items taken, 0 if the timeout expired
+   */
+  size_t
+  dequeue_wait_up_to(
+      T*       output,
+      size_t   max,
+      uint64_t timeout = 0) {
+    size_t count = 0;
+    wait_.wait(DequeueUpTo(queue_, output, max, count), timeout);
+    return count;
+  }
+
+  /**
+   * wake every parked consumer, e.g. so they notice a shutdown flag
+   */
+  inline void
+  notify_all() {
+    wait_.notify_all();
+  }
+
+  inline size_t
+  size_approx() {
+    return queue_.size_approx();
+  }
+
+  inline WaitStrategy&
+  wait_strategy() {
+    return wait_;
+  }
+
+ private:
+  struct Dequeue {
+    MpmcQueue<T>& queue;
+    T&            data;
+
+    Dequeue(
+        MpmcQueue<T>& queue,
+        T&            data) :
+        queue(queue),
+        data(data)
+    {}
+
+    inline bool
+    operator()() {
+      return queue.dequeue(data);
+    }
+  };
+
+  struct DequeueUpTo {
+    MpmcQueue<T>& queue;
+    T*            output;
+    size_t        max;
+    size_t&       count;
+
+    DequeueUpTo(
+        MpmcQueue<T>& queue,
+        T*            output,
+        size_t        max,
+        size_t&       count) :
+        queue(queue),
+        output(output),
+        max(max),
+        count(count)
+    {}
+
+    inline bool
+    operator()() {
+      count = queue.try_dequeue_up_to(output, max);
+      return count != 0;
+    }
+  };
+
+  MpmcQueue<T> queue_;
+  WaitStrategy wait_;
+
+  BlockingMpmcQueue(const BlockingMpmcQueue&) {}
+  void operator=(const BlockingMpmcQueue&) {}
+};
 }
 #endif
@@ -0,0 +1,143 @@
+/*
+  Copyright 2014 DataStax
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef __CQL_MURMUR3_HPP_INCLUDED__
+#define __CQL_MURMUR3_HPP_INCLUDED__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <limits>
+
+namespace cql {
+
+inline uint64_t
+murmur3_rotl(
+    uint64_t value,
+    int      shift) {
+  return (value << shift) | (value >> (64 - shift));
+}
+
+inline uint64_t
+murmur3_fmix(
+    uint64_t value) {
+  value ^= value >> 33;
+  value *= 0xff51afd7ed558ccdULL;
+  value ^= value >> 33;
+  value *= 0xc4ceb9fe1a85ec53ULL;
+  value ^= value >> 33;
+  return value;
+}
+
+inline uint64_t
+murmur3_block(
+    const uint8_t* input) {
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; --i) {
+    value = (value << 8) | input[i];
+  }
+  return value;
+}
+
+/**
+ * the token Cassandra's Murmur3Partitioner assigns a partition key, the
+ * first half of MurmurHash3 x64 128 with a seed of 0. Cassandra's
+ * implementation sign extends the bytes of the tail, which is kept here
+ * so tokens match the server's.
+ *
+ * @param data the serialized partition key
+ * @param size
+ *
+ * @return
+ */
+inline int64_t
+murmur3_token(
+    const char* data,
+    size_t      size) {
+  const uint8_t* input  = reinterpret_cast<const uint8_t*>(data);
+  const size_t   blocks = size / 16;
+  const uint64_t c1     = 0x87c37b91114253d5ULL;
+  const uint64_t c2     = 0x4cf5ad432745937fULL;
+  uint64_t       h1     = 0;
+  uint64_t       h2     = 0;
+
+  for (size_t i = 0; i < blocks; ++i) {
+    uint64_t k1 = murmur3_block(input + i * 16);
+    uint64_t k2 = murmur3_block(input + i * 16 + 8);
+
+    k1 *= c1;
+    k1  = murmur3_rotl(k1, 31);
+    k1 *= c2;
+    h1 ^= k1;
+    h1  = murmur3_rotl(h1, 27);
+    h1 += h2;
+    h1  = h1 * 5 + 0x52dce729;
+
+    k2 *= c2;
+    k2  = murmur3_rotl(k2, 33);
+    k2 *= c1;
+    h2 ^= k2;
+    h2  = murmur3_rotl(h2, 31);
+    h2 += h1;
+    h2  = h2 * 5 + 0x38495ab5;
+  }
+
+  // Cassandra reads the tail as signed bytes, the sign bits of each byte
+  // spill into the ones above it
+  const int8_t* tail = reinterpret_cast<const int8_t*>(input + blocks * 16);
+  size_t        rest = size & 15;
+  if (rest > 8) {
+    uint64_t k2 = 0;
+    for (size_t i = 8; i < rest; ++i) {
+      k2 ^= static_cast<uint64_t>(static_cast<int64_t>(tail[i]))
+          << ((i - 8) * 8);
+    }
+    k2 *= c2;
+    k2  = murmur3_rotl(k2, 33);
+    k2 *= c1;
+    h2 ^= k2;
+  }
+
+  if (rest > 0) {
+    uint64_t k1 = 0;
+    for (size_t i = 0; i < rest && i < 8; ++i) {
+      k1 ^= static_cast<uint64_t>(static_cast<int64_t>(tail[i]))
+          << (i * 8);
+    }
+    k1 *= c1;
+    k1  = murmur3_rotl(k1, 31);
+    k1 *= c2;
+    h1 ^= k1;
+  }
+
+  h1 ^= size;
+  h2 ^= size;
+  h1 += h2;
+  h2 += h1;
+  h1  = murmur3_fmix(h1);
+  h2  = murmur3_fmix(h2);
+  h1 += h2;
+
+  int64_t token;
+  memcpy(&token, &h1, sizeof(token));
+  // the minimum is reserved by the partitioner
+  return token == std::numeric_limits<int64_t>::min()
+      ? std::numeric_limits<int64_t>::max()
+      : token;
+}
+}
+#endif
@@ -0,0 +1,196 @@
+/*
+  Copyright 2014 DataStax
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef __CQL_OBJECT_POOL_HPP_INCLUDED__
+#define __CQL_OBJECT_POOL_HPP_INCLUDED__
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <new>
+
+#include "cql_mpmc_queue.hpp"
+
+#define CQL_OBJECT_POOL_CAPACITY 1024
+
+namespace cql {
+
+/**
+ * Free list of fixed size slots. Every slot is prefixed by a header
+ * pointing back to the pool it came from, which lets objects be released
+ * from any thread without knowing their origin. Objects allocated without
+ * a pool carry a NULL header and go straight back to the heap.
+ *
+ * Every slot handed out holds a reference on its pool. A pool allocated
+ * with new is let go of with retire rather than delete, it deletes itself
+ * once the last slot comes back, objects may outlive whoever owned the
+ * pool. A pool destroyed directly must outlive every object allocated
+ * from it.
+ */
+class ObjectPool {
+ public:
+  ObjectPool(
+      size_t slot_size,
+      size_t capacity = CQL_OBJECT_POOL_CAPACITY) :
+      slot_size_(slot_size),
+      free_(capacity),
+      hits_(0),
+      misses_(0),
+      references_(1)
+  {}
+
+  ~ObjectPool() {
+    void* slot = NULL;
+    while (free_.dequeue(slot)) {
+      ::free(slot);
+    }
+  }
+
+  /**
+   * drop the owner's reference to a pool allocated with new, it's deleted
+   * once every slot has come back
+   *
+   * @param pool
+   */
+  static void
+  retire(
+      ObjectPool* pool) {
+    pool->unref();
+  }
+
+  static void*
+  allocate(
+      ObjectPool* pool,
+      size_t      size) {
+    void* slot = NULL;
+
+    if (pool) {
+      assert(size <= pool->slot_size_);
+      pool->references_.fetch_add(1, std::memory_order_relaxed);
+      if (pool->free_.dequeue(slot)) {
+        pool->hits_.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        pool->misses_.fetch_add(1, std::memory_order_relaxed);
+        slot = ::malloc(sizeof(Header) + pool->slot_size_);
+      }
+    } else {
+      slot = ::malloc(sizeof(Header) + size);
+    }
+
+    if (!slot) {
+      throw std::bad_alloc();
+    }
+    reinterpret_cast<Header*>(slot)->pool = pool;
+    return reinterpret_cast<char*>(slot) + sizeof(Header);
+  }
+
+  static void
+  release(
+      void* ptr) {
+    if (!ptr) {
+      return;
+    }
+
+    void*       slot = reinterpret_cast<char*>(ptr) - sizeof(Header);
+    ObjectPool* pool = reinterpret_cast<Header*>(slot)->pool;
+    if (!pool || !pool->free_.enqueue(slot)) {
+      ::free(slot);
+    }
+    if (pool) {
+      pool->unref();
+    }
+  }
+
+  inline size_t
+  hits() {
+    return hits_.load(std::memory_order_relaxed);
+  }
+
+  inline size_t
+  misses() {
+    return misses_.load(std::memory_order_relaxed);
+  }
+
+  double
+  hit_rate() {
+    size_t h = hits();
+    size_t m = misses();
+    return h + m ? static_cast<double>(h) / (h + m) : 0.0;
+  }
+
+ private:
+  // keep the object maximally aligned
+  union Header {
+    ObjectPool* pool;
+    long double align;
+  };
+
+  void
+  unref() {
+    // pairs with the other releases, everything they freed is seen by
+    // the destructor
+    if (references_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete this;
+    }
+  }
+
+  const size_t        slot_size_;
+  MpmcQueue<void*>    free_;
+  std::atomic<size_t> hits_;
+  std::atomic<size_t> misses_;
+  // the owner's and one for each slot out
+  std::atomic<size_t> references_;
+
+  ObjectPool(const ObjectPool&);
+  void operator=(const ObjectPool&);
+};
+
+/**
+ * Base for types which can be allocated from an ObjectPool with
+ * new (pool) T(...). Plain new and delete keep working, delete returns
+ * the object to whichever pool it came from.
+ */
+struct PoolAllocated {
+  static void*
+  operator new(
+      size_t size) {
+    return ObjectPool::allocate(NULL, size);
+  }
+
+  static void*
+  operator new(
+      size_t      size,
+      ObjectPool* pool) {
+    return ObjectPool::allocate(pool, size);
+  }
+
+  static void
+  operator delete(
+      void* ptr) {
+    ObjectPool::release(ptr);
+  }
+
+  static void
+  operator delete(
+      void*       ptr,
+      ObjectPool* pool) {
+    (void) pool;
+    ObjectPool::release(ptr);
+  }
+};
+}
+#endif
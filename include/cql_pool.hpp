@@ -17,75 +17,457 @@
 #ifndef __POOL_HPP_INCLUDED__
 #define __POOL_HPP_INCLUDED__
 
+#include <algorithm>
+#include <deque>
 #include <list>
 #include <string>
-#include <algorithm>
+#include <vector>
 
 #include "cql_client_connection.hpp"
 #include "cql_cluster.hpp"
 
+#define CQL_POOL_PENDING_MAX          4096
+// milliseconds between looks at the load on a pool
+#define CQL_POOL_MAINTENANCE_INTERVAL 1000
+// average in flight requests per connection which opens another
+#define CQL_POOL_GROW_IN_FLIGHT       64
+// average, with one connection less, the pool has to stay under before
+// it's trimmed
+#define CQL_POOL_SHRINK_IN_FLIGHT     8
+// milliseconds the pool has to stay that quiet
+#define CQL_POOL_SHRINK_DELAY         60000
+
 namespace cql {
 
+/**
+ * Settings applied to every connection a pool opens
+ */
+struct PoolOptions {
+  std::string port;
+  std::string cql_version;
+  std::string keyspace;
+  int         compression;
+  int         protocol_version;
+  uint64_t    request_timeout;
+  size_t      core_connections_per_host;
+  size_t      max_connections_per_host;
+  // used instead of the above for hosts in other datacenters
+  size_t      remote_core_connections_per_host;
+  size_t      remote_max_connections_per_host;
+  size_t      max_simultaneous_creation;
+  size_t      max_pending_requests;
+  size_t      grow_in_flight;
+  size_t      shrink_in_flight;
+  uint64_t    shrink_delay;
+
+  PoolOptions() :
+      port("9042"),
+      cql_version("3.0.0"),
+      compression(CQL_OPTION_COMPRESSION_NONE),
+      protocol_version(CQL_PROTOCOL_VERSION_MAX),
+      request_timeout(CQL_REQUEST_TIMEOUT),
+      core_connections_per_host(1),
+      max_connections_per_host(2),
+      remote_core_connections_per_host(1),
+      remote_max_connections_per_host(1),
+      max_simultaneous_creation(1),
+      max_pending_requests(CQL_POOL_PENDING_MAX),
+      grow_in_flight(CQL_POOL_GROW_IN_FLIGHT),
+      shrink_in_flight(CQL_POOL_SHRINK_IN_FLIGHT),
+      shrink_delay(CQL_POOL_SHRINK_DELAY)
+  {}
+};
+
+/**
+ * Decides when a pool should change size. The pool grows as soon as the
+ * average in flight per connection reaches the high water mark, but only
+ * shrinks once the load would fit under the low water mark with one
+ * connection less, and has done so for a full delay. The gap between the
+ * marks and the delay keep a pool from opening and closing the same
+ * connection as the load moves around a single threshold, and a pool
+ * sheds at most one connection per delay.
+ */
+class PoolSizer {
+ public:
+  enum Decision {
+    HOLD,
+    GROW,
+    SHRINK
+  };
+
+  PoolSizer(
+      size_t   grow_in_flight,
+      size_t   shrink_in_flight,
+      uint64_t shrink_delay) :
+      grow_in_flight_(grow_in_flight ? grow_in_flight : 1),
+      shrink_in_flight_(shrink_in_flight < grow_in_flight_
+                        ? shrink_in_flight
+                        : grow_in_flight_ - 1),
+      shrink_delay_(shrink_delay),
+      idle_(false),
+      idle_since_(0)
+  {}
+
+  /**
+   * @param now milliseconds
+   * @param in_flight requests in flight across the pool
+   * @param connections connections ready to take requests
+   * @param core the pool never shrinks below this
+   * @param max the pool never grows past this
+   *
+   * @return
+   */
+  Decision
+  update(
+      uint64_t now,
+      size_t   in_flight,
+      size_t   connections,
+      size_t   core,
+      size_t   max) {
+    if (connections == 0) {
+      idle_ = false;
+      return HOLD;
+    }
+
+    if (in_flight >= grow_in_flight_ * connections) {
+      idle_ = false;
+      return connections < max ? GROW : HOLD;
+    }
+
+    if (connections <= core
+        || in_flight > shrink_in_flight_ * (connections - 1)) {
+      idle_ = false;
+      return HOLD;
+    }
+
+    if (!idle_) {
+      idle_       = true;
+      idle_since_ = now;
+      return HOLD;
+    }
+
+    if (now - idle_since_ < shrink_delay_) {
+      return HOLD;
+    }
+    // the next connection has to wait out a delay of its own
+    idle_since_ = now;
+    return SHRINK;
+  }
+
+ private:
+  size_t   grow_in_flight_;
+  size_t   shrink_in_flight_;
+  uint64_t shrink_delay_;
+  bool     idle_;
+  uint64_t idle_since_;
+};
+
 class Pool {
-  typedef std::list<cql::ClientConnection*> ConnectionCollection;
-
-  uv_loop_t*           loop_;
-  SSLContext*          ssl_context_;
-  std::string          address_;
-  // HostDistance         distance_;
-  size_t               core_connections_per_host_;
-  size_t               max_connections_per_host_;
-  size_t               max_simultaneous_creation_;
-  ConnectionCollection connections_;
-  ConnectionCollection connections_pending_;
+  // hands the pool connections which never went through a handshake
+  friend struct PoolTest;
+
+  // indexed for random picks, the others are only walked
+  typedef std::vector<cql::ClientConnection*> ReadyCollection;
+  typedef std::list<cql::ClientConnection*>   ConnectionCollection;
+  typedef std::deque<QueuedRequest>           RequestCollection;
+
+  uv_loop_t*                   loop_;
+  SSLContext*                  ssl_context_;
+  ObjectPools*                 object_pools_;
+  TimingWheel*                 timing_wheel_;
+  CallbackBatch*               callback_batch_;
+  std::string                  address_;
+  // shared with the other IO loops' pools to the host
+  std::shared_ptr<HostLatency> latency_;
+  HostDistance                 distance_;
+  PoolOptions                  options_;
+  ReadyCollection              connections_;
+  ConnectionCollection         connections_pending_;
+  ConnectionCollection         connections_defunct_;
+  // requests waiting for a connection to come up
+  RequestCollection            requests_pending_;
+  // xorshift state for picking connections
+  uint64_t                     random_;
+  PoolSizer                    sizer_;
+  TimerNode                    maintenance_;
+  // shutting down, no new connections or requests
+  bool                         closing_;
 
  public:
   Pool(
       uv_loop_t*         loop,
       SSLContext*        ssl_context,
-      const std::string& address,
-//      HostDistance       distance,
-      size_t             core_connections_per_host,
-      size_t             max_connections_per_host,
-      size_t             max_simultaneous_creation = 1) :
+      ObjectPools*       object_pools,
+      TimingWheel*       timing_wheel,
+      CallbackBatch*     callback_batch,
+      const Host&        host,
+      HostDistance       distance,
+      const PoolOptions& options) :
       loop_(loop),
       ssl_context_(ssl_context),
-      address_(address),
-//      distance_(distance),
-      core_connections_per_host_(core_connections_per_host),
-      max_connections_per_host_(max_connections_per_host),
-      max_simultaneous_creation_(max_simultaneous_creation) {
-    for (size_t i = 0; i < core_connections_per_host_; ++i) {
+      object_pools_(object_pools),
+      timing_wheel_(timing_wheel),
+      callback_batch_(callback_batch),
+      address_(host.address),
+      latency_(host.latency),
+      distance_(distance),
+      options_(options),
+      random_(uv_hrtime() | 1),
+      sizer_(
+          options.grow_in_flight,
+          options.shrink_in_flight,
+          options.shrink_delay),
+      closing_(false) {
+    if (distance_ == REMOTE) {
+      options_.core_connections_per_host
+          = options_.remote_core_connections_per_host;
+      options_.max_connections_per_host
+          = options_.remote_max_connections_per_host;
+    }
+    options_.max_connections_per_host = std::max(
+        options_.max_connections_per_host,
+        options_.core_connections_per_host);
+
+    for (size_t i = 0; i < options_.core_connections_per_host; ++i) {
       spawn_connection();
     }
+
+    if (timing_wheel_) {
+      maintenance_.data = this;
+      timing_wheel_->schedule(
+          &maintenance_,
+          CQL_POOL_MAINTENANCE_INTERVAL,
+          Pool::on_maintenance);
+    }
   }
 
   void
   connect_callback(
       ClientConnection* connection,
       cql::Error*       error) {
+    ConnectionCollection::iterator it = std::find(
+        connections_pending_.begin(),
+        connections_pending_.end(),
+        connection);
+    if (it == connections_pending_.end()) {
+      // only the handshake is reported through here
+      delete error;
+      return;
+    }
+    connections_pending_.erase(it);
 
-    (void) connection;
-    (void) error;
+    if (closing_) {
+      // reap closes it
+      delete error;
+      connections_defunct_.push_back(connection);
+      return;
+    }
 
+    if (error) {
+      delete error;
+      connections_defunct_.push_back(connection);
+      connection->close();
+
+      if (connections_.empty() && connections_pending_.empty()) {
+        fail_pending("unable to connect to host");
+      }
+      return;
+    }
+
+    connections_.push_back(connection);
+    if (!options_.keyspace.empty()) {
+      // queued ahead of anything else on the connection
+      connection->set_keyspace(options_.keyspace);
+    }
+    execute_pending();
   }
 
   ~Pool() {
+    if (timing_wheel_) {
+      timing_wheel_->cancel(&maintenance_);
+    }
+    fail_pending("pool shut down");
     for (auto c : connections_) {
       delete c;
     }
+    for (auto c : connections_pending_) {
+      delete c;
+    }
+    for (auto c : connections_defunct_) {
+      delete c;
+    }
   }
 
   void
   prepare() {
   }
 
+  /**
+   * send a request on the least busy connection, the pool takes ownership
+   * of the message. if no connection is ready yet the request waits for
+   * one, unless the message is borrowed: its owner may complete and free
+   * the values bound to it before a connection comes up, so it fails
+   * instead.
+   *
+   * @param queued
+   */
   void
-  execute() {
+  execute(
+      const QueuedRequest& queued) {
+    if (closing_) {
+      fail(
+          queued,
+          new Error(
+              CQL_ERROR_SOURCE_LIBRARY,
+              CQL_ERROR_LIB_NO_HOSTS,
+              "pool shut down",
+              __FILE__,
+              __LINE__));
+      return;
+    }
+
+    ClientConnection* connection = NULL;
+    Error*            err        = borrow_connection(&connection);
+    if (err) {
+      fail(queued, err);
+      return;
+    }
+
+    if (!connection) {
+      if (queued.borrowed) {
+        fail(
+            queued,
+            new Error(
+                CQL_ERROR_SOURCE_LIBRARY,
+                CQL_ERROR_LIB_NO_HOSTS,
+                "no connection ready",
+                __FILE__,
+                __LINE__));
+        return;
+      }
+      if (requests_pending_.size() >= options_.max_pending_requests) {
+        fail(
+            queued,
+            new Error(
+                CQL_ERROR_SOURCE_LIBRARY,
+                CQL_ERROR_LIB_MAX_CONNECTIONS,
+                "too many requests waiting for a connection",
+                __FILE__,
+                __LINE__));
+        return;
+      }
+      requests_pending_.push_back(queued);
+      return;
+    }
+    send(connection, queued);
+  }
+
+  /**
+   * whether the pool has a connection up, a pool without one can only
+   * queue requests until a connection is made
+   *
+   * @return
+   */
+  inline bool
+  is_connected() {
+    return !connections_.empty();
   }
 
+  inline HostDistance
+  distance() {
+    return distance_;
+  }
+
+  /**
+   * stop taking requests and close every connection once the requests
+   * on it are answered. connections still being opened are closed when
+   * they finish. the pool can be deleted once is_closed.
+   */
   void
   shutdown() {
+    if (closing_) {
+      return;
+    }
+    closing_ = true;
+    fail_pending("pool shut down");
+    connections_defunct_.insert(
+        connections_defunct_.end(),
+        connections_.begin(),
+        connections_.end());
+    connections_.clear();
+    reap();
+  }
+
+  /**
+   * shut down without waiting on anything, every connection is closed
+   * and the requests on it fail. the pool can be deleted once is_closed,
+   * which takes maintain() calls to notice.
+   */
+  void
+  close() {
+    shutdown();
+    connections_defunct_.insert(
+        connections_defunct_.end(),
+        connections_pending_.begin(),
+        connections_pending_.end());
+    connections_pending_.clear();
+    for (ConnectionCollection::iterator it = connections_defunct_.begin();
+         it != connections_defunct_.end();
+         ++it) {
+      (*it)->close();
+    }
+  }
+
+  inline bool
+  is_closed() {
+    return closing_
+        && connections_pending_.empty()
+        && connections_defunct_.empty();
+  }
+
+  /**
+   * drop connections which have gone away, then grow or shrink the pool
+   * to the load. runs off the timing wheel every
+   * CQL_POOL_MAINTENANCE_INTERVAL.
+   *
+   * @param now milliseconds
+   */
+  void
+  maintain(
+      uint64_t now) {
+    reap();
+    if (closing_) {
+      return;
+    }
+
+    size_t in_flight = 0;
+    for (ReadyCollection::iterator it = connections_.begin();
+         it != connections_.end();
+         ++it) {
+      in_flight += (*it)->in_flight();
+    }
+
+    switch (sizer_.update(
+                now,
+                in_flight,
+                connections_.size(),
+                options_.core_connections_per_host,
+                options_.max_connections_per_host)) {
+      case PoolSizer::GROW:
+        maybe_spawn_connection();
+        break;
+      case PoolSizer::SHRINK:
+        retire_connection();
+        break;
+      case PoolSizer::HOLD:
+        break;
+    }
+
+    // replace connections which dropped
+    if (connections_.size() + connections_pending_.size()
+        < options_.core_connections_per_host) {
+      maybe_spawn_connection();
+    }
   }
 
   void
@@ -96,61 +478,131 @@ class Pool {
   spawn_connection() {
     ClientConnection* connection = new ClientConnection(
         loop_,
-        ssl_context_ ? ssl_context_->session_new() : NULL);
+        ssl_context_ ? ssl_context_->session_new() : NULL,
+        object_pools_,
+        timing_wheel_,
+        callback_batch_);
+
+    connection->hostname_    = address_;
+    connection->port_        = options_.port;
+    connection->cql_version_ = options_.cql_version;
+    connection->compression(
+        static_cast<ClientConnection::Compression>(options_.compression));
+    connection->protocol_version(options_.protocol_version);
+    connection->request_timeout(options_.request_timeout);
+    connection->host_latency(latency_.get());
 
+    // the connection can report back before init returns
+    connections_pending_.push_back(connection);
     connection->init(
         std::bind(
             &Pool::connect_callback,
             this,
             std::placeholders::_1,
             std::placeholders::_2));
-
-    connections_pending_.push_back(connection);
   }
 
   void
   maybe_spawn_connection() {
-    if (connections_pending_.size() >= max_simultaneous_creation_) {
+    if (connections_pending_.size() >= options_.max_simultaneous_creation) {
       return;
     }
 
     if (connections_.size() + connections_pending_.size()
-        >= max_connections_per_host_) {
+        >= options_.max_connections_per_host) {
       return;
     }
 
     spawn_connection();
   }
 
-  static bool
-  least_busy_comp(
-      ClientConnection* a,
-      ClientConnection* b) {
-    return a->available_streams() < b->available_streams();
+  static inline bool
+  usable(
+      ClientConnection* connection) {
+    return connection->is_ready() && connection->available_streams();
+  }
+
+  /**
+   * expected wait on a connection, the requests ahead of this one times
+   * how long each tends to take. a connection without samples yet costs
+   * the same as a fast one so it gets tried.
+   *
+   * @param connection
+   *
+   * @return
+   */
+  static inline uint64_t
+  cost(
+      ClientConnection* connection) {
+    return (connection->in_flight() + 1) * (connection->latency() + 1);
   }
 
+  /**
+   * power of two choices, compare two connections picked at random and
+   * take the cheaper. keeps load close to the best of a full scan without
+   * touching every connection, and a socket which has gone slow loses
+   * most comparisons instead of getting an equal share.
+   *
+   * @return NULL if no connection has a free stream
+   */
   ClientConnection*
   find_least_busy() {
-    ConnectionCollection::iterator it =
-        std::max_element(
-            connections_.begin(),
-            connections_.end(),
-            Pool::least_busy_comp);
-    if ((*it)->available_streams()) {
-      return *it;
+    size_t count = connections_.size();
+    if (count == 0) {
+      return NULL;
+    }
+
+    if (count == 1) {
+      return usable(connections_[0]) ? connections_[0] : NULL;
+    }
+
+    size_t first  = next_random() % count;
+    size_t second = next_random() % (count - 1);
+    if (second >= first) {
+      ++second;
+    }
+
+    ClientConnection* a = connections_[first];
+    ClientConnection* b = connections_[second];
+    if (usable(a) && usable(b)) {
+      return cost(a) <= cost(b) ? a : b;
+    } else if (usable(a)) {
+      return a;
+    } else if (usable(b)) {
+      return b;
+    }
+
+    // both picks full or closing, rare enough to pay for a scan
+    ClientConnection* best = NULL;
+    for (ReadyCollection::iterator it = connections_.begin();
+         it != connections_.end();
+         ++it) {
+      if (usable(*it) && (!best || cost(*it) < cost(best))) {
+        best = *it;
+      }
     }
-    return nullptr;
+    return best;
   }
 
+  /**
+   * find a connection with a free stream. output is NULL without an error
+   * if a connection is on its way
+   *
+   * @param output
+   *
+   * @return
+   */
   Error*
   borrow_connection(
       ClientConnection** output) {
     *output = find_least_busy();
-    if (output) {
+    if (*output) {
       return CQL_ERROR_NO_ERROR;
     }
 
-    if (connections_.size() >= max_connections_per_host_) {
+    maybe_spawn_connection();
+    if (connections_pending_.empty()
+        && connections_.size() >= options_.max_connections_per_host) {
       return new Error(
           CQL_ERROR_SOURCE_LIBRARY,
           CQL_ERROR_LIB_MAX_CONNECTIONS,
@@ -159,10 +611,145 @@ class Pool {
           __LINE__);
     }
 
+    if (connections_pending_.empty() && connections_.empty()) {
+      return new Error(
+          CQL_ERROR_SOURCE_LIBRARY,
+          CQL_ERROR_LIB_NO_HOSTS,
+          "unable to connect to host",
+          __FILE__,
+          __LINE__);
+    }
     return CQL_ERROR_NO_ERROR;
   }
 
+ private:
+  void
+  send(
+      ClientConnection*    connection,
+      const QueuedRequest& queued) {
+    Error* err = connection->send_message(queued.message, queued.request);
+    if (!queued.borrowed) {
+      delete queued.message;
+    }
+    if (err) {
+      queued.request->error = err;
+      queued.request->notify(loop_);
+    }
+  }
+
+  static void
+  on_maintenance(
+      TimerNode* timer) {
+    Pool* pool = reinterpret_cast<Pool*>(timer->data);
+    pool->maintain(pool->timing_wheel_->now());
+    pool->timing_wheel_->schedule(
+        timer,
+        CQL_POOL_MAINTENANCE_INTERVAL,
+        Pool::on_maintenance);
+  }
+
+  /**
+   * move connections which are no longer ready out of the way of new
+   * requests, close retired ones once they've answered everything and
+   * free closed ones once nothing waits on them
+   */
+  void
+  reap() {
+    for (size_t i = 0; i < connections_.size();) {
+      if (connections_[i]->is_ready()) {
+        ++i;
+        continue;
+      }
+      connections_defunct_.push_back(connections_[i]);
+      connections_[i] = connections_.back();
+      connections_.pop_back();
+    }
+
+    ConnectionCollection::iterator it = connections_defunct_.begin();
+    while (it != connections_defunct_.end()) {
+      ClientConnection* connection = *it;
+      if (connection->waiting_requests()) {
+        // retired connections answer what they were sent first, closed
+        // ones have already failed their requests
+        ++it;
+      } else if (connection->is_closed()) {
+        delete connection;
+        it = connections_defunct_.erase(it);
+      } else {
+        connection->close();
+        ++it;
+      }
+    }
+  }
+
+  /**
+   * stop sending to the least loaded connection, reap closes it once its
+   * requests are answered
+   */
+  void
+  retire_connection() {
+    if (connections_.empty()) {
+      return;
+    }
+
+    size_t idle = 0;
+    for (size_t i = 1; i < connections_.size(); ++i) {
+      if (connections_[i]->in_flight() < connections_[idle]->in_flight()) {
+        idle = i;
+      }
+    }
 
+    connections_defunct_.push_back(connections_[idle]);
+    connections_[idle] = connections_.back();
+    connections_.pop_back();
+  }
+
+  inline uint64_t
+  next_random() {
+    random_ ^= random_ << 13;
+    random_ ^= random_ >> 7;
+    random_ ^= random_ << 17;
+    return random_;
+  }
+
+  void
+  fail(
+      const QueuedRequest& queued,
+      Error*               err) {
+    if (!queued.borrowed) {
+      delete queued.message;
+    }
+    queued.request->error = err;
+    queued.request->notify(loop_);
+  }
+
+  void
+  execute_pending() {
+    while (!requests_pending_.empty()) {
+      ClientConnection* connection = find_least_busy();
+      if (!connection) {
+        return;
+      }
+      send(connection, requests_pending_.front());
+      requests_pending_.pop_front();
+    }
+  }
+
+  void
+  fail_pending(
+      const char* message) {
+    while (!requests_pending_.empty()) {
+      fail(
+          requests_pending_.front(),
+          new Error(
+              CQL_ERROR_SOURCE_LIBRARY,
+              CQL_ERROR_LIB_NO_HOSTS,
+              message,
+              __FILE__,
+              __LINE__));
+      requests_pending_.pop_front();
+    }
+  }
 };
 }
 #endif
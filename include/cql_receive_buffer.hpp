@@ -0,0 +1,246 @@
+/*
+  Copyright 2014 DataStax
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef __CQL_RECEIVE_BUFFER_HPP_INCLUDED__
+#define __CQL_RECEIVE_BUFFER_HPP_INCLUDED__
+
+#include <uv.h>
+#include <vector>
+
+#include "cql_ref_buffer.hpp"
+
+#define CQL_RECEIVE_BUFFER_MIN_SIZE  65536
+#define CQL_RECEIVE_BUFFER_MAX_SIZE  16777216
+#define CQL_RECEIVE_BUFFER_MIN_READ  4096
+#define CQL_RECEIVE_BUFFER_SPARES    4
+#define CQL_RECEIVE_BUFFER_WINDOW    16
+
+namespace cql {
+
+/**
+ * Per connection receive space. Reads are appended to the tail of the
+ * current block, when the tail gets too small the ring moves on to a
+ * block which is no longer referenced by any in place decoded message.
+ * Blocks are only allocated when every block in the ring is still
+ * pinned by outstanding messages, or when the block size changes.
+ *
+ * The block size adapts to the traffic: it grows so that the largest
+ * observed frame fits twice into a block, and halves after a window of
+ * rotations in which no frame needed more than a quarter of it. An idle
+ * connection shrinks straight back to the minimum, see shrink().
+ *
+ * Not thread safe, owned by the IO loop of the connection.
+ */
+class ReceiveBuffer {
+ public:
+  ReceiveBuffer(
+      size_t min_size = CQL_RECEIVE_BUFFER_MIN_SIZE,
+      size_t max_size = CQL_RECEIVE_BUFFER_MAX_SIZE) :
+      min_size_(min_size),
+      max_size_(max_size),
+      block_size_(min_size),
+      current_(NULL),
+      offset_(0),
+      largest_frame_(0),
+      rotations_(0),
+      allocations_(0)
+  {}
+
+  ~ReceiveBuffer() {
+    if (current_) {
+      current_->release();
+    }
+
+    for (std::vector<RefBuffer*>::iterator it = spares_.begin();
+         it != spares_.end();
+         ++it) {
+      (*it)->release();
+    }
+  }
+
+  /**
+   * space for the next read, called from the libuv alloc callback
+   *
+   * @return
+   */
+  uv_buf_t
+  allocate() {
+    if (!current_
+        || current_->size() - offset_ < CQL_RECEIVE_BUFFER_MIN_READ) {
+      rotate();
+    }
+    return uv_buf_init(current_->data() + offset_, current_->size() - offset_);
+  }
+
+  /**
+   * mark nread bytes of the last allocation as used
+   *
+   * @param nread
+   *
+   * @return the block the data was read into
+   */
+  RefBuffer*
+  commit(
+      size_t nread) {
+    offset_ += nread;
+    return current_;
+  }
+
+  /**
+   * record the size of a received frame, used to size future blocks
+   *
+   * @param size
+   */
+  inline void
+  observe_frame(
+      size_t size) {
+    if (size > largest_frame_) {
+      largest_frame_ = size;
+    }
+  }
+
+  /**
+   * drop back to the default block size once nothing is buffered and no
+   * message points into the ring anymore, so a burst of large frames
+   * doesn't pin oversized blocks for the life of an idle connection
+   *
+   * @return true if the buffer was shrunk
+   */
+  bool
+  shrink() {
+    if (block_size_ <= min_size_
+        || (current_ && current_->ref_count() != 1)) {
+      return false;
+    }
+
+    for (std::vector<RefBuffer*>::iterator it = spares_.begin();
+         it != spares_.end();
+         ++it) {
+      if ((*it)->ref_count() != 1) {
+        return false;
+      }
+    }
+
+    if (current_) {
+      current_->release();
+      current_ = NULL;
+    }
+
+    for (std::vector<RefBuffer*>::iterator it = spares_.begin();
+         it != spares_.end();
+         ++it) {
+      (*it)->release();
+    }
+    spares_.clear();
+
+    block_size_    = min_size_;
+    offset_        = 0;
+    rotations_     = 0;
+    largest_frame_ = 0;
+    return true;
+  }
+
+  inline size_t
+  block_size() {
+    return block_size_;
+  }
+
+  inline size_t
+  allocations() {
+    return allocations_;
+  }
+
+ private:
+  void
+  resize() {
+    size_t wanted = block_size_;
+    while (wanted < largest_frame_ * 2 && wanted < max_size_) {
+      wanted *= 2;
+    }
+
+    if (wanted == block_size_ && ++rotations_ >= CQL_RECEIVE_BUFFER_WINDOW) {
+      if (largest_frame_ * 4 < block_size_ && block_size_ > min_size_) {
+        wanted = block_size_ / 2;
+      }
+      rotations_     = 0;
+      largest_frame_ = 0;
+    }
+
+    if (wanted != block_size_) {
+      block_size_    = wanted;
+      rotations_     = 0;
+      largest_frame_ = 0;
+    }
+  }
+
+  void
+  rotate() {
+    resize();
+    offset_ = 0;
+
+    if (current_) {
+      if (current_->ref_count() == 1 && current_->size() == block_size_) {
+        // nobody is pointing into it anymore, start over from the top
+        return;
+      }
+      spares_.push_back(current_);
+      current_ = NULL;
+    }
+
+    for (std::vector<RefBuffer*>::iterator it = spares_.begin();
+         it != spares_.end();) {
+      RefBuffer* block = *it;
+      if (block->ref_count() != 1) {
+        ++it;
+      } else if (block->size() != block_size_) {
+        block->release();
+        it = spares_.erase(it);
+      } else if (!current_) {
+        current_ = block;
+        it = spares_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    // let go of blocks that are pinned for longer than the ring can hold,
+    // the last message referencing them will free them
+    while (spares_.size() > CQL_RECEIVE_BUFFER_SPARES) {
+      spares_.front()->release();
+      spares_.erase(spares_.begin());
+    }
+
+    if (!current_) {
+      ++allocations_;
+      current_ = new RefBuffer(new char[block_size_], block_size_);
+    }
+  }
+
+  size_t                  min_size_;
+  size_t                  max_size_;
+  size_t                  block_size_;
+  RefBuffer*              current_;
+  size_t                  offset_;
+  std::vector<RefBuffer*> spares_;
+  size_t                  largest_frame_;
+  size_t                  rotations_;
+  size_t                  allocations_;
+
+  ReceiveBuffer(const ReceiveBuffer&) {}
+  void operator=(const ReceiveBuffer&) {}
+};
+}
+#endif
@@ -0,0 +1,87 @@
+/*
+  Copyright 2014 DataStax
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef __CQL_REF_BUFFER_HPP_INCLUDED__
+#define __CQL_REF_BUFFER_HPP_INCLUDED__
+
+#include <atomic>
+#include <stddef.h>
+
+namespace cql {
+
+/**
+ * A reference counted read buffer. Messages which are decoded in place
+ * hold a reference to the buffer they point into, the buffer is freed
+ * when the last reference is released. References may be released from
+ * any thread.
+ */
+class RefBuffer {
+ public:
+  /**
+   * take ownership of a buffer allocated with new char[]
+   *
+   * @param data
+   * @param size
+   */
+  RefBuffer(
+      char*  data,
+      size_t size) :
+      data_(data),
+      size_(size),
+      ref_count_(1)
+  {}
+
+  inline char*
+  data() {
+    return data_;
+  }
+
+  inline size_t
+  size() {
+    return size_;
+  }
+
+  inline int
+  ref_count() {
+    return ref_count_.load(std::memory_order_acquire);
+  }
+
+  inline void
+  retain() {
+    ref_count_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  inline void
+  release() {
+    if (ref_count_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete this;
+    }
+  }
+
+ private:
+  ~RefBuffer() {
+    delete[] data_;
+  }
+
+  char*            data_;
+  size_t           size_;
+  std::atomic<int> ref_count_;
+
+  RefBuffer(const RefBuffer&) {}
+  void operator=(const RefBuffer&) {}
+};
+}
+#endif
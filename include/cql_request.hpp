@@ -18,38 +18,53 @@
 #define __REQUEST_HPP_INCLUDED__
 
 #include <atomic>
+#include <chrono>
 #include <uv.h>
 
+#include "cql_callback_executor.hpp"
+#include "cql_completion.hpp"
+#include "cql_object_pool.hpp"
+#include "cql_timing_wheel.hpp"
+
 namespace cql {
 
 template<typename Data,
          typename Error,
          typename Result>
-struct Request {
+struct Request
+    : public PoolAllocated {
   typedef std::function<void(Request<Data, Error, Result>*)> Callback;
 
-  std::atomic<bool>       flag;
-  std::mutex              mutex;
-  std::condition_variable condition;
+  Completion              completion;
   Error                   error;
   Data                    data;
   Result                  result;
   Callback                callback;
   bool                    use_local_loop;
+  // set by the IO loop the request runs on, NULL falls back to the libuv
+  // threadpool
+  CallbackBatch*          callback_batch;
   uv_work_t               uv_work_req;
+  // milliseconds to wait for the response, 0 uses the connection default
+  uint64_t                timeout;
+  // uv_hrtime when the request went out, for the connection's latency
+  uint64_t                start_time;
+  TimerNode               timer;
 
   Request() :
-      flag(false),
       error(CQL_ERROR_NO_ERROR),
-      data(NULL),
+      data(),
       result(NULL),
       callback(NULL),
-      use_local_loop(false)
+      use_local_loop(false),
+      callback_batch(NULL),
+      timeout(0),
+      start_time(0)
   {}
 
   bool
   ready() {
-    return flag.load(std::memory_order_consume);
+    return completion.ready();
   }
 
   /**
@@ -67,12 +82,19 @@ struct Request {
   void
   notify(
       uv_loop_t* loop) {
-    flag.store(true, std::memory_order_release);
-    condition.notify_all();
+    // a waiter may delete the request as soon as it completes, so
+    // nothing but the callback path may touch it afterwards
+    bool has_callback = static_cast<bool>(callback);
+    // no system call unless a thread is asleep in wait
+    completion.complete();
 
-    if (callback) {
+    if (has_callback) {
       if (use_local_loop) {
         callback(this);
+      } else if (callback_batch) {
+        callback_batch->add(
+            &Request<Data, Error, Result>::callback_task,
+            this);
       } else {
         // we execute the callback in a separate thread so that badly
         // behaving client code can't interfere with event/network handling
@@ -91,12 +113,7 @@ struct Request {
    */
   void
   wait() {
-    if (!flag.load(std::memory_order_consume)) {
-      std::unique_lock<std::mutex> lock(mutex);
-      condition.wait(
-          lock,
-          std::bind(&Request<Data, Error, Result>::ready, this));
-    }
+    completion.wait();
   }
 
   /**
@@ -111,16 +128,21 @@ struct Request {
   bool
   wait_for(
       const std::chrono::duration<Rep, Period>& time) {
-    if (!flag.load(std::memory_order_consume)) {
-      std::unique_lock<std::mutex> lock(mutex);
-      return condition.wait_for(
-          lock,
-          time,
-          std::bind(&Request<Data, Error, Result>::ready, this));
-    }
+    std::chrono::microseconds us
+        = std::chrono::duration_cast<std::chrono::microseconds>(time);
+    // 0 would mean forever
+    return completion.wait_for(us.count() > 0 ? us.count() : 1);
   }
 
  private:
+  static void
+  callback_task(
+      void* data) {
+    Request<Data, Error, Result>* request
+        = reinterpret_cast<Request<Data, Error, Result>*>(data);
+    request->callback(request);
+  }
+
   /**
    * Called by the libuv worker thread, and this method calls the callback
    * this is done to isolate customer code from ours
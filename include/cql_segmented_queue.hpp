@@ -0,0 +1,297 @@
+/*
+  Copyright 2014 DataStax
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef __CQL_SEGMENTED_QUEUE_HPP_INCLUDED__
+#define __CQL_SEGMENTED_QUEUE_HPP_INCLUDED__
+
+#include <atomic>
+#include <mutex>
+#include <new>
+
+#include "cql_mpmc_queue.hpp"
+#include "cql_object_pool.hpp"
+
+// items per overflow segment
+#define CQL_QUEUE_SEGMENT_SIZE 256
+// free segments kept around for the next burst
+#define CQL_QUEUE_SEGMENT_POOL 16
+
+namespace cql {
+
+/**
+ * A bounded MpmcQueue which, when overflow is enabled, never refuses an
+ * item. Once the ring is full further items go to a linked list of
+ * fixed size segments, allocated from an ObjectPool, and consumers move
+ * them back into the ring as it empties. While anything is in overflow
+ * producers append there too, so a producer's items stay in order.
+ *
+ * The ring is lock free; the overflow list is guarded by a mutex, which
+ * is only touched during a burst. With overflow disabled this behaves
+ * exactly like MpmcQueue.
+ */
+template<typename T,
+         size_t   SegmentSize = CQL_QUEUE_SEGMENT_SIZE>
+class SegmentedMpmcQueue {
+ public:
+  SegmentedMpmcQueue(
+      size_t size,
+      bool   overflow = true) :
+      ring_(size),
+      ring_size_(size),
+      overflow_enabled_(overflow),
+      segment_pool_(sizeof(Segment), CQL_QUEUE_SEGMENT_POOL),
+      head_(NULL),
+      tail_(NULL),
+      overflow_size_(0),
+      overflows_(0),
+      overflow_peak_(0)
+  {}
+
+  ~SegmentedMpmcQueue() {
+    while (head_) {
+      Segment* segment = head_;
+      head_ = segment->next;
+      release_segment(segment);
+    }
+  }
+
+  bool
+  enqueue(
+      const T& data) {
+    if (!overflow_enabled_) {
+      return ring_.enqueue(data);
+    }
+
+    if (overflow_size_.load(std::memory_order_acquire) == 0
+        && ring_.enqueue(data)) {
+      return true;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    // consumers may have drained the overflow since we looked
+    if (overflow_size_.load(std::memory_order_relaxed) == 0
+        && ring_.enqueue(data)) {
+      return true;
+    }
+    push_locked(data);
+    return true;
+  }
+
+  bool
+  dequeue(
+      T& data) {
+    if (ring_.dequeue(data)) {
+      maybe_refill();
+      return true;
+    }
+
+    if (overflow_size_.load(std::memory_order_acquire) == 0) {
+      return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    bool found = ring_.dequeue(data) || pop_locked(data);
+    refill_locked();
+    return found;
+  }
+
+  /**
+   * take up to max items, older items in the ring first
+   *
+   * @param output
+   * @param max
+   *
+   * @return
+   */
+  size_t
+  try_dequeue_up_to(
+      T*     output,
+      size_t max) {
+    size_t count = ring_.try_dequeue_up_to(output, max);
+    if (overflow_size_.load(std::memory_order_acquire) == 0) {
+      return count;
+    }
+
+    if (count < max) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      while (count < max && pop_locked(output[count])) {
+        ++count;
+      }
+      refill_locked();
+    } else {
+      maybe_refill();
+    }
+    return count;
+  }
+
+  inline size_t
+  size_approx() {
+    return ring_.size_approx()
+        + overflow_size_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * items currently waiting in overflow segments
+   *
+   * @return
+   */
+  inline size_t
+  overflow_size() {
+    return overflow_size_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * number of items which didn't fit in the ring
+   *
+   * @return
+   */
+  inline size_t
+  overflows() {
+    return overflows_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * the most items ever waiting in overflow at once
+   *
+   * @return
+   */
+  inline size_t
+  overflow_peak() {
+    return overflow_peak_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * segments that had to come from the heap rather than the free list
+   *
+   * @return
+   */
+  inline size_t
+  segments_allocated() {
+    return segment_pool_.misses();
+  }
+
+ private:
+  struct Segment {
+    Segment* next;
+    size_t   head;
+    size_t   tail;
+    T        items[SegmentSize];
+
+    Segment() :
+        next(NULL),
+        head(0),
+        tail(0)
+    {}
+  };
+
+  void
+  push_locked(
+      const T& data) {
+    if (!tail_ || tail_->tail == SegmentSize) {
+      Segment* segment = new (ObjectPool::allocate(
+          &segment_pool_,
+          sizeof(Segment))) Segment();
+      if (tail_) {
+        tail_->next = segment;
+      } else {
+        head_ = segment;
+      }
+      tail_ = segment;
+    }
+
+    tail_->items[tail_->tail++] = data;
+    size_t size = overflow_size_.fetch_add(1, std::memory_order_release) + 1;
+    overflows_.fetch_add(1, std::memory_order_relaxed);
+    if (size > overflow_peak_.load(std::memory_order_relaxed)) {
+      overflow_peak_.store(size, std::memory_order_relaxed);
+    }
+  }
+
+  bool
+  pop_locked(
+      T& data) {
+    if (!head_) {
+      return false;
+    }
+    data = head_->items[head_->head];
+    advance_locked();
+    return true;
+  }
+
+  void
+  advance_locked() {
+    ++head_->head;
+    overflow_size_.fetch_sub(1, std::memory_order_release);
+    if (head_->head == head_->tail) {
+      Segment* segment = head_;
+      head_ = segment->next;
+      if (!head_) {
+        tail_ = NULL;
+      }
+      release_segment(segment);
+    }
+  }
+
+  /**
+   * move overflow back into the ring, oldest first, until either runs out
+   */
+  void
+  refill_locked() {
+    while (head_ && ring_.enqueue(head_->items[head_->head])) {
+      advance_locked();
+    }
+  }
+
+  /**
+   * refill once the ring is half empty, without waiting for a producer
+   * holding the lock
+   */
+  void
+  maybe_refill() {
+    if (overflow_size_.load(std::memory_order_relaxed) == 0
+        || ring_.size_approx() > ring_size_ / 2) {
+      return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
+    if (lock.owns_lock()) {
+      refill_locked();
+    }
+  }
+
+  void
+  release_segment(
+      Segment* segment) {
+    segment->~Segment();
+    ObjectPool::release(segment);
+  }
+
+  MpmcQueue<T>        ring_;
+  const size_t        ring_size_;
+  const bool          overflow_enabled_;
+  ObjectPool          segment_pool_;
+  std::mutex          mutex_;
+  Segment*            head_;
+  Segment*            tail_;
+  std::atomic<size_t> overflow_size_;
+  std::atomic<size_t> overflows_;
+  std::atomic<size_t> overflow_peak_;
+
+  SegmentedMpmcQueue(const SegmentedMpmcQueue&) {}
+  void operator=(const SegmentedMpmcQueue&) {}
+};
+}
+#endif
@@ -20,6 +20,7 @@
 #include <list>
 #include <map>
 #include <string>
+#include <vector>
 
 namespace cql {
 
@@ -184,6 +185,57 @@ decode_string_multimap(
   return buffer;
 }
 
+/**
+ * decode a list or set of strings from a column value, checking every
+ * length against the value's size
+ *
+ * @param input
+ * @param size
+ * @param int_lengths protocol v3 counts elements and sizes with ints,
+ *   earlier versions with shorts
+ * @param output appended to
+ *
+ * @return false if the value is truncated
+ */
+inline bool
+decode_string_collection(
+    const char*               input,
+    size_t                    size,
+    bool                      int_lengths,
+    std::vector<std::string>& output) {
+  const unsigned char* buffer = reinterpret_cast<const unsigned char*>(input);
+  const unsigned char* end    = buffer + size;
+  size_t               width  = int_lengths ? 4 : 2;
+
+  if (static_cast<size_t>(end - buffer) < width) {
+    return false;
+  }
+
+  int32_t count = 0;
+  for (size_t i = 0; i < width; ++i) {
+    count = (count << 8) | *(buffer++);
+  }
+
+  for (int32_t i = 0; i < count; ++i) {
+    if (static_cast<size_t>(end - buffer) < width) {
+      return false;
+    }
+
+    int32_t length = 0;
+    for (size_t j = 0; j < width; ++j) {
+      length = (length << 8) | *(buffer++);
+    }
+    if (length < 0 || end - buffer < length) {
+      return false;
+    }
+
+    output.push_back(
+        std::string(reinterpret_cast<const char*>(buffer), length));
+    buffer += length;
+  }
+  return true;
+}
+
 inline char*
 decode_option(
     char*    input,
@@ -18,44 +18,534 @@
 #define __SESSION_HPP_INCLUDED__
 
 #include <uv.h>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
-#include "cql_mpmc_queue.hpp"
+#include "cql_segmented_queue.hpp"
+#include "cql_callback_executor.hpp"
+#include "cql_control_connection.hpp"
+#include "cql_load_balancing.hpp"
+#include "cql_metadata.hpp"
+#include "cql_murmur3.hpp"
 #include "cql_pool.hpp"
 #include "cql_request.hpp"
+#include "cql_speculative_execution.hpp"
+
+// requests an IO loop takes off its queue before giving its sockets a turn
+#define CQL_SESSION_DRAIN_BATCH 128
+// per IO loop, must be a power of two
+#define CQL_SESSION_QUEUE_SIZE  4096
+// a sibling's queue has to be at least this deep before it's worth stealing
+#define CQL_SESSION_STEAL_MIN   32
 
 namespace cql {
 
+class Cluster;
+
 class Session {
+  friend class Cluster;
+  // drives IO loops which aren't running
+  friend struct SessionTest;
+
   struct IOWorker {
     typedef std::shared_ptr<cql::Pool>  PoolPtr;
     typedef std::unordered_map<std::string, PoolPtr> PoolCollection;
+    typedef SpeculativeExecution::TargetCollection   TargetCollection;
 
-    uv_thread_t    thread;
-    uv_loop_t*     loop;
-    SSLContext*    ssl_context;
-    PoolCollection pools;
+    Session*                          session;
+    size_t                            index;
+    uv_thread_t                       thread;
+    uv_loop_t*                        loop;
+    SSLContext*                       ssl_context;
+    ObjectPools                       object_pools;
+    // request timeouts for every connection on the loop
+    TimingWheel                       timing_wheel;
+    PoolCollection                    pools;
+    // pools of hosts which left the cluster, freed once their
+    // connections close
+    std::list<PoolPtr>                pools_closing;
+    PoolOptions                       pool_options;
+    // the metadata version pools were last matched to
+    size_t                            pools_version;
+    // only on the first loop
+    ControlConnection*                control;
+    // nothing left to drain or steal, a busy sibling wakes it to steal
+    std::atomic<bool>                 idle;
+    // the sibling woken last, wakeups go round the others in turn
+    size_t                            next_sibling;
+    // requests submitted to this loop, siblings steal from it when it
+    // falls behind
+    SegmentedMpmcQueue<QueuedRequest> queue;
+    QueuedRequest                     batch[CQL_SESSION_DRAIN_BATCH];
+    // wakes the loop when requests are queued or the session shuts down
+    uv_async_t                        wake;
+    // threads inside uv_async_send, the handle is only closed once
+    // there are none and no more can get in
+    std::atomic<size_t>               wakers;
+    std::atomic<bool>                 wake_closed;
+    // set by Session::shutdown once nothing more can be queued
+    std::atomic<bool>                 stopping;
+    // the loop is closing its pools and handles
+    bool                              closing;
+    // polls the pools and the control connection until they're closed
+    TimerNode                         closing_timer;
+    // callbacks completed during one loop iteration, handed over at the
+    // end of it
+    CallbackBatch                     callbacks;
+    uv_check_t                        flush_callbacks;
+    // reused for every request dispatched
+    std::vector<char>                 routing_key;
+    QueryPlan                         plan;
+    TargetCollection                  targets;
+    // speculative executions still running, failed on shutdown
+    SpeculativeExecution::Collection  executions;
 
-    IOWorker() :
-        loop(uv_loop_new())
-    {}
+    IOWorker(
+        Session* session,
+        size_t   index,
+        bool     queue_overflow) :
+        session(session),
+        index(index),
+        loop(uv_loop_new()),
+        ssl_context(NULL),
+        timing_wheel(loop),
+        pools_version(0),
+        control(NULL),
+        idle(true),
+        next_sibling(index),
+        queue(CQL_SESSION_QUEUE_SIZE, queue_overflow),
+        wakers(0),
+        wake_closed(false),
+        stopping(false),
+        closing(false),
+        callbacks(session->callback_executor_) {
+      closing_timer.data = this;
+      wake.data = this;
+      uv_async_init(loop, &wake, IOWorker::on_wake);
+      flush_callbacks.data = this;
+      uv_check_init(loop, &flush_callbacks);
+      uv_check_start(&flush_callbacks, IOWorker::on_check);
+    }
 
     void
     add_pool(
-        const std::string& host,
-        size_t             core_connections_per_host,
-        size_t             max_connections_per_host) {
-      pools.insert(
-          std::make_pair(
+        const Host&        host,
+        HostDistance       distance,
+        const PoolOptions& options) {
+      PoolPtr pool(
+          new cql::Pool(
+              loop,
+              ssl_context,
+              &object_pools,
+              &timing_wheel,
+              &callbacks,
               host,
-              PoolPtr(
-                  new cql::Pool(
-                      loop,
-                      ssl_context,
-                      host,
-                      core_connections_per_host,
-                      max_connections_per_host))));
+              distance,
+              options));
+      pools[host.address] = pool;
+    }
+
+    static void
+    on_wake(
+        uv_async_t* handle,
+        int         status) {
+      (void) status;
+      IOWorker* worker = reinterpret_cast<IOWorker*>(handle->data);
+      worker->drain();
+    }
+
+    static void
+    on_check(
+        uv_check_t* handle,
+        int         status) {
+      (void) status;
+      IOWorker* worker = reinterpret_cast<IOWorker*>(handle->data);
+      worker->callbacks.flush();
+      if (!worker->pools_closing.empty()) {
+        worker->reap_pools();
+      }
+    }
+
+    /**
+     * open pools to hosts which joined the cluster and shut down the pools
+     * of hosts which left it or which the policy now ignores. a host whose
+     * distance changed gets a new pool sized for it.
+     */
+    void
+    sync_pools() {
+      pools_version = session->metadata_version_.load(
+          std::memory_order_acquire);
+      std::shared_ptr<const Metadata> metadata = session->metadata();
+
+      const std::vector<Host>& hosts = metadata->hosts();
+      for (std::vector<Host>::const_iterator it = hosts.begin();
+           it != hosts.end();
+           ++it) {
+        HostDistance distance = session->policy_->distance(*metadata, *it);
+        if (distance == IGNORED) {
+          continue;
+        }
+
+        PoolCollection::iterator pool = pools.find(it->address);
+        if (pool == pools.end()) {
+          add_pool(*it, distance, pool_options);
+        } else if (pool->second->distance() != distance) {
+          pool->second->shutdown();
+          pools_closing.push_back(pool->second);
+          add_pool(*it, distance, pool_options);
+        }
+      }
+
+      PoolCollection::iterator it = pools.begin();
+      while (it != pools.end()) {
+        const Host* host = metadata->find_host(it->first);
+        if (host && session->policy_->distance(*metadata, *host) != IGNORED) {
+          ++it;
+          continue;
+        }
+        it->second->shutdown();
+        pools_closing.push_back(it->second);
+        it = pools.erase(it);
+      }
+    }
+
+    void
+    reap_pools() {
+      std::list<PoolPtr>::iterator it = pools_closing.begin();
+      while (it != pools_closing.end()) {
+        if ((*it)->is_closed()) {
+          it = pools_closing.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+
+    /**
+     * move queued requests onto connections. wakeups are coalesced by
+     * libuv, so one wakeup may find many requests; after a batch the loop
+     * gets to service its sockets and comes back for the rest. a loop
+     * which can't keep up wakes an idle sibling to steal from it, a loop
+     * which runs dry looks for work on its siblings.
+     */
+    void
+    drain() {
+      if (stopping.load(std::memory_order_acquire)) {
+        close();
+        return;
+      }
+
+      if (pools_version
+          != session->metadata_version_.load(std::memory_order_acquire)) {
+        sync_pools();
+      }
+
+      size_t count = drain(queue, CQL_SESSION_DRAIN_BATCH);
+      if (count == CQL_SESSION_DRAIN_BATCH) {
+        idle.store(false, std::memory_order_release);
+        uv_async_send(&wake);
+        if (queue.size_approx() >= CQL_SESSION_STEAL_MIN) {
+          wake_sibling();
+        }
+        return;
+      }
+
+      size_t stolen = steal(CQL_SESSION_DRAIN_BATCH - count);
+      idle.store(count + stolen == 0, std::memory_order_release);
+      if (stolen) {
+        // come back for more while the victim is still behind
+        uv_async_send(&wake);
+      }
+    }
+
+    size_t
+    drain(
+        SegmentedMpmcQueue<QueuedRequest>& source,
+        size_t                             limit) {
+      // one CAS for the whole batch instead of one per request
+      size_t count = source.try_dequeue_up_to(batch, limit);
+      if (count == 0) {
+        return 0;
+      }
+
+      std::shared_ptr<const Metadata> metadata = session->metadata();
+      for (size_t i = 0; i < count; ++i) {
+        dispatch(batch[i], *metadata);
+      }
+      return count;
+    }
+
+    /**
+     * take up to half of the deepest sibling queue
+     *
+     * @param limit
+     *
+     * @return the number of requests taken
+     */
+    size_t
+    steal(
+        size_t limit) {
+      IOWorker* victim = NULL;
+      size_t    depth  = CQL_SESSION_STEAL_MIN - 1;
+      for (size_t i = 0; i < session->io_loops_.size(); ++i) {
+        IOWorker* sibling = session->io_loops_[i];
+        if (sibling == this) {
+          continue;
+        }
+
+        size_t size = sibling->queue.size_approx();
+        if (size > depth) {
+          victim = sibling;
+          depth  = size;
+        }
+      }
+
+      if (!victim) {
+        return 0;
+      }
+      return drain(victim->queue, std::min(limit, depth / 2));
+    }
+
+    /**
+     * wake the next idle sibling after the one woken last, busy siblings
+     * steal on their own once they run dry and stopping ones are left
+     * alone
+     */
+    void
+    wake_sibling() {
+      size_t count = session->io_loops_.size();
+      // ends on the sibling woken last, it may be the only one
+      for (size_t i = 1; i <= count; ++i) {
+        size_t    next    = (next_sibling + i) % count;
+        IOWorker* sibling = session->io_loops_[next];
+        if (sibling == this
+            || sibling->stopping.load(std::memory_order_acquire)
+            || !sibling->idle.load(std::memory_order_acquire)) {
+          continue;
+        }
+        next_sibling = next;
+        sibling->wake_async();
+        return;
+      }
+    }
+
+    /**
+     * wake the loop, safe to call from any thread. does nothing once the
+     * loop has closed its handle.
+     */
+    void
+    wake_async() {
+      // sequentially consistent, pairs with close_wake
+      wakers.fetch_add(1);
+      if (!wake_closed.load()) {
+        uv_async_send(&wake);
+      }
+      wakers.fetch_sub(1);
+    }
+
+    void
+    close_wake() {
+      wake_closed.store(true);
+      while (wakers.load() != 0) {
+        std::this_thread::yield();
+      }
+      uv_close(reinterpret_cast<uv_handle_t*>(&wake), NULL);
+    }
+
+    /**
+     * shut the loop down from its own thread. speculative executions fail
+     * their requests, the control connection and the pools are closed,
+     * failing the requests on them, and once they're gone the last
+     * handles are closed and uv_run returns.
+     */
+    void
+    close() {
+      if (closing) {
+        return;
+      }
+      closing = true;
+      close_wake();
+
+      // their copies fail with the connections below
+      SpeculativeExecution::Collection running(executions);
+      for (SpeculativeExecution::Collection::iterator it = running.begin();
+           it != running.end();
+           ++it) {
+        (*it)->shutdown();
+      }
+      if (control) {
+        control->close();
+      }
+      for (PoolCollection::iterator it = pools.begin();
+           it != pools.end();
+           ++it) {
+        pools_closing.push_back(it->second);
+      }
+      pools.clear();
+      for (std::list<PoolPtr>::iterator it = pools_closing.begin();
+           it != pools_closing.end();
+           ++it) {
+        (*it)->close();
+      }
+      on_closing(&closing_timer);
+    }
+
+    static void
+    on_closing(
+        TimerNode* timer) {
+      IOWorker* worker = reinterpret_cast<IOWorker*>(timer->data);
+      uint64_t  now    = worker->timing_wheel.now();
+      for (std::list<PoolPtr>::iterator it = worker->pools_closing.begin();
+           it != worker->pools_closing.end();
+           ++it) {
+        (*it)->maintain(now);
+      }
+      worker->reap_pools();
+
+      if (!worker->pools_closing.empty()
+          || !worker->executions.empty()
+          || (worker->control && !worker->control->is_closed())) {
+        // the wheel keeps the loop running until they are
+        worker->timing_wheel.schedule(timer, 1, IOWorker::on_closing);
+        return;
+      }
+
+      worker->callbacks.flush();
+      uv_close(
+          reinterpret_cast<uv_handle_t*>(&worker->flush_callbacks),
+          NULL);
+      worker->timing_wheel.close();
+    }
+
+    /**
+     * the first pool in the request's plan with a connection up, or the
+     * first one there is if none are connected yet
+     *
+     * @param message
+     * @param metadata
+     *
+     * @return NULL if there's no pool for any host in the plan
+     */
+    Pool*
+    select_pool(
+        Message*        message,
+        const Metadata& metadata) {
+      Token        token   = 0;
+      const Token* routing = NULL;
+      routing_key.clear();
+      if (message->body.get() && message->body->routing_key(routing_key)) {
+        token   = murmur3_token(
+            routing_key.empty() ? NULL : &routing_key[0],
+            routing_key.size());
+        routing = &token;
+      }
+
+      plan.clear();
+      session->policy_->plan(metadata, routing, plan);
+
+      Pool* fallback = NULL;
+      for (QueryPlan::const_iterator it = plan.begin();
+           it != plan.end();
+           ++it) {
+        PoolCollection::iterator pool = pools.find((*it)->address);
+        if (pool == pools.end()) {
+          continue;
+        }
+
+        if (pool->second->is_connected()) {
+          return pool->second.get();
+        }
+
+        if (!fallback) {
+          fallback = pool->second.get();
+        }
+      }
+      return fallback;
+    }
+
+    /**
+     * race copies of an idempotent request over the connected pools of
+     * its plan, select_pool has to have made the plan
+     *
+     * @param queued
+     * @param first the pool select_pool picked
+     *
+     * @return false if the request wasn't taken, fewer than two hosts
+     */
+    bool
+    speculate(
+        const QueuedRequest& queued,
+        Pool*                first) {
+      SpeculativeExecutionPolicy* policy = session->speculative_policy_;
+      if (!first->is_connected()) {
+        return false;
+      }
+
+      targets.clear();
+      for (QueryPlan::const_iterator it = plan.begin();
+           it != plan.end() && targets.size() <= policy->max_executions();
+           ++it) {
+        PoolCollection::iterator pool = pools.find((*it)->address);
+        if (pool == pools.end() || !pool->second->is_connected()) {
+          continue;
+        }
+
+        SpeculativeExecution::Target target = {
+          pool->second,
+          policy->delay(**it)
+        };
+        targets.push_back(target);
+        if (target.delay == 0) {
+          break;
+        }
+      }
+
+      if (targets.size() < 2) {
+        return false;
+      }
+
+      SpeculativeExecution* execution = new SpeculativeExecution(
+          loop,
+          &timing_wheel,
+          &object_pools,
+          queued,
+          targets,
+          &executions);
+      execution->start();
+      return true;
+    }
+
+    void
+    dispatch(
+        const QueuedRequest& queued,
+        const Metadata&      metadata) {
+      queued.request->callback_batch = &callbacks;
+      Pool* pool = select_pool(queued.message, metadata);
+      if (!pool) {
+        delete queued.message;
+        queued.request->error = new Error(
+            CQL_ERROR_SOURCE_LIBRARY,
+            CQL_ERROR_LIB_NO_HOSTS,
+            "no hosts available",
+            __FILE__,
+            __LINE__);
+        queued.request->notify(loop);
+        return;
+      }
+
+      if (session->speculative_policy_
+          && queued.message->body.get()
+          && queued.message->body->idempotent()
+          && speculate(queued, pool)) {
+        return;
+      }
+      pool->execute(queued);
     }
 
     static void
@@ -70,9 +560,41 @@ class Session {
       uv_thread_create(&thread, &IOWorker::run, this);
     }
 
+    /**
+     * ask the loop to shut down, safe to call from any thread
+     */
     void
     stop() {
-      uv_stop(loop);
+      stopping.store(true, std::memory_order_release);
+      wake_async();
+    }
+
+    /**
+     * log the hit rate of the per loop object free lists
+     *
+     * @param log_callback
+     */
+    void
+    log_pool_stats(
+        const LogCallback& log_callback) {
+      char log_message[512];
+      snprintf(
+          log_message,
+          sizeof(log_message),
+          "object pools hit rate message %.3f, body %.3f, request %.3f",
+          object_pools.message->hit_rate(),
+          object_pools.body->hit_rate(),
+          object_pools.request->hit_rate());
+      log_callback(CQL_LOG_INFO, log_message, strlen(log_message));
+
+      snprintf(
+          log_message,
+          sizeof(log_message),
+          "request queue overflows %zu, peak overflow %zu, segments %zu",
+          queue.overflows(),
+          queue.overflow_peak(),
+          queue.segments_allocated());
+      log_callback(CQL_LOG_INFO, log_message, strlen(log_message));
     }
 
     void
@@ -81,21 +603,214 @@ class Session {
     }
 
     ~IOWorker() {
+      // closed along with the loop's handles before uv_run returned
+      delete control;
+      pools_closing.clear();
+      callbacks.flush();
       uv_loop_delete(loop);
     }
   };
 
+  // declared first so it outlives the IO loops handing it callbacks
+  cql::CallbackExecutor*              callback_executor_;
   std::vector<IOWorker*>              io_loops_;
   cql::SSLContext*                    ssl_context_;
   cql::LogCallback                    log_callback_;
-  cql::MpmcQueue<cql::CallerRequest*> queue_;
+  std::atomic<bool>                   stopping_;
+  // threads inside submit, shutdown waits for them to leave so that
+  // nothing is queued after the queues were drained for the last time
+  std::atomic<size_t>                 submitting_;
+  bool                                running_;
+  // replaced whole on every change, see metadata()
+  std::shared_ptr<const Metadata>     metadata_;
+  std::mutex                          metadata_mutex_;
+  // bumped whenever metadata_ is replaced, IO loops compare it against
+  // the version their pools match
+  std::atomic<size_t>                 metadata_version_;
+  // milliseconds, 0 uses CQL_CONTROL_CONNECTION_TIMEOUT
+  uint64_t                            control_connection_timeout_;
+  LoadBalancingPolicy*                policy_;
+  // NULL to never race copies of a request
+  SpeculativeExecutionPolicy*         speculative_policy_;
 
+  /**
+   * @param io_loop_count
+   * @param callback_thread_count threads running request callbacks
+   * @param queue_overflow let requests spill past the end of the
+   *   submission queues instead of failing them
+   */
   Session(
-      size_t io_loop_count) :
-      io_loops_(io_loop_count, NULL),
-      queue_(1024) {
+      size_t io_loop_count,
+      size_t callback_thread_count = 1,
+      bool   queue_overflow = false) :
+      callback_executor_(new CallbackExecutor(callback_thread_count)),
+      io_loops_(io_loop_count ? io_loop_count : 1, NULL),
+      ssl_context_(NULL),
+      log_callback_(nullptr),
+      stopping_(false),
+      submitting_(0),
+      running_(false),
+      metadata_(new Metadata()),
+      metadata_version_(0),
+      control_connection_timeout_(0),
+      policy_(new TokenAwarePolicy(new RoundRobinPolicy())),
+      speculative_policy_(NULL) {
+    for (size_t i = 0; i < io_loops_.size(); ++i) {
+      io_loops_[i] = new IOWorker(this, i, queue_overflow);
+    }
+  }
+
+  /**
+   * the IO loop an application thread submits to. a thread sticks to one
+   * loop, which keeps its requests in order and spreads threads evenly
+   * across loops.
+   *
+   * @return
+   */
+  inline size_t
+  home_io_loop() {
+    return std::hash<std::thread::id>()(std::this_thread::get_id())
+        % io_loops_.size();
+  }
+
+  /**
+   * open pools to every host on every IO loop and start the loops
+   *
+   * @param hosts
+   * @param options
+   */
+  void
+  init(
+      const std::list<std::string>& hosts,
+      const PoolOptions&            options) {
+    Metadata* metadata = new Metadata(*this->metadata());
+    for (std::list<std::string>::const_iterator it = hosts.begin();
+         it != hosts.end();
+         ++it) {
+      if (!metadata->find_host(*it)) {
+        metadata->update_host(Host(*it));
+      }
+    }
+    this->metadata(metadata);
+
+    for (size_t i = 0; i < io_loops_.size(); ++i) {
+      io_loops_[i]->ssl_context  = ssl_context_;
+      io_loops_[i]->pool_options = options;
+      io_loops_[i]->sync_pools();
+    }
+
+    if (!hosts.empty()) {
+      IOWorker* worker = io_loops_[0];
+      worker->control = new ControlConnection(
+          worker->loop,
+          ssl_context_,
+          &worker->timing_wheel,
+          options,
+          control_connection_timeout_,
+          std::bind(
+              &Session::update_topology,
+              this,
+              std::placeholders::_1));
+      worker->control->connect(hosts);
+    }
+
+    for (size_t i = 0; i < io_loops_.size(); ++i) {
+      io_loops_[i]->run_async();
+    }
+    running_ = true;
+  }
+
+  /**
+   * the current view of the cluster. IO loops take it once per batch of
+   * requests, it stays valid for as long as the reference is held even
+   * if it's replaced in the meantime.
+   *
+   * @return
+   */
+  std::shared_ptr<const Metadata>
+  metadata() {
+    std::lock_guard<std::mutex> lock(metadata_mutex_);
+    return metadata_;
+  }
+
+  /**
+   * replace the metadata and have the IO loops bring their pools in line
+   * with it
+   *
+   * @param metadata takes ownership
+   */
+  void
+  metadata(
+      const Metadata* metadata) {
+    std::shared_ptr<const Metadata> replaced(metadata);
+    {
+      std::lock_guard<std::mutex> lock(metadata_mutex_);
+      metadata_.swap(replaced);
+      metadata_version_.fetch_add(1, std::memory_order_release);
+    }
+    wake_io_loops();
+  }
+
+  /**
+   * apply change to a copy of the metadata and swap it in, changes from
+   * different threads are applied one after the other
+   *
+   * @param change
+   */
+  void
+  update_metadata(
+      const std::function<void(Metadata&)>& change) {
+    std::shared_ptr<const Metadata> replaced;
+    {
+      std::lock_guard<std::mutex> lock(metadata_mutex_);
+      Metadata* metadata = new Metadata(*metadata_);
+      change(*metadata);
+      replaced.reset(metadata);
+      metadata_.swap(replaced);
+      metadata_version_.fetch_add(1, std::memory_order_release);
+    }
+    wake_io_loops();
+  }
+
+  void
+  wake_io_loops() {
+    if (stopping_.load(std::memory_order_acquire)) {
+      return;
+    }
     for (size_t i = 0; i < io_loops_.size(); ++i) {
-      io_loops_[i] = new IOWorker();
+      io_loops_[i]->wake_async();
+    }
+  }
+
+  /**
+   * the control connection read the hosts of the cluster
+   *
+   * @param hosts
+   */
+  void
+  update_topology(
+      const std::vector<Host>& hosts) {
+    update_metadata(
+        std::bind(
+            &Session::apply_topology,
+            std::placeholders::_1,
+            std::cref(hosts)));
+  }
+
+  /**
+   * the first host is the node the control connection is on, the first
+   * datacenter it's seen in becomes the local one
+   *
+   * @param metadata
+   * @param hosts
+   */
+  static void
+  apply_topology(
+      Metadata&                metadata,
+      const std::vector<Host>& hosts) {
+    metadata.hosts(hosts);
+    if (metadata.local_datacenter().empty() && !hosts.empty()) {
+      metadata.local_datacenter(hosts.front().datacenter);
     }
   }
 
@@ -111,37 +826,233 @@ class Session {
   log(
       int         level,
       const char* message) {
-    (void) level;
-    std::cout << message << std::endl;
+    if (log_callback_) {
+      log_callback_(level, message, strlen(message));
+    } else {
+      std::cout << message << std::endl;
+    }
   }
 
   inline void
   log(
       int                level,
       const std::string& message) {
-    (void) level;
-    std::cout << message << std::endl;
+    log(level, message.c_str());
+  }
+
+  /**
+   * a request for the application to wait on, from the free list of the
+   * calling thread's loop. the free lists are lock free so any thread can
+   * allocate from them, and they stay around until the request is
+   * deleted.
+   *
+   * @return
+   */
+  inline CallerRequest*
+  new_request() {
+    ObjectPools& pools = io_loops_[home_io_loop()]->object_pools;
+    return new (pools.request) CallerRequest();
+  }
+
+  /**
+   * hand a request to the IO loops. the message is owned by the session
+   * from here on. if the calling thread's loop is backed up the request
+   * spills over to the next loop with room; if every queue is full the
+   * request fails straight away, its callback running on the calling
+   * thread.
+   *
+   * @param message
+   * @param request
+   */
+  void
+  submit(
+      Message*       message,
+      CallerRequest* request) {
+    QueuedRequest queued = { message, request, false };
+    // sequentially consistent, pairs with shutdown: either this sees
+    // stopping_ or shutdown sees the submit and waits for it
+    submitting_.fetch_add(1);
+    if (stopping_.load()) {
+      submitting_.fetch_sub(1);
+      fail(
+          queued,
+          CQL_ERROR_LIB_SESSION_STATE,
+          "session shut down");
+      return;
+    }
+
+    size_t home = home_io_loop();
+    for (size_t i = 0; i < io_loops_.size(); ++i) {
+      IOWorker* worker = io_loops_[(home + i) % io_loops_.size()];
+      if (worker->queue.enqueue(queued)) {
+        worker->wake_async();
+        submitting_.fetch_sub(1);
+        return;
+      }
+    }
+    submitting_.fetch_sub(1);
+
+    fail(
+        queued,
+        CQL_ERROR_LIB_QUEUE_FULL,
+        "request queue full");
+  }
+
+  /**
+   * complete a request which never reached an IO loop, the callback runs
+   * on the calling thread
+   *
+   * @param queued
+   * @param code
+   * @param message
+   */
+  static void
+  fail(
+      const QueuedRequest& queued,
+      int                  code,
+      const char*          message) {
+    delete queued.message;
+    queued.request->use_local_loop = true;
+    queued.request->error = new Error(
+        CQL_ERROR_SOURCE_LIBRARY,
+        code,
+        message,
+        __FILE__,
+        __LINE__);
+    queued.request->notify(NULL);
   }
 
  public:
+  ~Session() {
+    shutdown();
+    // the loops are gone, hand over what they completed last and run
+    // every callback still queued while the loops' object pools are
+    // around
+    for (size_t i = 0; i < io_loops_.size(); ++i) {
+      io_loops_[i]->callbacks.flush();
+    }
+    callback_executor_->shutdown();
+    for (size_t i = 0; i < io_loops_.size(); ++i) {
+      delete io_loops_[i];
+    }
+    delete callback_executor_;
+    delete policy_;
+    delete speculative_policy_;
+  }
+
+  /**
+   * add a host or replace what's known about it, its tokens decide which
+   * requests are routed to it. callable from any thread.
+   *
+   * @param host
+   */
+  void
+  update_host(
+      const Host& host) {
+    update_metadata(
+        std::bind(
+            &Metadata::update_host,
+            std::placeholders::_1,
+            std::cref(host)));
+  }
+
+  /**
+   * prepare a statement on one of the hosts
+   *
+   * @param statement
+   * @param size
+   * @param callback
+   *
+   * @return a request to wait on, the caller deletes it once complete
+   */
   CallerRequest*
-  prepare() {
-    return nullptr;
+  prepare(
+      const char*             statement,
+      size_t                  size,
+      CallerRequest::Callback callback = NULL) {
+    Message*     message = new Message(CQL_OPCODE_PREPARE);
+    BodyPrepare* prepare = static_cast<BodyPrepare*>(message->body.get());
+    prepare->prepare_string(statement, size);
+
+    CallerRequest* request = new_request();
+    request->callback = callback;
+    request->data.assign(statement, size);
+    submit(message, request);
+    return request;
   }
 
+  /**
+   * execute a message on one of the hosts, the session takes ownership of
+   * the message. callable from any thread.
+   *
+   * @param message
+   * @param callback
+   *
+   * @return a request to wait on, the caller deletes it once complete
+   */
   CallerRequest*
-  execute() {
-    return nullptr;
+  execute(
+      Message*                message,
+      CallerRequest::Callback callback = NULL) {
+    CallerRequest* request = new_request();
+    request->callback = callback;
+    submit(message, request);
+    return request;
   }
 
+  /**
+   * stop the IO loops and wait for them to exit. requests still queued
+   * or in flight fail, every handle is closed by the time this returns.
+   */
   void
   shutdown() {
+    if (stopping_.exchange(true)) {
+      return;
+    }
+
+    while (submitting_.load() != 0) {
+      std::this_thread::yield();
+    }
+
+    for (size_t i = 0; i < io_loops_.size(); ++i) {
+      io_loops_[i]->stop();
+    }
+    if (running_) {
+      for (size_t i = 0; i < io_loops_.size(); ++i) {
+        io_loops_[i]->join();
+      }
+      running_ = false;
+    } else {
+      // never started, close the handles on this thread
+      for (size_t i = 0; i < io_loops_.size(); ++i) {
+        uv_run(io_loops_[i]->loop, UV_RUN_DEFAULT);
+      }
+    }
+
+    QueuedRequest queued;
+    for (size_t i = 0; i < io_loops_.size(); ++i) {
+      while (io_loops_[i]->queue.dequeue(queued)) {
+        fail(
+            queued,
+            CQL_ERROR_LIB_SESSION_STATE,
+            "session shut down");
+      }
+    }
   }
 
   void
   set_keyspace() {
   }
 
+  void
+  log_pool_stats() {
+    if (!log_callback_) {
+      return;
+    }
+    for (size_t i = 0; i < io_loops_.size(); ++i) {
+      io_loops_[i]->log_pool_stats(log_callback_);
+    }
+  }
 };
 }
 #endif
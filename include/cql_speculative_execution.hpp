@@ -0,0 +1,341 @@
+/*
+  Copyright 2014 DataStax
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+
+#ifndef __CQL_SPECULATIVE_EXECUTION_HPP_INCLUDED__
+#define __CQL_SPECULATIVE_EXECUTION_HPP_INCLUDED__
+
+#include <functional>
+#include <list>
+#include <memory>
+#include <vector>
+
+#include "cql_host.hpp"
+#include "cql_pool.hpp"
+
+// samples a host needs before its percentile is trusted
+#define CQL_SPECULATIVE_EXECUTION_MIN_SAMPLES 100
+
+namespace cql {
+
+/**
+ * Decides how long a request may go unanswered before a copy of it is
+ * sent to the next host of its plan. One policy serves every IO loop of
+ * a session, implementations have to be thread safe.
+ */
+class SpeculativeExecutionPolicy {
+ public:
+  /**
+   * @param max_executions copies sent on top of the first request
+   */
+  explicit
+  SpeculativeExecutionPolicy(
+      size_t max_executions) :
+      max_executions_(max_executions)
+  {}
+
+  virtual
+  ~SpeculativeExecutionPolicy()
+  {}
+
+  /**
+   * @param host the host the request was just sent to
+   *
+   * @return milliseconds to wait for it, 0 to not send a copy
+   */
+  virtual uint64_t
+  delay(
+      const Host& host) = 0;
+
+  inline size_t
+  max_executions() {
+    return max_executions_;
+  }
+
+ private:
+  size_t max_executions_;
+};
+
+/**
+ * The same delay for every host
+ */
+class ConstantSpeculativeExecutionPolicy
+    : public SpeculativeExecutionPolicy {
+ public:
+  /**
+   * @param delay milliseconds
+   * @param max_executions
+   */
+  ConstantSpeculativeExecutionPolicy(
+      uint64_t delay,
+      size_t   max_executions) :
+      SpeculativeExecutionPolicy(max_executions),
+      delay_(delay)
+  {}
+
+  uint64_t
+  delay(
+      const Host& host) {
+    (void) host;
+    return delay_;
+  }
+
+ private:
+  uint64_t delay_;
+};
+
+/**
+ * Waits as long as the given percentile of the host's recent response
+ * times, so only the requests slower than that get a copy. Hosts without
+ * enough samples get none.
+ */
+class PercentileSpeculativeExecutionPolicy
+    : public SpeculativeExecutionPolicy {
+ public:
+  /**
+   * @param percentile between 0 and 1
+   * @param max_executions
+   * @param min_samples
+   */
+  PercentileSpeculativeExecutionPolicy(
+      double   percentile,
+      size_t   max_executions,
+      uint64_t min_samples = CQL_SPECULATIVE_EXECUTION_MIN_SAMPLES) :
+      SpeculativeExecutionPolicy(max_executions),
+      percentile_(percentile),
+      min_samples_(min_samples)
+  {}
+
+  uint64_t
+  delay(
+      const Host& host) {
+    uint64_t latency = host.latency->histogram().percentile(
+        percentile_,
+        min_samples_);
+    // round up to whole milliseconds
+    return (latency + 999999) / 1000000;
+  }
+
+ private:
+  double   percentile_;
+  uint64_t min_samples_;
+};
+
+/**
+ * Races copies of an idempotent request against each other. The request
+ * goes to the first pool; whenever the latest copy has gone unanswered
+ * for its delay, another copy goes to the next pool. The first answer
+ * completes the caller's request, an error only does once no copy is
+ * left that could still succeed, and a failed copy moves on to the next
+ * pool without waiting.
+ *
+ * Every copy runs as a request of its own on the IO loop, so a copy which
+ * loses keeps its stream until its answer arrives, which then releases
+ * it like any other. The message is shared by the copies and encoded
+ * with its values copied, a losing copy may still be waiting to be
+ * written when the caller's request completes. A copy is never left
+ * waiting for a connection to come up, it would be encoded after that;
+ * the pool fails it and the next one is tried. Deletes itself once the
+ * last copy is answered.
+ *
+ * Delays are rounded up to the resolution of the timing wheel.
+ */
+class SpeculativeExecution {
+ public:
+  struct Target {
+    std::shared_ptr<Pool> pool;
+    // milliseconds to wait before the next copy, 0 for none
+    uint64_t              delay;
+  };
+
+  typedef std::vector<Target> TargetCollection;
+
+  typedef std::list<SpeculativeExecution*> Collection;
+
+  /**
+   * @param loop
+   * @param timing_wheel
+   * @param object_pools
+   * @param queued takes ownership of the message
+   * @param targets at least two
+   * @param executions the loop's executions, this is in it until deleted
+   */
+  SpeculativeExecution(
+      uv_loop_t*              loop,
+      TimingWheel*            timing_wheel,
+      ObjectPools*            object_pools,
+      const QueuedRequest&    queued,
+      const TargetCollection& targets,
+      Collection*             executions) :
+      loop_(loop),
+      timing_wheel_(timing_wheel),
+      object_pools_(object_pools),
+      message_(queued.message),
+      request_(queued.request),
+      targets_(targets),
+      executions_(executions),
+      position_(executions->insert(executions->end(), this)),
+      next_(0),
+      outstanding_(0),
+      done_(false) {
+    message_->copy_values = true;
+    timer_.data           = this;
+  }
+
+  ~SpeculativeExecution() {
+    timing_wheel_->cancel(&timer_);
+    executions_->erase(position_);
+    delete message_;
+  }
+
+  /**
+   * send the first copy. this may already be gone when it returns.
+   */
+  inline void
+  start() {
+    send();
+  }
+
+  /**
+   * the loop is shutting down, fail the caller's request without waiting
+   * on the copies. those still out are dropped as their connections fail
+   * them.
+   */
+  void
+  shutdown() {
+    if (done_) {
+      return;
+    }
+    done_ = true;
+    timing_wheel_->cancel(&timer_);
+    request_->error = new Error(
+        CQL_ERROR_SOURCE_LIBRARY,
+        CQL_ERROR_LIB_SESSION_STATE,
+        "session shut down",
+        __FILE__,
+        __LINE__);
+    request_->notify(loop_);
+  }
+
+ private:
+  void
+  send() {
+    const Target&  target  = targets_[next_++];
+    CallerRequest* attempt = object_pools_
+        ? new (object_pools_->request) CallerRequest()
+        : new CallerRequest();
+    attempt->timeout        = request_->timeout;
+    attempt->use_local_loop = true;
+    attempt->callback       = std::bind(
+        &SpeculativeExecution::on_attempt,
+        this,
+        std::placeholders::_1);
+    ++outstanding_;
+
+    if (next_ < targets_.size() && target.delay) {
+      timing_wheel_->schedule(
+          &timer_,
+          target.delay,
+          SpeculativeExecution::on_timer);
+    }
+
+    // a pool which fails the copy straight away calls back from in here,
+    // which may delete this and with it the last reference to the pool
+    std::shared_ptr<Pool> pool   = target.pool;
+    QueuedRequest         queued = { message_, attempt, true };
+    pool->execute(queued);
+  }
+
+  static void
+  on_timer(
+      TimerNode* timer) {
+    SpeculativeExecution* execution
+        = reinterpret_cast<SpeculativeExecution*>(timer->data);
+    if (!execution->done_ && execution->next_ < execution->targets_.size()) {
+      execution->send();
+    }
+  }
+
+  void
+  on_attempt(
+      CallerRequest* attempt) {
+    --outstanding_;
+    if (done_) {
+      discard(attempt);
+      if (outstanding_ == 0) {
+        delete this;
+      }
+      return;
+    }
+
+    if (attempt->error) {
+      if (outstanding_ > 0) {
+        // another copy may still succeed
+        discard(attempt);
+        return;
+      }
+
+      if (next_ < targets_.size()) {
+        discard(attempt);
+        timing_wheel_->cancel(&timer_);
+        send();
+        return;
+      }
+    }
+
+    done_ = true;
+    timing_wheel_->cancel(&timer_);
+    request_->result = attempt->result;
+    request_->error  = attempt->error;
+    attempt->result  = NULL;
+    attempt->error   = NULL;
+    delete attempt;
+    request_->notify(loop_);
+
+    if (outstanding_ == 0) {
+      delete this;
+    }
+  }
+
+  static void
+  discard(
+      CallerRequest* attempt) {
+    delete attempt->result;
+    delete attempt->error;
+    delete attempt;
+  }
+
+  uv_loop_t*           loop_;
+  TimingWheel*         timing_wheel_;
+  ObjectPools*         object_pools_;
+  Message*             message_;
+  CallerRequest*       request_;
+  TargetCollection     targets_;
+  Collection*          executions_;
+  Collection::iterator position_;
+  // the target the next copy goes to
+  size_t               next_;
+  // copies sent and not answered yet
+  size_t               outstanding_;
+  // the caller's request is complete
+  bool                 done_;
+  TimerNode            timer_;
+
+  SpeculativeExecution(const SpeculativeExecution&);
+  void operator=(const SpeculativeExecution&);
+};
+}
+#endif
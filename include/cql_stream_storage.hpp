@@ -17,73 +17,304 @@
 #ifndef __STREAM_STORAGE_HPP_INCLUDED__
 #define __STREAM_STORAGE_HPP_INCLUDED__
 
+#include <stdint.h>
+#include <string.h>
+#include <new>
+
 namespace cql {
 
+/**
+ * Maps stream ids 1..Max to the requests waiting on them.
+ *
+ * Free ids are tracked in a bitmap of 64 bit words, one word per group of
+ * 64 ids, and each word sits directly in front of the slots it describes
+ * so that allocating an id touches one block of memory. A second level
+ * summary bitmap records which groups still have a free id, finding the
+ * lowest free id is a find-first-set on the summary followed by one on
+ * the group. The lowest group with a free id is cached, so the summary is
+ * only searched after that group fills up. Groups are padded to whole
+ * cache lines and the group array starts on one, so allocations in one
+ * group never touch the lines of its neighbours.
+ *
+ * Ids are always handed out lowest first, so keeping the number of ids in
+ * use below a limit also keeps every id below it. The group array only
+ * covers the groups ids have been handed out from so far, it doubles when
+ * an allocation spills past its end and is never shrunk. A connection
+ * which never has more than a few requests in flight, or which is limited
+ * to the 127 ids of v2, never pays for the groups above them.
+ *
+ * Errors are reported as CQL_ERROR_LIB_* codes. Only an allocation which
+ * grows the group array allocates memory. Not thread safe, owned by the
+ * IO loop of the connection.
+ */
 template <typename IdType,
           typename StorageType,
           size_t   Max>
 class StreamStorage {
  public:
   StreamStorage() :
-      available_streams_index_(0) {
-    for (size_t i = 1; i <= Max; ++i) {
-      available_streams_[i - 1] = i;
-      allocated_streams_[i - 1] = false;
+      raw_(NULL),
+      groups_(NULL),
+      group_count_(0),
+      lowest_group_(0),
+      in_use_(0),
+      max_streams_(Max) {
+    // groups which don't exist yet are entirely free
+    for (size_t w = 0; w < SUMMARY_WORDS; ++w) {
+      size_t groups = GROUPS - w * 64 < 64 ? GROUPS - w * 64 : 64;
+      summary_[w] = groups == 64 ? ~0ULL : (1ULL << groups) - 1;
     }
   }
 
-  inline Error*
+  ~StreamStorage() {
+    delete[] raw_;
+  }
+
+  /**
+   * limit the ids handed out to 1..max, used when the negotiated protocol
+   * version has a narrower stream id than the storage was sized for. must
+   * not be lowered while ids above the new limit are in use.
+   *
+   * @param max
+   */
+  inline void
+  max_streams(
+      size_t max) {
+    max_streams_ = max < Max ? max : Max;
+  }
+
+  inline size_t
+  max_streams() {
+    return max_streams_;
+  }
+
+  /**
+   * how many ids the group array covers so far
+   *
+   * @return
+   */
+  inline size_t
+  capacity() {
+    return group_count_ * 64 < Max ? group_count_ * 64 : Max;
+  }
+
+  /**
+   * allocate the lowest free id and store input against it
+   *
+   * @param input
+   * @param output the allocated id
+   *
+   * @return CQL_ERROR_NO_ERROR or CQL_ERROR_LIB_NO_STREAMS
+   */
+  inline int
   set_stream(
       const StorageType& input,
-      IdType&      output) {
-    if (available_streams_index_ >= Max) {
-      return new Error(
-          CQL_ERROR_SOURCE_LIBRARY,
-          CQL_ERROR_LIB_NO_STREAMS,
-          "no available streams",
-          __FILE__,
-          __LINE__);
+      IdType&            output) {
+    if (in_use_ >= max_streams_) {
+      return CQL_ERROR_LIB_NO_STREAMS;
+    }
+
+    size_t group = lowest_group_;
+    if (group >= group_count_) {
+      grow(group + 1);
+    }
+    if (groups_[group].free == 0) {
+      // the group filled up on the last allocation, find the next one
+      size_t word = group / 64;
+      while (summary_[word] == 0) {
+        ++word;
+      }
+      group         = word * 64 + __builtin_ctzll(summary_[word]);
+      lowest_group_ = group;
+      if (group >= group_count_) {
+        grow(group + 1);
+      }
+    }
+
+    Group& slots = groups_[group];
+    size_t bit   = __builtin_ctzll(slots.free);
+
+    slots.free &= slots.free - 1;
+    if (slots.free == 0) {
+      summary_[group / 64] &= ~(1ULL << (group % 64));
     }
 
-    intptr_t index             = available_streams_index_++;
-    output                     = available_streams_[index];
-    storage_[output]           = input;
-    allocated_streams_[output] = true;
+    slots.storage[bit] = input;
+    output             = group * 64 + bit + 1;
+    ++in_use_;
     return CQL_ERROR_NO_ERROR;
   }
 
-  inline Error*
+  /**
+   * look up the value stored against an id
+   *
+   * @param input the id
+   * @param output
+   * @param releaseStream give the id back
+   *
+   * @return CQL_ERROR_NO_ERROR or CQL_ERROR_LIB_INVALID_STREAM if the id is
+   * out of range, or if it's being released and isn't in use
+   */
+  inline int
   get_stream(
       const IdType& input,
       StorageType&  output,
       bool          releaseStream = true) {
-    output = storage_[static_cast<int>(input)];
+    if (!covers(input)) {
+      return CQL_ERROR_LIB_INVALID_STREAM;
+    }
+
+    size_t   index = static_cast<size_t>(input) - 1;
+    size_t   group = index / 64;
+    uint64_t mask  = 1ULL << (index % 64);
+    Group&   slots = groups_[group];
+
+    output = slots.storage[index % 64];
     if (releaseStream) {
-      if (allocated_streams_[input]) {
-        available_streams_[--available_streams_index_] = input;
-        allocated_streams_[input] = false;
-      } else {
-        return new Error(
-            CQL_ERROR_SOURCE_LIBRARY,
-            CQL_ERROR_LIB_NO_STREAMS,
-            "this stream has already been released",
-            __FILE__,
-            __LINE__);
+      if (slots.free & mask) {
+        // this stream has already been released
+        return CQL_ERROR_LIB_INVALID_STREAM;
+      }
+
+      if (slots.free == 0) {
+        summary_[group / 64] |= 1ULL << (group % 64);
       }
+      slots.free |= mask;
+      if (group < lowest_group_) {
+        lowest_group_ = group;
+      }
+      --in_use_;
+    }
+    return CQL_ERROR_NO_ERROR;
+  }
+
+  /**
+   * replace the value stored against an id which is in use, the id stays
+   * allocated
+   *
+   * @param input the id
+   * @param value
+   *
+   * @return CQL_ERROR_NO_ERROR or CQL_ERROR_LIB_INVALID_STREAM
+   */
+  inline int
+  update_stream(
+      const IdType&      input,
+      const StorageType& value) {
+    if (!covers(input)) {
+      return CQL_ERROR_LIB_INVALID_STREAM;
+    }
+
+    size_t index = static_cast<size_t>(input) - 1;
+    Group& slots = groups_[index / 64];
+    if (slots.free & (1ULL << (index % 64))) {
+      return CQL_ERROR_LIB_INVALID_STREAM;
     }
+    slots.storage[index % 64] = value;
     return CQL_ERROR_NO_ERROR;
   }
 
+  /**
+   * whether an id is currently allocated
+   *
+   * @param input the id
+   *
+   * @return false for free or out of range ids
+   */
+  inline bool
+  in_use(
+      const IdType& input) {
+    if (!covers(input)) {
+      return false;
+    }
+
+    size_t index = static_cast<size_t>(input) - 1;
+    return !(groups_[index / 64].free & (1ULL << (index % 64)));
+  }
+
   inline size_t
   available_streams() {
-    return Max - available_streams_index_;
+    if (in_use_ >= max_streams_) {
+      return 0;
+    }
+    return max_streams_ - in_use_;
   }
 
  private:
-  uintptr_t   available_streams_index_;
-  IdType      available_streams_[Max];
-  bool        allocated_streams_[Max];
-  StorageType storage_[Max];
+  static const size_t GROUPS        = (Max + 63) / 64;
+  static const size_t SUMMARY_WORDS = (GROUPS + 63) / 64;
+  static const size_t CACHE_LINE    = 64;
+  static const size_t GROUP_BYTES   = sizeof(uint64_t)
+                                    + 64 * sizeof(StorageType);
+
+  // a set bit marks a free id. the array is over aligned by hand, an
+  // alignas would need the aligned operator new of C++17
+  struct Group {
+    uint64_t    free;
+    StorageType storage[64];
+    char        pad[CACHE_LINE - GROUP_BYTES % CACHE_LINE];
+  };
+
+  /**
+   * whether an id is in range and its group exists, ids in groups which
+   * don't exist yet were never handed out
+   *
+   * @param input
+   *
+   * @return
+   */
+  inline bool
+  covers(
+      const IdType& input) {
+    return static_cast<intptr_t>(input) >= 1
+        && static_cast<intptr_t>(input) <= static_cast<intptr_t>(Max)
+        && (static_cast<size_t>(input) - 1) / 64 < group_count_;
+  }
+
+  /**
+   * at least double the group array so that it covers needed groups,
+   * the new groups start out entirely free
+   *
+   * @param needed
+   */
+  void
+  grow(
+      size_t needed) {
+    size_t count = group_count_ * 2 > needed ? group_count_ * 2 : needed;
+    if (count > GROUPS) {
+      count = GROUPS;
+    }
+
+    char*  raw    = new char[count * sizeof(Group) + CACHE_LINE];
+    Group* groups = reinterpret_cast<Group*>(
+        (reinterpret_cast<uintptr_t>(raw) + CACHE_LINE - 1)
+        & ~static_cast<uintptr_t>(CACHE_LINE - 1));
+    if (group_count_) {
+      memcpy(groups, groups_, group_count_ * sizeof(Group));
+    }
+    for (size_t g = group_count_; g < count; ++g) {
+      size_t ids = Max - g * 64 < 64 ? Max - g * 64 : 64;
+      new (&groups[g]) Group();
+      groups[g].free = ids == 64 ? ~0ULL : (1ULL << ids) - 1;
+    }
+
+    delete[] raw_;
+    raw_         = raw;
+    groups_      = groups;
+    group_count_ = count;
+  }
+
+  char*    raw_;
+  // groups_[0, group_count_) points into raw_
+  Group*   groups_;
+  size_t   group_count_;
+  uint64_t summary_[SUMMARY_WORDS];
+  size_t   lowest_group_;
+  size_t   in_use_;
+  size_t   max_streams_;
+
+  StreamStorage(const StreamStorage&) {}
+  void operator=(const StreamStorage&) {}
 };
 }
 #endif
@@ -0,0 +1,263 @@
+/*
+  Copyright 2014 DataStax
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef __CQL_TIMING_WHEEL_HPP_INCLUDED__
+#define __CQL_TIMING_WHEEL_HPP_INCLUDED__
+
+#include <assert.h>
+#include <stdint.h>
+#include <uv.h>
+#include <vector>
+
+// milliseconds per tick, deadlines are rounded up to a whole tick
+#define CQL_TIMING_WHEEL_RESOLUTION 10
+// must be a power of two
+#define CQL_TIMING_WHEEL_SLOTS      1024
+
+namespace cql {
+
+struct TimerNode;
+
+typedef void (*TimerCallback)(TimerNode*);
+
+/**
+ * A timer embedded in the object it times, scheduling and cancelling
+ * never allocate. data and id are left to the owner of the node.
+ */
+struct TimerNode {
+  TimerNode*    prev;
+  TimerNode*    next;
+  uint64_t      tick;
+  bool          scheduled;
+  TimerCallback callback;
+  void*         data;
+  int64_t       id;
+
+  TimerNode() :
+      prev(NULL),
+      next(NULL),
+      tick(0),
+      scheduled(false),
+      callback(NULL),
+      data(NULL),
+      id(0)
+  {}
+};
+
+/**
+ * Hashed timing wheel. Timers hash into one of a fixed number of slots by
+ * the tick they expire on, a timer further out than one turn of the wheel
+ * stays in its slot until the turn it's due. Scheduling and cancelling are
+ * O(1); a single uv timer drives the wheel, and only runs while timers
+ * are pending.
+ *
+ * Constructed without a loop the wheel is only advanced by explicit calls
+ * to advance(). Otherwise close() has to be called, and the loop run
+ * until the handle is closed, before the wheel is destroyed. Not thread
+ * safe, owned by one IO loop.
+ */
+class TimingWheel {
+ public:
+  TimingWheel(
+      uv_loop_t* loop,
+      uint64_t   resolution = CQL_TIMING_WHEEL_RESOLUTION,
+      size_t     slots = CQL_TIMING_WHEEL_SLOTS) :
+      loop_(loop),
+      resolution_(resolution ? resolution : 1),
+      slots_(slots, static_cast<TimerNode*>(NULL)),
+      mask_(slots - 1),
+      current_tick_(0),
+      size_(0),
+      running_(false),
+      closed_(false) {
+    assert((slots & mask_) == 0);
+    if (loop_) {
+      timer_.data   = this;
+      uv_timer_init(loop_, &timer_);
+      current_tick_ = uv_now(loop_) / resolution_;
+    }
+  }
+
+  /**
+   * schedule node to fire timeout milliseconds from now, rescheduling a
+   * node which is already pending moves it
+   *
+   * @param node
+   * @param timeout
+   * @param callback
+   */
+  void
+  schedule(
+      TimerNode*    node,
+      uint64_t      timeout,
+      TimerCallback callback) {
+    cancel(node);
+    if (size_ == 0 && loop_) {
+      // nothing was pending, skip the ticks the wheel slept through
+      current_tick_ = uv_now(loop_) / resolution_;
+    }
+
+    uint64_t tick = (now() + timeout + resolution_ - 1) / resolution_;
+    if (tick <= current_tick_) {
+      tick = current_tick_ + 1;
+    }
+
+    TimerNode*& head = slots_[tick & mask_];
+    node->tick      = tick;
+    node->callback  = callback;
+    node->scheduled = true;
+    node->prev      = NULL;
+    node->next      = head;
+    if (head) {
+      head->prev = node;
+    }
+    head = node;
+
+    if (size_++ == 0) {
+      start();
+    }
+  }
+
+  /**
+   * safe to call on nodes which aren't scheduled
+   *
+   * @param node
+   */
+  void
+  cancel(
+      TimerNode* node) {
+    if (!node->scheduled) {
+      return;
+    }
+
+    if (node->prev) {
+      node->prev->next = node->next;
+    } else {
+      slots_[node->tick & mask_] = node->next;
+    }
+    if (node->next) {
+      node->next->prev = node->prev;
+    }
+    node->prev      = NULL;
+    node->next      = NULL;
+    node->scheduled = false;
+
+    if (--size_ == 0) {
+      stop();
+    }
+  }
+
+  /**
+   * fire every timer due at or before now
+   *
+   * @param now milliseconds, on the same clock as uv_now
+   */
+  void
+  advance(
+      uint64_t now) {
+    uint64_t target = now / resolution_;
+    while (current_tick_ < target && size_) {
+      ++current_tick_;
+      expire(current_tick_);
+    }
+
+    if (current_tick_ < target) {
+      current_tick_ = target;
+    }
+  }
+
+  /**
+   * close the uv timer, pending timers never fire after this
+   */
+  void
+  close() {
+    if (loop_ && !closed_) {
+      closed_  = true;
+      running_ = false;
+      uv_close(reinterpret_cast<uv_handle_t*>(&timer_), NULL);
+    }
+  }
+
+  inline size_t
+  size() {
+    return size_;
+  }
+
+  inline uint64_t
+  now() {
+    return loop_ ? uv_now(loop_) : current_tick_ * resolution_;
+  }
+
+ private:
+  void
+  expire(
+      uint64_t tick) {
+    // callbacks may schedule or cancel any node, so after each one the
+    // slot is scanned again from the top
+    for (;;) {
+      TimerNode* node = slots_[tick & mask_];
+      while (node && node->tick != tick) {
+        node = node->next;
+      }
+
+      if (!node) {
+        return;
+      }
+      cancel(node);
+      node->callback(node);
+    }
+  }
+
+  void
+  start() {
+    if (loop_ && !running_ && !closed_) {
+      running_ = true;
+      uv_timer_start(&timer_, TimingWheel::on_tick, resolution_, resolution_);
+    }
+  }
+
+  void
+  stop() {
+    if (loop_ && running_) {
+      running_ = false;
+      uv_timer_stop(&timer_);
+    }
+  }
+
+  static void
+  on_tick(
+      uv_timer_t* handle,
+      int         status) {
+    (void) status;
+    TimingWheel* wheel = reinterpret_cast<TimingWheel*>(handle->data);
+    wheel->advance(uv_now(wheel->loop_));
+  }
+
+  uv_loop_t*              loop_;
+  uv_timer_t              timer_;
+  uint64_t                resolution_;
+  std::vector<TimerNode*> slots_;
+  size_t                  mask_;
+  uint64_t                current_tick_;
+  size_t                  size_;
+  bool                    running_;
+  bool                    closed_;
+
+  TimingWheel(const TimingWheel&);
+  void operator=(const TimingWheel&);
+};
+}
+#endif
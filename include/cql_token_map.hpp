@@ -0,0 +1,122 @@
+/*
+  Copyright 2014 DataStax
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef __CQL_TOKEN_MAP_HPP_INCLUDED__
+#define __CQL_TOKEN_MAP_HPP_INCLUDED__
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "cql_host.hpp"
+
+namespace cql {
+
+/**
+ * The token ring, which hosts hold a copy of each partition. A token
+ * belongs to the first host token at or after it, wrapping around at the
+ * end of the ring; further replicas are the next distinct hosts walking
+ * on from there, the way SimpleStrategy places them.
+ *
+ * Replica sets are worked out for every position on the ring when the
+ * map is built, so a lookup is one binary search. Built once and then
+ * only read, safe to share between threads.
+ */
+class TokenMap {
+ public:
+  // indexes into the hosts the map was built from
+  typedef std::vector<size_t> Replicas;
+
+  TokenMap()
+  {}
+
+  /**
+   * @param hosts
+   * @param replication_factor copies of each partition, capped at the
+   *   number of hosts owning tokens
+   */
+  void
+  build(
+      const std::vector<Host>& hosts,
+      size_t                   replication_factor) {
+    ring_.clear();
+    replicas_.clear();
+
+    for (size_t i = 0; i < hosts.size(); ++i) {
+      for (std::vector<Token>::const_iterator it = hosts[i].tokens.begin();
+           it != hosts[i].tokens.end();
+           ++it) {
+        ring_.push_back(std::make_pair(*it, i));
+      }
+    }
+    std::sort(ring_.begin(), ring_.end());
+
+    size_t owners = 0;
+    for (size_t i = 0; i < hosts.size(); ++i) {
+      owners += !hosts[i].tokens.empty();
+    }
+    size_t copies = std::min(std::max<size_t>(replication_factor, 1), owners);
+
+    replicas_.resize(ring_.size());
+    for (size_t i = 0; i < ring_.size(); ++i) {
+      Replicas& replicas = replicas_[i];
+      replicas.reserve(copies);
+      for (size_t j = 0; replicas.size() < copies && j < ring_.size(); ++j) {
+        size_t host = ring_[(i + j) % ring_.size()].second;
+        if (std::find(replicas.begin(), replicas.end(), host)
+            == replicas.end()) {
+          replicas.push_back(host);
+        }
+      }
+    }
+  }
+
+  /**
+   * @param token
+   *
+   * @return the hosts holding token, primary first. NULL if no host
+   *   owns any tokens.
+   */
+  const Replicas*
+  replicas(
+      Token token) const {
+    if (ring_.empty()) {
+      return NULL;
+    }
+
+    RingCollection::const_iterator it = std::lower_bound(
+        ring_.begin(),
+        ring_.end(),
+        std::make_pair(token, static_cast<size_t>(0)));
+    if (it == ring_.end()) {
+      it = ring_.begin();
+    }
+    return &replicas_[it - ring_.begin()];
+  }
+
+  inline bool
+  empty() const {
+    return ring_.empty();
+  }
+
+ private:
+  typedef std::vector<std::pair<Token, size_t> > RingCollection;
+
+  RingCollection        ring_;
+  std::vector<Replicas> replicas_;
+};
+}
+#endif
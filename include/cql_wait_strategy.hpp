@@ -0,0 +1,232 @@
+/*
+  Copyright 2014 DataStax
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef __CQL_WAIT_STRATEGY_HPP_INCLUDED__
+#define __CQL_WAIT_STRATEGY_HPP_INCLUDED__
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "cql_futex.hpp"
+
+// polls before a waiter starts yielding its core
+#define CQL_WAIT_SPIN_LIMIT  128
+// yields before a waiter parks
+#define CQL_WAIT_YIELD_LIMIT 16
+
+namespace cql {
+
+inline void
+cpu_relax() {
+#if defined(__i386__) || defined(__x86_64__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+/**
+ * Wait strategies block a consumer until poll() succeeds. poll is any
+ * callable returning bool, typically a dequeue attempt. Producers call
+ * notify() after publishing, which only costs anything when a waiter is
+ * parked.
+ *
+ * wait returns false if the timeout, in microseconds, expires first; a
+ * timeout of 0 waits forever.
+ */
+
+/**
+ * Busy poll, lowest latency and burns a core while idle
+ */
+class SpinWaitStrategy {
+ public:
+  template<typename Poll>
+  bool
+  wait(
+      Poll     poll,
+      uint64_t timeout = 0) {
+    Deadline deadline(timeout);
+    for (;;) {
+      for (size_t i = 0; i < CQL_WAIT_SPIN_LIMIT; ++i) {
+        if (poll()) {
+          return true;
+        }
+        cpu_relax();
+      }
+      if (deadline.expired()) {
+        return poll();
+      }
+    }
+  }
+
+  inline void
+  notify() {}
+
+  inline void
+  notify_all() {}
+
+ protected:
+  struct Deadline {
+    bool                                  enabled;
+    std::chrono::steady_clock::time_point at;
+
+    Deadline(
+        uint64_t timeout) :
+        enabled(timeout != 0),
+        at(std::chrono::steady_clock::now()
+           + std::chrono::microseconds(timeout))
+    {}
+
+    inline bool
+    expired() {
+      return enabled && std::chrono::steady_clock::now() >= at;
+    }
+
+    inline uint64_t
+    remaining() {
+      std::chrono::steady_clock::duration left
+          = at - std::chrono::steady_clock::now();
+      int64_t us
+          = std::chrono::duration_cast<std::chrono::microseconds>(left)
+            .count();
+      return us > 0 ? us : 1;
+    }
+  };
+};
+
+/**
+ * Spin briefly, then give the core away between polls
+ */
+class YieldWaitStrategy : public SpinWaitStrategy {
+ public:
+  template<typename Poll>
+  bool
+  wait(
+      Poll     poll,
+      uint64_t timeout = 0) {
+    Deadline deadline(timeout);
+    for (size_t i = 0; i < CQL_WAIT_SPIN_LIMIT; ++i) {
+      if (poll()) {
+        return true;
+      }
+      cpu_relax();
+    }
+
+    for (;;) {
+      if (poll()) {
+        return true;
+      }
+      if (deadline.expired()) {
+        return false;
+      }
+      std::this_thread::yield();
+    }
+  }
+};
+
+/**
+ * Spin, yield, then sleep on a futex until a producer notifies. Producers
+ * skip the wakeup system call unless somebody is parked.
+ */
+class ParkWaitStrategy : public SpinWaitStrategy {
+ public:
+  ParkWaitStrategy() :
+      waiters_(0)
+  {}
+
+  template<typename Poll>
+  bool
+  wait(
+      Poll     poll,
+      uint64_t timeout = 0) {
+    Deadline deadline(timeout);
+    for (size_t i = 0; i < CQL_WAIT_SPIN_LIMIT; ++i) {
+      if (poll()) {
+        return true;
+      }
+      cpu_relax();
+    }
+
+    for (size_t i = 0; i < CQL_WAIT_YIELD_LIMIT; ++i) {
+      if (poll()) {
+        return true;
+      }
+      std::this_thread::yield();
+    }
+
+    for (;;) {
+      // read the epoch before announcing ourselves, a notify after this
+      // point changes it and the futex won't sleep
+      uint32_t epoch = epoch_.value().load(std::memory_order_acquire);
+      waiters_.fetch_add(1, std::memory_order_seq_cst);
+      if (poll()) {
+        waiters_.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+      }
+
+      if (deadline.expired()) {
+        waiters_.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+      }
+      epoch_.wait(epoch, timeout ? deadline.remaining() : 0);
+      waiters_.fetch_sub(1, std::memory_order_relaxed);
+
+      if (poll()) {
+        return true;
+      }
+    }
+  }
+
+  inline void
+  notify() {
+    wake(1);
+  }
+
+  inline void
+  notify_all() {
+    wake(INT_MAX);
+  }
+
+  inline size_t
+  waiters() {
+    return waiters_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  void
+  wake(
+      int count) {
+    // pairs with the seq_cst increment of waiters_: either we see the
+    // waiter or its poll sees what we published
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters_.load(std::memory_order_relaxed) == 0) {
+      return;
+    }
+    epoch_.value().fetch_add(1, std::memory_order_release);
+    epoch_.wake(count);
+  }
+
+  Futex               epoch_;
+  std::atomic<size_t> waiters_;
+
+  ParkWaitStrategy(const ParkWaitStrategy&);
+  void operator=(const ParkWaitStrategy&);
+};
+}
+#endif
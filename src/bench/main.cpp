@@ -0,0 +1,169 @@
+// This is free and unencumbered software released into the public domain.
+
+// Anyone is free to copy, modify, publish, use, compile, sell, or
+// distribute this software, either in source code form or as a compiled
+// binary, for any purpose, commercial or non-commercial, and by any
+// means.
+
+// In jurisdictions that recognize copyright laws, the author or authors
+// of this software dedicate any and all copyright interest in the
+// software to the public domain. We make this dedication for the benefit
+// of the public at large and to the detriment of our heirs and
+// successors. We intend this dedication to be an overt act of
+// relinquishment in perpetuity of all present and future rights to this
+// software under copyright law.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+// OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+// For more information, please refer to <http://unlicense.org/>
+
+// Round trip latency and throughput of Session::execute from a varying
+// number of application threads. Needs a node listening on the given host.
+//
+//   uv-bench [host] [requests per thread]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cql.h"
+#include "cql_cluster.hpp"
+
+#define BENCH_QUERY "SELECT release_version FROM system.local"
+
+typedef std::chrono::high_resolution_clock Clock;
+
+void
+bench_log(
+    int         level,
+    const char* message,
+    size_t      size) {
+  if (level <= CQL_LOG_ERROR) {
+    fprintf(stderr, "%.*s\n", static_cast<int>(size), message);
+  }
+}
+
+void
+bench_thread(
+    cql::Session*        session,
+    size_t               requests,
+    std::vector<double>* latencies,
+    std::atomic<size_t>* errors) {
+  latencies->reserve(requests);
+  for (size_t i = 0; i < requests; ++i) {
+    cql::Message* message = new cql::Message(CQL_OPCODE_QUERY);
+    static_cast<cql::BodyQuery*>(message->body.get())->query_string(
+        BENCH_QUERY);
+
+    Clock::time_point   start   = Clock::now();
+    cql::CallerRequest* request = session->execute(message);
+    request->wait();
+    Clock::time_point   end     = Clock::now();
+
+    if (request->error) {
+      errors->fetch_add(1);
+      delete request->error;
+    } else {
+      latencies->push_back(
+          std::chrono::duration<double, std::micro>(end - start).count());
+    }
+    delete request->result;
+    delete request;
+  }
+}
+
+double
+percentile(
+    const std::vector<double>& sorted,
+    double                     p) {
+  if (sorted.empty()) {
+    return 0.0;
+  }
+  size_t index = static_cast<size_t>(p * (sorted.size() - 1));
+  return sorted[index];
+}
+
+void
+bench_run(
+    cql::Session* session,
+    size_t        thread_count,
+    size_t        requests) {
+  std::vector<std::vector<double> > latencies(thread_count);
+  std::vector<std::thread>          threads;
+  std::atomic<size_t>               errors(0);
+
+  Clock::time_point start = Clock::now();
+  for (size_t i = 0; i < thread_count; ++i) {
+    threads.push_back(
+        std::thread(
+            bench_thread,
+            session,
+            requests,
+            &latencies[i],
+            &errors));
+  }
+  for (size_t i = 0; i < thread_count; ++i) {
+    threads[i].join();
+  }
+  double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+  std::vector<double> all;
+  double              total = 0.0;
+  for (size_t i = 0; i < thread_count; ++i) {
+    all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+  }
+  for (size_t i = 0; i < all.size(); ++i) {
+    total += all[i];
+  }
+  std::sort(all.begin(), all.end());
+
+  printf(
+      "threads %3zu  requests %8zu  errors %6zu  mean %9.1fus  "
+      "p50 %9.1fus  p99 %9.1fus  p999 %9.1fus  %10.0f req/s\n",
+      thread_count,
+      all.size(),
+      errors.load(),
+      all.empty() ? 0.0 : total / all.size(),
+      percentile(all, 0.5),
+      percentile(all, 0.99),
+      percentile(all, 0.999),
+      all.size() / elapsed);
+}
+
+int
+main(
+    int   argc,
+    char* argv[]) {
+  const char* host     = argc > 1 ? argv[1] : "127.0.0.1";
+  size_t      requests = argc > 2 ? strtoul(argv[2], NULL, 10) : 10000;
+
+  cql::Cluster cluster;
+  cluster.log_callback(bench_log);
+  cluster.option(CQL_OPTION_CONTACT_POINT_ADD, host, strlen(host));
+  cql::Session* session = cluster.connect();
+
+  // let the pools finish their handshakes
+  bench_run(session, 1, 1000);
+
+  const size_t thread_counts[] = { 1, 4, 16 };
+  for (size_t i = 0; i < sizeof(thread_counts) / sizeof(size_t); ++i) {
+    bench_run(session, thread_counts[i], requests);
+  }
+
+  session->shutdown();
+  delete session;
+  return 0;
+}
@@ -0,0 +1,319 @@
+// This is free and unencumbered software released into the public domain.
+
+// Anyone is free to copy, modify, publish, use, compile, sell, or
+// distribute this software, either in source code form or as a compiled
+// binary, for any purpose, commercial or non-commercial, and by any
+// means.
+
+// In jurisdictions that recognize copyright laws, the author or authors
+// of this software dedicate any and all copyright interest in the
+// software to the public domain. We make this dedication for the benefit
+// of the public at large and to the detriment of our heirs and
+// successors. We intend this dedication to be an overt act of
+// relinquishment in perpetuity of all present and future rights to this
+// software under copyright law.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+// OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+// For more information, please refer to <http://unlicense.org/>
+
+// Throughput and per call latency of cql::MpmcQueue against a mutex
+// protected deque, across producer/consumer shapes, element sizes and ring
+// sizes. Besides as many producers as consumers, one producer feeds many
+// consumers, like an IO loop handing callbacks to the executor, and many
+// producers feed one consumer, like application threads submitting to an
+// IO loop. The packed variant drops the cache line padding between the
+// head and tail sequences, the difference between it and the padded queue
+// is what false sharing costs.
+//
+// Latency is how long a single enqueue or dequeue call takes, timed around
+// the call, for calls which succeeded. Time spent retrying on a full or
+// empty ring isn't in it, that would measure how long elements sit in the
+// ring rather than what the queue costs. The clock's own overhead, printed
+// first, is included.
+//
+//   uv-queue-bench [max threads per side] [operations per run]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "cql_mpmc_queue.hpp"
+
+// every nth successful call records its latency
+#define BENCH_SAMPLE_RATE 16
+
+inline uint64_t
+now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template<size_t Size>
+struct Payload {
+  char data[Size];
+};
+
+/**
+ * The baseline, a bounded deque behind a mutex
+ */
+template<typename T>
+class MutexQueue {
+ public:
+  MutexQueue(
+      size_t size) :
+      size_(size)
+  {}
+
+  bool
+  enqueue(
+      const T& data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (queue_.size() >= size_) {
+      return false;
+    }
+    queue_.push_back(data);
+    return true;
+  }
+
+  bool
+  dequeue(
+      T& data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (queue_.empty()) {
+      return false;
+    }
+    data = queue_.front();
+    queue_.pop_front();
+    return true;
+  }
+
+ private:
+  const size_t  size_;
+  std::mutex    mutex_;
+  std::deque<T> queue_;
+};
+
+struct Latency {
+  uint64_t p50;
+  uint64_t p99;
+  uint64_t p999;
+};
+
+struct Result {
+  double  ops_per_second;
+  Latency enqueue;
+  Latency dequeue;
+};
+
+uint64_t
+percentile(
+    const std::vector<uint64_t>& sorted,
+    double                       p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  return sorted[static_cast<size_t>(p * (sorted.size() - 1))];
+}
+
+Latency
+latency(
+    std::vector<std::vector<uint64_t> >& samples) {
+  std::vector<uint64_t> all;
+  for (size_t i = 0; i < samples.size(); ++i) {
+    all.insert(all.end(), samples[i].begin(), samples[i].end());
+  }
+  std::sort(all.begin(), all.end());
+
+  Latency result;
+  result.p50  = percentile(all, 0.5);
+  result.p99  = percentile(all, 0.99);
+  result.p999 = percentile(all, 0.999);
+  return result;
+}
+
+/**
+ * the median cost of reading the clock twice, which every latency sample
+ * includes
+ */
+uint64_t
+clock_overhead() {
+  std::vector<uint64_t> samples(10000);
+  for (size_t i = 0; i < samples.size(); ++i) {
+    uint64_t start = now_ns();
+    samples[i] = now_ns() - start;
+  }
+  std::sort(samples.begin(), samples.end());
+  return percentile(samples, 0.5);
+}
+
+template<typename Queue,
+         typename T>
+Result
+bench_run(
+    size_t ring,
+    size_t producers,
+    size_t consumers,
+    size_t operations) {
+  Queue*                              queue = new Queue(ring);
+  std::atomic<bool>                   go(false);
+  std::atomic<size_t>                 consumed(0);
+  std::vector<std::vector<uint64_t> > enqueue_latencies(producers);
+  std::vector<std::vector<uint64_t> > dequeue_latencies(consumers);
+  std::vector<std::thread>            threads;
+  size_t                              per_producer = operations / producers;
+  size_t                              total        = per_producer * producers;
+
+  for (size_t p = 0; p < producers; ++p) {
+    std::vector<uint64_t>* samples = &enqueue_latencies[p];
+    samples->reserve(per_producer / BENCH_SAMPLE_RATE + 1);
+    threads.push_back(std::thread([&, samples] {
+      T item;
+      memset(&item, 0, sizeof(item));
+      while (!go.load()) {}
+      for (size_t i = 0; i < per_producer; ++i) {
+        for (;;) {
+          uint64_t start  = now_ns();
+          bool     queued = queue->enqueue(item);
+          uint64_t end    = now_ns();
+          if (queued) {
+            if (i % BENCH_SAMPLE_RATE == 0) {
+              samples->push_back(end - start);
+            }
+            break;
+          }
+          // more threads than cores is common on test boxes
+          std::this_thread::yield();
+        }
+      }
+    }));
+  }
+
+  for (size_t c = 0; c < consumers; ++c) {
+    std::vector<uint64_t>* samples = &dequeue_latencies[c];
+    samples->reserve(total / consumers / BENCH_SAMPLE_RATE + 1);
+    threads.push_back(std::thread([&, samples] {
+      T      item;
+      size_t count = 0;
+      while (!go.load()) {}
+      while (consumed.load(std::memory_order_relaxed) < total) {
+        uint64_t start    = now_ns();
+        bool     dequeued = queue->dequeue(item);
+        uint64_t end      = now_ns();
+        if (!dequeued) {
+          std::this_thread::yield();
+          continue;
+        }
+        consumed.fetch_add(1, std::memory_order_relaxed);
+        if (++count % BENCH_SAMPLE_RATE == 0) {
+          samples->push_back(end - start);
+        }
+      }
+    }));
+  }
+
+  uint64_t start = now_ns();
+  go.store(true);
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i].join();
+  }
+  double elapsed = (now_ns() - start) / 1e9;
+  delete queue;
+
+  Result result;
+  result.ops_per_second = total / elapsed;
+  result.enqueue        = latency(enqueue_latencies);
+  result.dequeue        = latency(dequeue_latencies);
+  return result;
+}
+
+template<typename T>
+void
+bench_shape(
+    size_t ring,
+    size_t producers,
+    size_t consumers,
+    size_t operations) {
+  const char* names[] = { "mpmc", "mpmc-packed", "mutex-deque" };
+  Result      results[3];
+  results[0] = bench_run<cql::MpmcQueue<T>, T>(
+      ring, producers, consumers, operations);
+  results[1] = bench_run<cql::MpmcQueue<T, false>, T>(
+      ring, producers, consumers, operations);
+  results[2] = bench_run<MutexQueue<T>, T>(
+      ring, producers, consumers, operations);
+
+  for (size_t q = 0; q < 3; ++q) {
+    printf(
+        "%-12s elem %4zu  ring %6zu  %2zuP/%2zuC  %8.2f Mops/s  "
+        "enqueue p50/p99/p999 %6llu %7llu %8llu ns  "
+        "dequeue p50/p99/p999 %6llu %7llu %8llu ns\n",
+        names[q],
+        sizeof(T),
+        ring,
+        producers,
+        consumers,
+        results[q].ops_per_second / 1e6,
+        static_cast<unsigned long long>(results[q].enqueue.p50),
+        static_cast<unsigned long long>(results[q].enqueue.p99),
+        static_cast<unsigned long long>(results[q].enqueue.p999),
+        static_cast<unsigned long long>(results[q].dequeue.p50),
+        static_cast<unsigned long long>(results[q].dequeue.p99),
+        static_cast<unsigned long long>(results[q].dequeue.p999));
+  }
+}
+
+template<typename T>
+void
+bench_element(
+    size_t max_threads,
+    size_t operations) {
+  const size_t rings[] = { 256, 4096, 65536 };
+
+  for (size_t r = 0; r < sizeof(rings) / sizeof(size_t); ++r) {
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+      bench_shape<T>(rings[r], threads, threads, operations);
+      if (threads > 1) {
+        bench_shape<T>(rings[r], 1, threads, operations);
+        bench_shape<T>(rings[r], threads, 1, operations);
+      }
+    }
+  }
+}
+
+int
+main(
+    int   argc,
+    char* argv[]) {
+  size_t max_threads = argc > 1 ? strtoul(argv[1], NULL, 10) : 4;
+  size_t operations  = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+  if (max_threads == 0) {
+    max_threads = 1;
+  }
+
+  printf(
+      "%u hardware threads, %zu operations per run, "
+      "latency per successful call including %llu ns of clock overhead\n",
+      std::thread::hardware_concurrency(),
+      operations,
+      static_cast<unsigned long long>(clock_overhead()));
+  bench_element<Payload<8> >(max_threads, operations);
+  bench_element<Payload<64> >(max_threads, operations);
+  bench_element<Payload<256> >(max_threads, operations);
+  return 0;
+}
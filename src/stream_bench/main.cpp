@@ -0,0 +1,160 @@
+// This is free and unencumbered software released into the public domain.
+
+// Anyone is free to copy, modify, publish, use, compile, sell, or
+// distribute this software, either in source code form or as a compiled
+// binary, for any purpose, commercial or non-commercial, and by any
+// means.
+
+// In jurisdictions that recognize copyright laws, the author or authors
+// of this software dedicate any and all copyright interest in the
+// software to the public domain. We make this dedication for the benefit
+// of the public at large and to the detriment of our heirs and
+// successors. We intend this dedication to be an overt act of
+// relinquishment in perpetuity of all present and future rights to this
+// software under copyright law.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+// OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+// For more information, please refer to <http://unlicense.org/>
+
+// Set/get cost of cql::StreamStorage against the array backed storage it
+// replaced, with half the id space in flight and ids completing out of
+// order.
+//
+//   uv-stream-bench
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "cql.h"
+#include "cql_error.hpp"
+#include "cql_stream_storage.hpp"
+
+// the array backed StreamStorage the bitmap version replaced, kept to
+// benchmark against
+template <typename IdType,
+          typename StorageType,
+          size_t   Max>
+class LegacyStreamStorage {
+ public:
+  LegacyStreamStorage() :
+      available_streams_index_(0) {
+    for (size_t i = 1; i <= Max; ++i) {
+      available_streams_[i - 1] = i;
+      allocated_streams_[i]     = false;
+    }
+  }
+
+  inline cql::Error*
+  set_stream(
+      const StorageType& input,
+      IdType&            output) {
+    if (available_streams_index_ >= Max) {
+      return new cql::Error(
+          CQL_ERROR_SOURCE_LIBRARY,
+          CQL_ERROR_LIB_NO_STREAMS,
+          "no available streams",
+          __FILE__,
+          __LINE__);
+    }
+
+    intptr_t index             = available_streams_index_++;
+    output                     = available_streams_[index];
+    storage_[output]           = input;
+    allocated_streams_[output] = true;
+    return CQL_ERROR_NO_ERROR;
+  }
+
+  inline cql::Error*
+  get_stream(
+      const IdType& input,
+      StorageType&  output) {
+    output = storage_[static_cast<int>(input)];
+    if (allocated_streams_[input]) {
+      available_streams_[--available_streams_index_] = input;
+      allocated_streams_[input] = false;
+    } else {
+      return new cql::Error(
+          CQL_ERROR_SOURCE_LIBRARY,
+          CQL_ERROR_LIB_NO_STREAMS,
+          "this stream has already been released",
+          __FILE__,
+          __LINE__);
+    }
+    return CQL_ERROR_NO_ERROR;
+  }
+
+ private:
+  uintptr_t   available_streams_index_;
+  IdType      available_streams_[Max];
+  bool        allocated_streams_[Max + 1];
+  StorageType storage_[Max + 1];
+};
+
+/**
+ * keep half the id space in flight and complete requests oldest first,
+ * which scatters the free ids the way out of order responses do
+ *
+ * @return nanoseconds per set/get pair
+ */
+template <typename Storage,
+          size_t   Max>
+double
+bench_stream_storage_run(
+    Storage& streams) {
+  const size_t iterations = 1000000;
+  const size_t in_flight  = Max / 2 ? Max / 2 : 1;
+
+  std::vector<int16_t> pending(in_flight);
+  for (size_t i = 0; i < in_flight; ++i) {
+    streams.set_stream(&pending, pending[i]);
+  }
+
+  std::chrono::steady_clock::time_point start
+      = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iterations; ++i) {
+    size_t             slot  = (i * 7919) % in_flight;
+    std::vector<int16_t>* value = NULL;
+    streams.get_stream(pending[slot], value);
+    streams.set_stream(value, pending[slot]);
+  }
+  std::chrono::nanoseconds elapsed
+      = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start);
+  return static_cast<double>(elapsed.count()) / iterations;
+}
+
+template <size_t Max>
+void
+bench_stream_storage_size() {
+  typedef LegacyStreamStorage<int16_t, std::vector<int16_t>*, Max> Legacy;
+  typedef cql::StreamStorage<int16_t, std::vector<int16_t>*, Max>  Bitmap;
+
+  std::unique_ptr<Legacy> legacy(new Legacy());
+  std::unique_ptr<Bitmap> bitmap(new Bitmap());
+  double legacy_ns = bench_stream_storage_run<Legacy, Max>(*legacy);
+  double bitmap_ns = bench_stream_storage_run<Bitmap, Max>(*bitmap);
+  printf(
+      "stream storage %5zu streams: legacy %6.2f ns/op, bitmap %6.2f ns/op\n",
+      Max,
+      legacy_ns,
+      bitmap_ns);
+}
+
+int
+main() {
+  bench_stream_storage_size<127>();
+  bench_stream_storage_size<1024>();
+  bench_stream_storage_size<32767>();
+  return 0;
+}
@@ -25,12 +25,25 @@
 
 #include <stdio.h>
 #include <iostream>
+#include <thread>
 
+#include "cql_callback_executor.hpp"
+#include "cql_cluster.hpp"
 #include "cql_common.hpp"
+#include "cql_completion.hpp"
+#include "cql_control_connection.hpp"
+#include "cql_load_balancing.hpp"
 #include "cql_message.hpp"
+#include "cql_metadata.hpp"
+#include "cql_mpmc_queue.hpp"
+#include "cql_murmur3.hpp"
+#include "cql_receive_buffer.hpp"
+#include "cql_segmented_queue.hpp"
 #include "cql_ssl_context.hpp"
 #include "cql_ssl_session.hpp"
 #include "cql_stream_storage.hpp"
+#include "cql_timing_wheel.hpp"
+#include "cql_wait_strategy.hpp"
 
 char TEST_MESSAGE_ERROR[] = {
   0x81, 0x01, 0x7F, 0x00, 0x00, 0x00, 0x00, 0x0C,  // header
@@ -120,6 +133,161 @@ test_error_consume() {
   return true;
 }
 
+bool
+test_error_consume_in_place() {
+  // two complete frames back to back in one read buffer
+  size_t         size = sizeof(TEST_MESSAGE_ERROR) * 2;
+  char*          data = new char[size];
+  memcpy(data, TEST_MESSAGE_ERROR, sizeof(TEST_MESSAGE_ERROR));
+  memcpy(data + sizeof(TEST_MESSAGE_ERROR),
+         TEST_MESSAGE_ERROR,
+         sizeof(TEST_MESSAGE_ERROR));
+  cql::RefBuffer* buffer = new cql::RefBuffer(data, size);
+
+  {
+    cql::Message first;
+    cql::Message second;
+    CHECK_EQUAL(
+        first.consume(data, size, buffer),
+        sizeof(TEST_MESSAGE_ERROR));
+    CHECK_EQUAL(
+        second.consume(data + sizeof(TEST_MESSAGE_ERROR),
+                       sizeof(TEST_MESSAGE_ERROR),
+                       buffer),
+        sizeof(TEST_MESSAGE_ERROR));
+    CHECK(first.body_ready);
+    CHECK(second.body_ready);
+    CHECK_EQUAL(buffer->ref_count(), 3);
+
+    // the body should point directly into the read buffer
+    cql::BodyError* error = static_cast<cql::BodyError*>(first.body.get());
+    CHECK((error->message >= data && error->message < data + size));
+    CHECK_EQUAL(error->message_size, 6);
+    CHECK_EQUAL(memcmp(error->message, "foobar", 6), 0);
+  }
+  CHECK_EQUAL(buffer->ref_count(), 1);
+  buffer->release();
+  return true;
+}
+
+bool
+test_error_consume_split() {
+  // a frame straddling reads falls back to copying
+  char*           data   = new char[sizeof(TEST_MESSAGE_ERROR)];
+  memcpy(data, TEST_MESSAGE_ERROR, sizeof(TEST_MESSAGE_ERROR));
+  cql::RefBuffer* buffer = new cql::RefBuffer(data, sizeof(TEST_MESSAGE_ERROR));
+
+  cql::Message message;
+  CHECK_EQUAL(message.consume(data, 5, buffer), 5);
+  CHECK_EQUAL(message.consume(data + 5, 6, buffer), 6);
+  CHECK(!message.body_ready);
+  CHECK_EQUAL(
+      message.consume(data + 11, sizeof(TEST_MESSAGE_ERROR) - 11, buffer),
+      sizeof(TEST_MESSAGE_ERROR) - 11);
+  CHECK(message.body_ready);
+  CHECK_EQUAL(buffer->ref_count(), 1);
+
+  cql::BodyError* error = static_cast<cql::BodyError*>(message.body.get());
+  CHECK_EQUAL(error->message_size, 6);
+  CHECK_EQUAL(memcmp(error->message, "foobar", 6), 0);
+  buffer->release();
+  return true;
+}
+
+bool
+test_receive_buffer() {
+  cql::ReceiveBuffer receive;
+
+  // steady state reads recycle the same block
+  for (int i = 0; i < 100; ++i) {
+    uv_buf_t buf = receive.allocate();
+    CHECK((buf.len >= CQL_RECEIVE_BUFFER_MIN_READ));
+    receive.commit(buf.len);
+  }
+  CHECK_EQUAL(receive.allocations(), 1);
+
+  // a block pinned by a message isn't reused
+  uv_buf_t        buf    = receive.allocate();
+  cql::RefBuffer* pinned = receive.commit(buf.len);
+  pinned->retain();
+  buf = receive.allocate();
+  CHECK_EQUAL(receive.allocations(), 2);
+  receive.commit(buf.len);
+  pinned->release();
+
+  // large frames grow the block size
+  receive.observe_frame(CQL_RECEIVE_BUFFER_MIN_SIZE);
+  buf = receive.allocate();
+  CHECK_EQUAL(receive.block_size(), CQL_RECEIVE_BUFFER_MIN_SIZE * 2);
+  CHECK_EQUAL(buf.len, CQL_RECEIVE_BUFFER_MIN_SIZE * 2);
+  receive.commit(buf.len);
+
+  // and shrink back once they stop
+  for (int i = 0; i <= CQL_RECEIVE_BUFFER_WINDOW; ++i) {
+    buf = receive.allocate();
+    receive.commit(buf.len);
+  }
+  CHECK_EQUAL(receive.block_size(), CQL_RECEIVE_BUFFER_MIN_SIZE);
+
+  // an oversized buffer shrinks once nothing points into it
+  receive.observe_frame(CQL_RECEIVE_BUFFER_MIN_SIZE * 2);
+  buf    = receive.allocate();
+  pinned = receive.commit(buf.len);
+  CHECK_EQUAL(receive.block_size(), CQL_RECEIVE_BUFFER_MIN_SIZE * 4);
+  pinned->retain();
+  CHECK(!receive.shrink());
+  CHECK_EQUAL(receive.block_size(), CQL_RECEIVE_BUFFER_MIN_SIZE * 4);
+  pinned->release();
+  CHECK(receive.shrink());
+  CHECK_EQUAL(receive.block_size(), CQL_RECEIVE_BUFFER_MIN_SIZE);
+  buf = receive.allocate();
+  CHECK_EQUAL(buf.len, CQL_RECEIVE_BUFFER_MIN_SIZE);
+  CHECK(!receive.shrink());
+  return true;
+}
+
+bool
+test_object_pool() {
+  cql::ObjectPools pools;
+
+  cql::Message* message = new (pools.message) cql::Message(pools.body);
+  CHECK_EQUAL(message->consume(TEST_MESSAGE_ERROR,
+                               sizeof(TEST_MESSAGE_ERROR)),
+              sizeof(TEST_MESSAGE_ERROR));
+  CHECK(message->body_ready);
+  delete message;
+  CHECK_EQUAL(pools.message->misses(), 1);
+  CHECK_EQUAL(pools.body->misses(), 1);
+
+  // the second round trip should be served from the free lists
+  message = new (pools.message) cql::Message(pools.body);
+  CHECK_EQUAL(message->consume(TEST_MESSAGE_ERROR,
+                               sizeof(TEST_MESSAGE_ERROR)),
+              sizeof(TEST_MESSAGE_ERROR));
+  delete message;
+  CHECK_EQUAL(pools.message->hits(), 1);
+  CHECK_EQUAL(pools.body->hits(), 1);
+  CHECK_EQUAL(pools.message->hit_rate(), 0.5);
+
+  cql::CallerRequest* request = new (pools.request) cql::CallerRequest();
+  delete request;
+  request = new (pools.request) cql::CallerRequest();
+  delete request;
+  CHECK_EQUAL(pools.request->hits(), 1);
+
+  // objects allocated without a pool go back to the heap
+  message = new cql::Message(CQL_OPCODE_QUERY);
+  delete message;
+  CHECK_EQUAL(pools.message->hits() + pools.message->misses(), 2);
+
+  // an object may outlive the set it came from, its pool goes with it
+  cql::ObjectPools* retired = new cql::ObjectPools();
+  request = new (retired->request) cql::CallerRequest();
+  delete retired;
+  delete request;
+  return true;
+}
+
 bool
 test_error_prepare() {
   cql::Message message;
@@ -498,14 +666,2166 @@ test_ssl() {
   return true;
 }
 
+std::string
+flatten_segments(
+    std::vector<char>&                scratch,
+    const cql::FrameSegmentCollection& segments) {
+  std::vector<uv_buf_t> buffers;
+  std::vector<char*>    owned;
+  cql::FrameWriter::resolve(scratch, segments, buffers, owned);
+
+  std::string output;
+  for (size_t i = 0; i < buffers.size(); ++i) {
+    output.append(buffers[i].base, buffers[i].len);
+  }
+
+  for (size_t i = 0; i < owned.size(); ++i) {
+    delete[] owned[i];
+  }
+  return output;
+}
+
+bool
+test_options_encode() {
+  cql::Message                message(CQL_OPCODE_OPTIONS);
+  std::vector<char>           scratch;
+  cql::FrameSegmentCollection segments;
+  cql::FrameWriter            writer(scratch, segments);
+
+  CHECK(message.prepare(writer));
+  CHECK_EQUAL(writer.size(), sizeof(TEST_MESSAGE_OPTIONS));
+
+  std::string output = flatten_segments(scratch, segments);
+  CHECK_EQUAL(
+      output.compare(
+          0,
+          output.size(),
+          TEST_MESSAGE_OPTIONS,
+          sizeof(TEST_MESSAGE_OPTIONS)),
+      0);
+  return true;
+}
+
+bool
+test_query_encode_values() {
+  std::string small_value("system.peers");
+  std::string large_value(CQL_FRAME_WRITER_REFERENCE_MIN * 4, 'x');
+
+  cql::Message    message(CQL_OPCODE_QUERY);
+  cql::BodyQuery* query = static_cast<cql::BodyQuery*>(message.body.get());
+  query->query_string("SELECT * FROM ? WHERE blob = ?;");
+  query->add_value(small_value.c_str(), small_value.size());
+  query->add_value(large_value.c_str(), large_value.size());
+  query->consistency(CQL_CONSISTENCY_ONE);
+  query->page_size(100);
+  query->paging_state("foobar", 6);
+
+  std::unique_ptr<char> buffer;
+  char*                 buffer_ptr;
+  size_t                size;
+  CHECK(message.prepare(&buffer_ptr, size));
+  buffer.reset(buffer_ptr);
+
+  std::vector<char>           scratch;
+  cql::FrameSegmentCollection segments;
+  cql::FrameWriter            writer(scratch, segments);
+  CHECK(message.prepare(writer));
+
+  // scratch, the referenced large value, then the remaining scratch
+  CHECK_EQUAL(segments.size(), 3);
+  CHECK((segments[1].base == large_value.c_str()));
+  CHECK(!segments[1].owned);
+
+  std::string output = flatten_segments(scratch, segments);
+  CHECK_EQUAL(output.size(), size);
+  CHECK_EQUAL(memcmp(output.c_str(), buffer.get(), size), 0);
+  return true;
+}
+
+bool
+test_compression() {
+  int algorithms[] = {
+    CQL_OPTION_COMPRESSION_SNAPPY,
+    CQL_OPTION_COMPRESSION_LZ4
+  };
+
+  std::string text(CQL_COMPRESSION_MIN_SIZE * 4, 'a');
+  for (size_t i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); ++i) {
+    int algorithm = algorithms[i];
+    if (!cql::compression_available(algorithm)) {
+      continue;
+    }
+
+    cql::Message message;
+    message.opcode = CQL_OPCODE_ERROR;
+    message.body.reset(new cql::BodyError(1, text.c_str(), text.size()));
+
+    std::vector<char>           scratch;
+    cql::FrameSegmentCollection segments;
+    cql::FrameWriter            writer(scratch, segments);
+    CHECK(message.prepare(writer, algorithm));
+    CHECK((message.flags & CQL_FLAG_COMPRESSION));
+
+    std::string output = flatten_segments(scratch, segments);
+    CHECK((output.size() < text.size()));
+
+    cql::Message response;
+    response.compression = algorithm;
+    CHECK_EQUAL(
+        response.consume(const_cast<char*>(output.c_str()), output.size()),
+        static_cast<int>(output.size()));
+    CHECK(response.body_ready);
+    CHECK(!response.body_error);
+
+    cql::BodyError* error = static_cast<cql::BodyError*>(response.body.get());
+    CHECK_EQUAL(error->message_size, text.size());
+    CHECK_EQUAL(memcmp(error->message, text.c_str(), text.size()), 0);
+  }
+
+  // tiny bodies skip compression
+  cql::Message                message(CQL_OPCODE_OPTIONS);
+  std::vector<char>           scratch;
+  cql::FrameSegmentCollection segments;
+  cql::FrameWriter            writer(scratch, segments);
+  CHECK(message.prepare(writer, CQL_OPTION_COMPRESSION_LZ4));
+  CHECK(!(message.flags & CQL_FLAG_COMPRESSION));
+  return true;
+}
+
+bool
+test_error_v3() {
+  // same frame as TEST_MESSAGE_ERROR with the 9 byte v3 header
+  cql::Message message;
+  message.version = 0x83;
+  message.flags   = 0x00;
+  message.stream  = 0x1234;
+  message.opcode  = CQL_OPCODE_ERROR;
+  message.body.reset(new cql::BodyError(0xFFFFFFFF, (const char*)"foobar", 6));
+
+  std::vector<char>           scratch;
+  cql::FrameSegmentCollection segments;
+  cql::FrameWriter            writer(scratch, segments);
+  CHECK(message.prepare(writer));
+
+  std::string output = flatten_segments(scratch, segments);
+  CHECK_EQUAL(output.size(), CQL_HEADER_SIZE_V3 + 12);
+  CHECK_EQUAL(static_cast<int>(output[2]), 0x12);
+  CHECK_EQUAL(static_cast<int>(output[3]), 0x34);
+
+  // parsed in place, and again a byte at a time through the copy path
+  char*           data   = new char[output.size()];
+  memcpy(data, output.c_str(), output.size());
+  cql::RefBuffer* buffer = new cql::RefBuffer(data, output.size());
+  {
+    cql::Message in_place;
+    CHECK_EQUAL(
+        in_place.consume(data, output.size(), buffer),
+        static_cast<int>(output.size()));
+    CHECK(in_place.body_ready);
+    CHECK_EQUAL(static_cast<int>(in_place.stream), 0x1234);
+    CHECK_EQUAL(static_cast<int>(in_place.opcode), CQL_OPCODE_ERROR);
+    CHECK_EQUAL(static_cast<int>(in_place.length), 12);
+  }
+
+  cql::Message copied;
+  for (size_t i = 0; i < output.size(); ++i) {
+    CHECK(!copied.body_ready);
+    CHECK_EQUAL(copied.consume(data + i, 1), 1);
+  }
+  CHECK(copied.body_ready);
+  CHECK_EQUAL(static_cast<int>(copied.stream), 0x1234);
+
+  cql::BodyError* error = static_cast<cql::BodyError*>(copied.body.get());
+  CHECK_EQUAL(error->message_size, 6);
+  CHECK_EQUAL(memcmp(error->message, "foobar", 6), 0);
+  buffer->release();
+
+  // v2 stream ids are signed bytes, events use -1
+  char event[] = { 0x02, 0x00, -1, 0x0C, 0x00, 0x00, 0x00, 0x00 };
+  cql::Message v2;
+  v2.decode_header(event);
+  CHECK_EQUAL(static_cast<int>(v2.stream), -1);
+  return true;
+}
+
+bool
+test_stream_storage_limit() {
+  typedef cql::StreamStorage<int16_t, int, 32767> StreamStorageCollection;
+
+  StreamStorageCollection streams;
+  CHECK_EQUAL(streams.available_streams(), 32767);
+  CHECK_EQUAL(streams.capacity(), 0);
+
+  // limited to the v2 id space every id handed out fits in a byte
+  streams.max_streams(127);
+  CHECK_EQUAL(streams.available_streams(), 127);
+  for (int i = 0; i < 127; ++i) {
+    int16_t stream = 0;
+    CHECK(!streams.set_stream(i, stream));
+    CHECK(((stream >= 1) && (stream <= 127)));
+  }
+
+  int16_t stream = 0;
+  CHECK_EQUAL(streams.set_stream(0, stream), CQL_ERROR_LIB_NO_STREAMS);
+  // only the groups the ids came from were allocated
+  CHECK_EQUAL(streams.capacity(), 128);
+
+  // out of range ids are rejected instead of indexing past the storage,
+  // as are ids past the groups allocated so far
+  int value = 0;
+  CHECK_EQUAL(streams.get_stream(-1, value), CQL_ERROR_LIB_INVALID_STREAM);
+  CHECK_EQUAL(streams.get_stream(0, value), CQL_ERROR_LIB_INVALID_STREAM);
+  CHECK_EQUAL(streams.get_stream(1000, value), CQL_ERROR_LIB_INVALID_STREAM);
+  CHECK(!streams.in_use(1000));
+  CHECK_EQUAL(streams.update_stream(1000, 0), CQL_ERROR_LIB_INVALID_STREAM);
+  return true;
+}
+
+bool
+test_stream_storage_bitmap() {
+  // spans several groups and a partial last group
+  typedef cql::StreamStorage<int, int, 200> StreamStorageCollection;
+
+  StreamStorageCollection streams;
+  for (int i = 1; i <= 200; ++i) {
+    int stream = 0;
+    CHECK_EQUAL(streams.set_stream(i * 10, stream), CQL_ERROR_NO_ERROR);
+    CHECK_EQUAL(stream, i);
+  }
+  CHECK_EQUAL(streams.available_streams(), 0);
+  CHECK_EQUAL(streams.capacity(), 200);
+
+  // released ids are handed out again lowest first
+  int ids[] = { 150, 3, 64, 65, 129 };
+  for (size_t i = 0; i < sizeof(ids) / sizeof(ids[0]); ++i) {
+    int value = 0;
+    CHECK_EQUAL(streams.get_stream(ids[i], value), CQL_ERROR_NO_ERROR);
+    CHECK_EQUAL(value, ids[i] * 10);
+  }
+  CHECK_EQUAL(streams.available_streams(), 5);
+
+  int expected[] = { 3, 64, 65, 129, 150 };
+  for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i) {
+    int stream = 0;
+    CHECK_EQUAL(streams.set_stream(0, stream), CQL_ERROR_NO_ERROR);
+    CHECK_EQUAL(stream, expected[i]);
+  }
+
+  int stream = 0;
+  CHECK_EQUAL(streams.set_stream(0, stream), CQL_ERROR_LIB_NO_STREAMS);
+  int value = 0;
+  CHECK_EQUAL(streams.get_stream(201, value), CQL_ERROR_LIB_INVALID_STREAM);
+  return true;
+}
+
+void
+count_timer(
+    cql::TimerNode* timer) {
+  ++*reinterpret_cast<int*>(timer->data);
+}
+
+bool
+test_timing_wheel() {
+  // 8 slots of 10ms, one turn of the wheel is 80ms
+  cql::TimingWheel wheel(NULL, 10, 8);
+
+  int             fired[3] = { 0, 0, 0 };
+  cql::TimerNode  timers[3];
+  for (int i = 0; i < 3; ++i) {
+    timers[i].data = &fired[i];
+  }
+
+  wheel.schedule(&timers[0], 25, count_timer);
+  wheel.schedule(&timers[1], 100, count_timer);  // wraps around once
+  wheel.schedule(&timers[2], 50, count_timer);
+  CHECK_EQUAL(wheel.size(), 3);
+
+  wheel.cancel(&timers[2]);
+  wheel.cancel(&timers[2]);
+  CHECK_EQUAL(wheel.size(), 2);
+
+  wheel.advance(20);
+  CHECK_EQUAL(fired[0], 0);
+  wheel.advance(30);
+  CHECK_EQUAL(fired[0], 1);
+
+  // the slot for 100ms comes round at 20ms, it must not fire early
+  wheel.advance(99);
+  CHECK_EQUAL(fired[1], 0);
+  wheel.advance(100);
+  CHECK_EQUAL(fired[1], 1);
+  CHECK_EQUAL(fired[2], 0);
+  CHECK_EQUAL(wheel.size(), 0);
+  return true;
+}
+
+char*
+test_result_void(
+    int16_t stream) {
+  // v3 RESULT frame of kind VOID
+  char* frame = new char[CQL_HEADER_SIZE_V3 + 4];
+  frame[0] = (char) 0x83;
+  frame[1] = 0x00;
+  cql::encode_short(frame + 2, stream);
+  frame[4] = CQL_OPCODE_RESULT;
+  cql::encode_int(frame + 5, 4);
+  cql::encode_int(frame + 9, CQL_RESULT_KIND_VOID);
+  return frame;
+}
+
+char*
+test_error_overloaded(
+    int16_t stream) {
+  // v3 ERROR frame, the server is overloaded
+  char* frame = new char[CQL_HEADER_SIZE_V3 + 12];
+  frame[0] = (char) 0x83;
+  frame[1] = 0x00;
+  cql::encode_short(frame + 2, stream);
+  frame[4] = CQL_OPCODE_ERROR;
+  cql::encode_int(frame + 5, 12);
+  cql::encode_int(frame + 9, 0x1001);
+  cql::encode_string(frame + 13, "foobar", 6);
+  return frame;
+}
+
+/**
+ * make a connection look open without a server, its socket never
+ * connected so every write to it fails
+ *
+ * @param connection
+ * @param loop
+ */
+void
+test_open_connection(
+    cql::ClientConnection& connection,
+    uv_loop_t*             loop) {
+  uv_tcp_init(loop, &connection.socket_);
+  connection.state_ = cql::ClientConnection::CLIENT_STATE_READY;
+}
+
+bool
+test_request_timeout() {
+  uv_loop_t*             loop = uv_loop_new();
+  cql::TimingWheel       wheel(loop);
+  cql::ClientConnection* connection
+      = new cql::ClientConnection(loop, NULL, NULL, &wheel);
+  test_open_connection(*connection, loop);
+  connection->request_timeout(50);
+  size_t streams = connection->available_streams();
+
+  cql::Message message(CQL_OPCODE_QUERY);
+  static_cast<cql::BodyQuery*>(message.body.get())->query_string("SELECT");
+
+  cql::CallerRequest* slow = connection->exec(&message);
+  int16_t             slow_stream = message.stream;
+  cql::CallerRequest* fast = connection->exec(&message);
+  int16_t             fast_stream = message.stream;
+  CHECK_EQUAL(connection->available_streams(), streams - 2);
+  CHECK_EQUAL(wheel.size(), 2);
+
+  // the fast response cancels its timer
+  std::unique_ptr<char> frame(test_result_void(fast_stream));
+  connection->consume(frame.get(), CQL_HEADER_SIZE_V3 + 4);
+  CHECK(fast->ready());
+  CHECK(!fast->error);
+  CHECK(fast->result);
+  CHECK_EQUAL(wheel.size(), 1);
+  CHECK_EQUAL(connection->waiting_requests(), 1);
+
+  while (!slow->ready()) {
+    uv_run(loop, UV_RUN_ONCE);
+  }
+  CHECK(slow->error);
+  CHECK_EQUAL(slow->error->code, CQL_ERROR_LIB_REQUEST_TIMEOUT);
+
+  // the stream is held until the late response turns up
+  CHECK_EQUAL(connection->available_streams(), streams - 1);
+  CHECK_EQUAL(connection->waiting_requests(), 0);
+  frame.reset(test_result_void(slow_stream));
+  connection->consume(frame.get(), CQL_HEADER_SIZE_V3 + 4);
+  CHECK_EQUAL(connection->available_streams(), streams);
+
+  // closing fails whatever is still waiting
+  cql::CallerRequest* closed = connection->exec(&message);
+  connection->close();
+  uv_run(loop, UV_RUN_DEFAULT);
+  CHECK(connection->is_closed());
+  CHECK(closed->ready());
+  CHECK(closed->error);
+  CHECK_EQUAL(closed->error->code, CQL_ERROR_LIB_CONNECTION_CLOSED);
+  CHECK_EQUAL(connection->available_streams(), streams);
+  delete connection;
+
+  // and so does deleting a connection which never opened
+  connection = new cql::ClientConnection(loop, NULL, NULL, &wheel);
+  cql::CallerRequest* deleted = connection->exec(&message);
+  CHECK_EQUAL(wheel.size(), 1);
+  connection->close();
+  // the wheel keeps the loop alive until the request would time out
+  uv_run(loop, UV_RUN_NOWAIT);
+  CHECK(!deleted->ready());
+  delete connection;
+  CHECK(deleted->ready());
+  CHECK(deleted->error);
+  CHECK_EQUAL(deleted->error->code, CQL_ERROR_LIB_CONNECTION_CLOSED);
+  CHECK_EQUAL(wheel.size(), 0);
+
+  wheel.close();
+  uv_run(loop, UV_RUN_DEFAULT);
+  uv_loop_delete(loop);
+
+  delete fast->result;
+  delete fast;
+  delete slow->error;
+  delete slow;
+  delete closed->error;
+  delete closed;
+  delete deleted->error;
+  delete deleted;
+  return true;
+}
+
+bool
+test_write_batch_delay() {
+  uv_loop_t*            loop = uv_loop_new();
+  cql::ClientConnection connection(loop, NULL);
+  test_open_connection(connection, loop);
+  connection.write_batching(3, CQL_WRITE_BATCH_MAX_BYTES, 50);
+
+  uv_update_time(loop);
+  uint64_t start = uv_now(loop);
+  connection.send_data(new char[16], 16);
+  connection.send_data(new char[16], 16);
+
+  // a partial batch outlives the loop iteration
+  uv_run(loop, UV_RUN_NOWAIT);
+  CHECK_EQUAL(connection.outbound_frames_, 2);
+
+  // but not the delay
+  uv_run(loop, UV_RUN_ONCE);
+  CHECK_EQUAL(connection.outbound_frames_, 0);
+  CHECK((uv_now(loop) - start >= 50));
+  CHECK((uv_now(loop) - start < 1000));
+
+  // a full batch doesn't wait
+  connection.send_data(new char[16], 16);
+  connection.send_data(new char[16], 16);
+  connection.send_data(new char[16], 16);
+  CHECK_EQUAL(connection.outbound_frames_, 0);
+
+  connection.close();
+  uv_run(loop, UV_RUN_DEFAULT);
+  CHECK(connection.is_closed());
+  uv_loop_delete(loop);
+  return true;
+}
+
+bool
+test_session_shutdown() {
+  const size_t submitters = 4;
+  // nothing listens there, the pools never connect
+  const char   contact_point[] = "127.0.0.1";
+  const char   port[]          = "1999";
+  int          io_threads      = 2;
+
+  cql::Cluster cluster;
+  cluster.option(CQL_OPTION_THREADS_IO, &io_threads, sizeof(int));
+  cluster.option(
+      CQL_OPTION_CONTACT_POINT_ADD,
+      contact_point,
+      strlen(contact_point));
+  cluster.option(CQL_OPTION_PORT, port, strlen(port));
+  cql::Session* session = cluster.connect();
+
+  // their callbacks run on the executor as the loops fail them and free
+  // the requests back to the loops' object pools
+  const size_t        callbacks = 100;
+  std::atomic<size_t> called(0);
+  for (size_t i = 0; i < callbacks; ++i) {
+    cql::Message* message = new cql::Message(CQL_OPCODE_QUERY);
+    static_cast<cql::BodyQuery*>(message->body.get())
+        ->query_string("SELECT");
+    session->execute(message, [&called](cql::CallerRequest* request) {
+      // the callback goes with the request, nothing of it is used after
+      called.fetch_add(1);
+      delete request->error;
+      delete request;
+    });
+  }
+
+  // submits race the shutdown, every request handed out has to complete
+  // by the time it returns, whichever side of it the request fell on
+  std::vector<std::vector<cql::CallerRequest*> > requests(submitters);
+  std::vector<std::thread>                       threads;
+  for (size_t t = 0; t < submitters; ++t) {
+    threads.push_back(std::thread([&requests, session, t] {
+      for (;;) {
+        cql::Message* message = new cql::Message(CQL_OPCODE_QUERY);
+        static_cast<cql::BodyQuery*>(message->body.get())
+            ->query_string("SELECT");
+        cql::CallerRequest* request = session->execute(message);
+        requests[t].push_back(request);
+        if (request->ready()
+            && request->error
+            && request->error->code == CQL_ERROR_LIB_SESSION_STATE) {
+          return;
+        }
+      }
+    }));
+  }
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  session->shutdown();
+  for (size_t t = 0; t < threads.size(); ++t) {
+    threads[t].join();
+  }
+
+  size_t rejected = 0;
+  for (size_t t = 0; t < submitters; ++t) {
+    for (size_t i = 0; i < requests[t].size(); ++i) {
+      cql::CallerRequest* request = requests[t][i];
+      CHECK(request->ready());
+      CHECK(request->error);
+      rejected += request->error->code == CQL_ERROR_LIB_SESSION_STATE;
+      delete request->error;
+      delete request;
+    }
+  }
+  CHECK((rejected >= submitters));
+
+  cql::Message*       message = new cql::Message(CQL_OPCODE_QUERY);
+  cql::CallerRequest* request = session->execute(message);
+  CHECK(request->ready());
+  CHECK(request->error);
+  CHECK_EQUAL(request->error->code, CQL_ERROR_LIB_SESSION_STATE);
+
+  // the request is kept past the session, it still goes back to the
+  // pool it came from
+  delete session;
+  CHECK_EQUAL(called.load(), callbacks);
+  delete request->error;
+  delete request;
+  return true;
+}
+
+namespace cql {
+
+struct SessionTest {
+  static Session*
+  session(
+      size_t io_loops) {
+    return new Session(io_loops);
+  }
+
+  static bool
+  enqueue(
+      Session*       session,
+      size_t         io_loop,
+      CallerRequest* request) {
+    QueuedRequest queued = {
+      new Message(CQL_OPCODE_QUERY),
+      request,
+      false
+    };
+    return session->io_loops_[io_loop]->queue.enqueue(queued);
+  }
+
+  static size_t
+  queued(
+      Session* session,
+      size_t   io_loop) {
+    return session->io_loops_[io_loop]->queue.size_approx();
+  }
+
+  static void
+  wake_sibling(
+      Session* session,
+      size_t   io_loop) {
+    session->io_loops_[io_loop]->wake_sibling();
+  }
+
+  static void
+  run(
+      Session* session,
+      size_t   io_loop) {
+    uv_run(session->io_loops_[io_loop]->loop, UV_RUN_NOWAIT);
+  }
+};
+
+}
+
+bool
+test_session_steal() {
+  cql::Session* session = cql::SessionTest::session(3);
+
+  std::vector<cql::CallerRequest*> requests;
+  for (int i = 0; i < 200; ++i) {
+    requests.push_back(new cql::CallerRequest());
+    CHECK(cql::SessionTest::enqueue(session, 0, requests.back()));
+  }
+
+  // loop 0 never runs, its first idle sibling takes half of its queue
+  cql::SessionTest::wake_sibling(session, 0);
+  cql::SessionTest::run(session, 1);
+  CHECK_EQUAL(cql::SessionTest::queued(session, 0), 100);
+
+  // loop 1 isn't idle any more, the next wakeup goes to loop 2
+  cql::SessionTest::wake_sibling(session, 0);
+  cql::SessionTest::run(session, 2);
+  CHECK_EQUAL(cql::SessionTest::queued(session, 0), 50);
+
+  // both woke themselves to come back for more, until the queue is too
+  // short to be worth it
+  cql::SessionTest::run(session, 1);
+  CHECK_EQUAL(cql::SessionTest::queued(session, 0), 25);
+  cql::SessionTest::run(session, 2);
+  CHECK_EQUAL(cql::SessionTest::queued(session, 0), 25);
+
+  size_t stolen = 0;
+  for (size_t i = 0; i < requests.size(); ++i) {
+    if (requests[i]->ready()) {
+      // there are no hosts to send them to
+      CHECK_EQUAL(requests[i]->error->code, CQL_ERROR_LIB_NO_HOSTS);
+      ++stolen;
+    }
+  }
+  CHECK_EQUAL(stolen, 175);
+
+  // what's left fails on shutdown
+  delete session;
+  for (size_t i = 0; i < requests.size(); ++i) {
+    CHECK(requests[i]->ready());
+    CHECK(requests[i]->error);
+    delete requests[i]->error;
+    delete requests[i];
+  }
+  return true;
+}
+
+bool
+test_mpmc_queue_size() {
+  cql::MpmcQueue<int> queue(4);
+  CHECK_EQUAL(queue.size_approx(), 0);
+
+  for (int i = 0; i < 4; ++i) {
+    CHECK(queue.enqueue(i));
+  }
+  CHECK(!queue.enqueue(4));
+  CHECK_EQUAL(queue.size_approx(), 4);
+
+  int value = -1;
+  CHECK(queue.dequeue(value));
+  CHECK_EQUAL(value, 0);
+  CHECK_EQUAL(queue.size_approx(), 3);
+
+  while (queue.dequeue(value)) {}
+  CHECK_EQUAL(value, 3);
+  CHECK_EQUAL(queue.size_approx(), 0);
+  return true;
+}
+
+bool
+test_mpmc_queue_bulk() {
+  cql::MpmcQueue<int> queue(8);
+  int                 input[8]  = { 0, 1, 2, 3, 4, 5, 6, 7 };
+  int                 output[8] = { 0 };
+
+  CHECK(queue.enqueue_bulk(input, 5));
+  // all or nothing
+  CHECK(!queue.enqueue_bulk(input, 4));
+  CHECK_EQUAL(queue.size_approx(), 5);
+  CHECK(!queue.dequeue_bulk(output, 6));
+  CHECK(queue.dequeue_bulk(output, 2));
+  CHECK((output[0] == 0 && output[1] == 1));
+
+  // wraps around the end of the ring
+  CHECK(queue.enqueue_bulk(input + 5, 3));
+  CHECK(queue.enqueue(8));
+  CHECK(queue.enqueue(9));
+  CHECK(!queue.enqueue(10));
+
+  CHECK_EQUAL(queue.try_dequeue_up_to(output, 16), 8);
+  for (int i = 0; i < 8; ++i) {
+    CHECK_EQUAL(output[i], i + 2);
+  }
+  CHECK_EQUAL(queue.try_dequeue_up_to(output, 16), 0);
+  return true;
+}
+
+bool
+test_mpmc_queue_bulk_threads() {
+  const size_t producers = 4;
+  const size_t per_thread = 100000;
+
+  cql::MpmcQueue<size_t>   queue(1024);
+  std::atomic<size_t>      consumed(0);
+  std::atomic<size_t>      sum(0);
+  std::vector<std::thread> threads;
+
+  for (size_t p = 0; p < producers; ++p) {
+    threads.push_back(std::thread([&queue, p, per_thread] {
+      size_t items[16];
+      for (size_t i = 0; i < per_thread; i += 16) {
+        for (size_t j = 0; j < 16; ++j) {
+          items[j] = p * per_thread + i + j;
+        }
+        // alternate between bulk and single enqueues
+        if ((i / 16) % 2) {
+          while (!queue.enqueue_bulk(items, 16)) {}
+        } else {
+          for (size_t j = 0; j < 16; ++j) {
+            while (!queue.enqueue(items[j])) {}
+          }
+        }
+      }
+    }));
+  }
+
+  for (size_t c = 0; c < 2; ++c) {
+    threads.push_back(std::thread([&] {
+      size_t items[64];
+      while (consumed.load() < producers * per_thread) {
+        size_t count = queue.try_dequeue_up_to(items, 64);
+        size_t total = 0;
+        for (size_t i = 0; i < count; ++i) {
+          total += items[i];
+        }
+        sum.fetch_add(total);
+        consumed.fetch_add(count);
+      }
+    }));
+  }
+
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i].join();
+  }
+
+  size_t n = producers * per_thread;
+  CHECK_EQUAL(consumed.load(), n);
+  CHECK_EQUAL(sum.load(), n * (n - 1) / 2);
+  return true;
+}
+
+template<typename WaitStrategy>
+bool
+test_blocking_queue_strategy() {
+  cql::BlockingMpmcQueue<int, WaitStrategy> queue(16);
+  int                                       value = 0;
+
+  // nothing arrives
+  CHECK(!queue.dequeue_wait(value, 1000));
+
+  std::thread consumer([&queue, &value] {
+    queue.dequeue_wait(value);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  CHECK(queue.enqueue(42));
+  consumer.join();
+  CHECK_EQUAL(value, 42);
+
+  int items[3] = { 1, 2, 3 };
+  int output[8];
+  CHECK(queue.enqueue_bulk(items, 3));
+  CHECK_EQUAL(queue.dequeue_wait_up_to(output, 8, 1000), 3);
+  CHECK_EQUAL(queue.dequeue_wait_up_to(output, 8, 1000), 0);
+  return true;
+}
+
+bool
+test_wait_strategies() {
+  CHECK(test_blocking_queue_strategy<cql::SpinWaitStrategy>());
+  CHECK(test_blocking_queue_strategy<cql::YieldWaitStrategy>());
+  CHECK(test_blocking_queue_strategy<cql::ParkWaitStrategy>());
+
+  cql::Futex futex(7);
+  // returns straight away when the value has already changed
+  CHECK(futex.wait(6, 1000));
+  CHECK(!futex.wait(7, 1000));
+
+  // a consumer is parked on the futex until the producer notifies
+  cql::BlockingMpmcQueue<int> queue(16);
+  int                         value = 0;
+  std::thread consumer([&queue, &value] {
+    queue.dequeue_wait(value);
+  });
+  while (queue.wait_strategy().waiters() == 0) {
+    std::this_thread::yield();
+  }
+  CHECK(queue.enqueue(7));
+  consumer.join();
+  CHECK_EQUAL(value, 7);
+  CHECK_EQUAL(queue.wait_strategy().waiters(), 0);
+  return true;
+}
+
+bool
+test_segmented_queue() {
+  // without overflow it's a plain bounded queue
+  cql::SegmentedMpmcQueue<int, 4> bounded(4, false);
+  for (int i = 0; i < 4; ++i) {
+    CHECK(bounded.enqueue(i));
+  }
+  CHECK(!bounded.enqueue(4));
+  CHECK_EQUAL(bounded.overflows(), 0);
+
+  cql::SegmentedMpmcQueue<int, 4> queue(4);
+  for (int i = 0; i < 14; ++i) {
+    CHECK(queue.enqueue(i));
+  }
+  CHECK_EQUAL(queue.size_approx(), 14);
+  CHECK_EQUAL(queue.overflow_size(), 10);
+  CHECK_EQUAL(queue.overflows(), 10);
+  CHECK_EQUAL(queue.overflow_peak(), 10);
+  CHECK_EQUAL(queue.segments_allocated(), 3);
+
+  // order is kept across the ring and the overflow segments
+  int value = -1;
+  for (int i = 0; i < 6; ++i) {
+    CHECK(queue.dequeue(value));
+    CHECK_EQUAL(value, i);
+  }
+  CHECK(queue.enqueue(14));
+
+  int output[16];
+  CHECK_EQUAL(queue.try_dequeue_up_to(output, 16), 9);
+  for (int i = 0; i < 9; ++i) {
+    CHECK_EQUAL(output[i], i + 6);
+  }
+  CHECK_EQUAL(queue.overflow_size(), 0);
+  CHECK(!queue.dequeue(value));
+
+  // segments come back from the pool on the next burst
+  for (int i = 0; i < 12; ++i) {
+    CHECK(queue.enqueue(i));
+  }
+  CHECK_EQUAL(queue.segments_allocated(), 3);
+  return true;
+}
+
+bool
+test_segmented_queue_threads() {
+  const size_t producers  = 4;
+  const size_t per_thread = 50000;
+
+  cql::SegmentedMpmcQueue<size_t, 64> queue(64);
+  std::atomic<size_t>                 consumed(0);
+  std::atomic<size_t>                 sum(0);
+  std::vector<std::thread>            threads;
+
+  for (size_t p = 0; p < producers; ++p) {
+    threads.push_back(std::thread([&queue, p, per_thread] {
+      for (size_t i = 0; i < per_thread; ++i) {
+        queue.enqueue(p * per_thread + i);
+      }
+    }));
+  }
+
+  for (size_t c = 0; c < 2; ++c) {
+    threads.push_back(std::thread([&] {
+      size_t items[32];
+      while (consumed.load() < producers * per_thread) {
+        size_t count = queue.try_dequeue_up_to(items, 32);
+        size_t total = 0;
+        for (size_t i = 0; i < count; ++i) {
+          total += items[i];
+        }
+        sum.fetch_add(total);
+        consumed.fetch_add(count);
+      }
+    }));
+  }
+
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i].join();
+  }
+
+  size_t n = producers * per_thread;
+  CHECK_EQUAL(consumed.load(), n);
+  CHECK_EQUAL(sum.load(), n * (n - 1) / 2);
+  CHECK_EQUAL(queue.size_approx(), 0);
+  return true;
+}
+
+bool
+test_completion() {
+  cql::Completion completion;
+  CHECK(!completion.ready());
+  CHECK(!completion.wait_for(1000));
+
+  std::thread waker([&completion] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    completion.complete();
+  });
+  completion.wait();
+  CHECK(completion.ready());
+  waker.join();
+  CHECK(completion.wait_for(1));
+
+  // a waiter may free the request as soon as it's notified
+  for (int i = 0; i < 100; ++i) {
+    cql::CallerRequest* request = new cql::CallerRequest();
+    std::thread notifier([request] {
+      request->notify(NULL);
+    });
+    request->wait();
+    delete request;
+    notifier.join();
+  }
+
+  cql::CallerRequest request;
+  CHECK(!request.wait_for(std::chrono::milliseconds(1)));
+  request.notify(NULL);
+  CHECK(request.wait_for(std::chrono::milliseconds(0)));
+  return true;
+}
+
+void
+count_task(
+    void* data) {
+  reinterpret_cast<std::atomic<size_t>*>(data)->fetch_add(1);
+}
+
+void
+block_task(
+    void* data) {
+  std::atomic<bool>* release = reinterpret_cast<std::atomic<bool>*>(data);
+  while (!release->load()) {
+    std::this_thread::yield();
+  }
+}
+
+void
+request_callback(
+    cql::CallerRequest* request) {
+  reinterpret_cast<std::atomic<size_t>*>(request->result)->fetch_add(1);
+}
+
+bool
+test_callback_executor() {
+  std::atomic<size_t> count(0);
+  std::atomic<bool>   release(false);
+
+  {
+    cql::CallbackExecutor executor(2);
+    cql::CallbackBatch    batch(&executor);
+
+    // one thread is stuck, the other has to steal what's queued behind it
+    batch.add(block_task, &release);
+    for (int i = 0; i < 100; ++i) {
+      batch.add(count_task, &count);
+    }
+    batch.flush();
+    CHECK_EQUAL(batch.size(), 0);
+
+    for (int i = 0; i < 1000 && count.load() < 100; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    size_t unblocked = count.load();
+    release.store(true);
+    CHECK_EQUAL(unblocked, 100);
+
+    // callbacks of requests completed on an IO loop go through the batch
+    cql::CallerRequest request;
+    request.callback       = request_callback;
+    request.callback_batch = &batch;
+    request.result         = reinterpret_cast<cql::Message*>(&count);
+    request.notify(NULL);
+    CHECK_EQUAL(batch.size(), 1);
+    batch.flush();
+    request.wait();
+
+    for (int i = 0; i < 1000; ++i) {
+      batch.add(count_task, &count);
+    }
+    // shutting down runs everything still queued
+    executor.shutdown();
+    request.result = NULL;
+  }
+  CHECK_EQUAL(count.load(), 1101);
+  return true;
+}
+
+struct OverflowCount {
+  std::thread::id     submitter;
+  std::atomic<size_t> count;
+  std::atomic<size_t> inline_runs;
+};
+
+void
+overflow_task(
+    void* data) {
+  OverflowCount* overflow = reinterpret_cast<OverflowCount*>(data);
+  if (std::this_thread::get_id() == overflow->submitter) {
+    overflow->inline_runs.fetch_add(1);
+  }
+  overflow->count.fetch_add(1);
+}
+
+bool
+test_callback_executor_overflow() {
+  std::atomic<bool> release(false);
+  OverflowCount     overflow;
+  overflow.submitter = std::this_thread::get_id();
+  overflow.count.store(0);
+  overflow.inline_runs.store(0);
+
+  cql::CallbackExecutor executor(1);
+  cql::CallbackTask     block = { block_task, &release };
+  cql::CallbackTask     task  = { overflow_task, &overflow };
+  executor.submit(block);
+  for (size_t i = 0; i < 2 * CQL_CALLBACK_QUEUE_SIZE; ++i) {
+    // the only queue fills up, the rest has to wait rather than run here
+    executor.submit(task);
+  }
+  CHECK_EQUAL(overflow.inline_runs.load(), 0);
+  release.store(true);
+
+  for (int i = 0;
+       i < 1000 && overflow.count.load() < 2 * CQL_CALLBACK_QUEUE_SIZE;
+       ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  CHECK_EQUAL(overflow.count.load(), 2 * CQL_CALLBACK_QUEUE_SIZE);
+  CHECK_EQUAL(overflow.inline_runs.load(), 0);
+
+  // submits racing the shutdown all run, none are dropped
+  std::atomic<size_t>      count(0);
+  std::atomic<size_t>      submitted(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.push_back(std::thread([&executor, &count, &submitted] {
+      cql::CallbackTask task = { count_task, &count };
+      for (int i = 0; i < 10000; ++i) {
+        executor.submit(task);
+        submitted.fetch_add(1);
+      }
+    }));
+  }
+  while (submitted.load() < 1000) {
+    std::this_thread::yield();
+  }
+  executor.shutdown();
+  for (size_t t = 0; t < threads.size(); ++t) {
+    threads[t].join();
+  }
+  CHECK_EQUAL(count.load(), 40000);
+  return true;
+}
+
+std::atomic<size_t> batched_callbacks(0);
+
+void
+batched_callback(
+    cql::CallerRequest* request) {
+  batched_callbacks.fetch_add(1);
+  delete request->result;
+  delete request;
+}
+
+bool
+test_batched_completion() {
+  uv_loop_t*            loop = uv_loop_new();
+  cql::CallbackExecutor executor(1);
+  cql::CallbackBatch    batch(&executor);
+  cql::ClientConnection connection(loop, NULL, NULL, NULL, &batch);
+  test_open_connection(connection, loop);
+
+  cql::Message message(CQL_OPCODE_QUERY);
+  static_cast<cql::BodyQuery*>(message.body.get())->query_string("SELECT");
+  connection.exec(&message, batched_callback);
+  int16_t first = message.stream;
+  connection.exec(&message, batched_callback);
+  int16_t second = message.stream;
+
+  // both responses arrive in one read
+  size_t                size = CQL_HEADER_SIZE_V3 + 4;
+  std::unique_ptr<char> a(test_result_void(first));
+  std::unique_ptr<char> b(test_result_void(second));
+  std::vector<char>     input(size * 2);
+  memcpy(&input[0], a.get(), size);
+  memcpy(&input[size], b.get(), size);
+  connection.consume(&input[0], input.size());
+
+  // held until the read is done with, then handed over together
+  CHECK_EQUAL(batch.size(), 2);
+  CHECK_EQUAL(batched_callbacks.load(), 0);
+  batch.flush();
+  executor.shutdown();
+  CHECK_EQUAL(batched_callbacks.load(), 2);
+
+  connection.close();
+  uv_run(loop, UV_RUN_DEFAULT);
+  CHECK(connection.is_closed());
+  uv_loop_delete(loop);
+  return true;
+}
+
+bool
+test_connection_load() {
+  uv_loop_t*            loop = uv_loop_new();
+  cql::ClientConnection connection(loop, NULL, NULL, NULL);
+  test_open_connection(connection, loop);
+  CHECK_EQUAL(connection.in_flight(), 0);
+  CHECK_EQUAL(connection.latency(), 0);
+
+  cql::Message message(CQL_OPCODE_QUERY);
+  static_cast<cql::BodyQuery*>(message.body.get())->query_string("SELECT");
+  cql::CallerRequest* first = connection.exec(&message);
+  int16_t             first_stream = message.stream;
+  cql::CallerRequest* second = connection.exec(&message);
+  int16_t             second_stream = message.stream;
+  CHECK_EQUAL(connection.in_flight(), 2);
+  CHECK(first->start_time);
+
+  std::unique_ptr<char> frame(test_result_void(first_stream));
+  connection.consume(frame.get(), CQL_HEADER_SIZE_V3 + 4);
+  CHECK_EQUAL(connection.in_flight(), 1);
+  uint64_t latency = connection.latency();
+  CHECK((latency > 0));
+
+  // later samples move the average instead of replacing it
+  second->start_time = uv_hrtime() - latency * 9;
+  frame.reset(test_result_void(second_stream));
+  connection.consume(frame.get(), CQL_HEADER_SIZE_V3 + 4);
+  CHECK_EQUAL(connection.in_flight(), 0);
+  CHECK((connection.latency() > latency
+         && connection.latency() < latency * 9));
+
+  connection.close();
+  uv_run(loop, UV_RUN_DEFAULT);
+  CHECK(connection.is_closed());
+  uv_loop_delete(loop);
+
+  delete first->result;
+  delete first;
+  delete second->result;
+  delete second;
+  return true;
+}
+
+namespace cql {
+
+struct PoolTest {
+  static void
+  add(
+      Pool&             pool,
+      ClientConnection* connection) {
+    pool.connections_.push_back(connection);
+  }
+
+  static ClientConnection*
+  find_least_busy(
+      Pool& pool) {
+    return pool.find_least_busy();
+  }
+
+  static size_t
+  connections(
+      Pool& pool) {
+    return pool.connections_.size();
+  }
+
+  static size_t
+  defunct(
+      Pool& pool) {
+    return pool.connections_defunct_.size();
+  }
+
+  static void
+  core_connections(
+      Pool&  pool,
+      size_t core) {
+    pool.options_.core_connections_per_host = core;
+  }
+};
+
+}
+
+bool
+test_pool_least_busy() {
+  uv_loop_t*       loop = uv_loop_new();
+  cql::PoolOptions options;
+  // the test hands it its connections
+  options.core_connections_per_host = 0;
+  cql::Pool* pool = new cql::Pool(
+      loop,
+      NULL,
+      NULL,
+      NULL,
+      NULL,
+      cql::Host("127.0.0.1"),
+      cql::LOCAL,
+      options);
+
+  cql::ClientConnection* busy
+      = new cql::ClientConnection(loop, NULL, NULL, NULL);
+  cql::ClientConnection* idle
+      = new cql::ClientConnection(loop, NULL, NULL, NULL);
+  test_open_connection(*busy, loop);
+  test_open_connection(*idle, loop);
+  cql::PoolTest::add(*pool, busy);
+  cql::PoolTest::add(*pool, idle);
+
+  cql::Message message(CQL_OPCODE_QUERY);
+  static_cast<cql::BodyQuery*>(message.body.get())->query_string("SELECT");
+  std::vector<cql::CallerRequest*> requests;
+  for (int i = 0; i < 4; ++i) {
+    requests.push_back(busy->exec(&message));
+  }
+
+  // with two connections every pick compares both
+  for (int i = 0; i < 16; ++i) {
+    CHECK((cql::PoolTest::find_least_busy(*pool) == idle));
+  }
+
+  // as many in flight on each, but one takes far longer to answer
+  for (int i = 0; i < 4; ++i) {
+    requests.push_back(idle->exec(&message));
+  }
+  busy->latency_ = 10;
+  idle->latency_ = 1000;
+  for (int i = 0; i < 16; ++i) {
+    CHECK((cql::PoolTest::find_least_busy(*pool) == busy));
+  }
+
+  // which is where the pool sends
+  cql::Message* query = new cql::Message(CQL_OPCODE_QUERY);
+  static_cast<cql::BodyQuery*>(query->body.get())->query_string("SELECT");
+  requests.push_back(new cql::CallerRequest());
+  cql::QueuedRequest queued = { query, requests.back(), false };
+  pool->execute(queued);
+  CHECK_EQUAL(busy->in_flight(), 5);
+  CHECK_EQUAL(idle->in_flight(), 4);
+
+  pool->close();
+  uv_run(loop, UV_RUN_DEFAULT);
+  pool->maintain(uv_now(loop));
+  CHECK(pool->is_closed());
+  delete pool;
+  uv_loop_delete(loop);
+
+  for (size_t i = 0; i < requests.size(); ++i) {
+    CHECK(requests[i]->ready());
+    CHECK(requests[i]->error);
+    delete requests[i]->error;
+    delete requests[i];
+  }
+  return true;
+}
+
+bool
+test_pool_reap() {
+  uv_loop_t*       loop = uv_loop_new();
+  cql::PoolOptions options;
+  options.core_connections_per_host = 0;
+  options.max_connections_per_host  = 3;
+  options.shrink_in_flight          = 8;
+  options.shrink_delay              = 100;
+  cql::Pool* pool = new cql::Pool(
+      loop,
+      NULL,
+      NULL,
+      NULL,
+      NULL,
+      cql::Host("127.0.0.1"),
+      cql::LOCAL,
+      options);
+
+  cql::Message message(CQL_OPCODE_QUERY);
+  static_cast<cql::BodyQuery*>(message.body.get())->query_string("SELECT");
+  std::vector<cql::CallerRequest*> requests;
+  cql::ClientConnection*           connections[3];
+  int16_t                          first_stream = 0;
+  for (int i = 0; i < 3; ++i) {
+    connections[i] = new cql::ClientConnection(loop, NULL, NULL, NULL);
+    test_open_connection(*connections[i], loop);
+    cql::PoolTest::add(*pool, connections[i]);
+    // one in flight on the first, two on the second, three on the third
+    for (int j = 0; j <= i; ++j) {
+      requests.push_back(connections[i]->exec(&message));
+    }
+    if (i == 0) {
+      first_stream = message.stream;
+    }
+  }
+  // set after the pool was made so it doesn't open one of its own
+  cql::PoolTest::core_connections(*pool, 1);
+
+  // the load has to stay low for a whole delay
+  pool->maintain(0);
+  pool->maintain(50);
+  CHECK_EQUAL(cql::PoolTest::connections(*pool), 3);
+
+  // then the least loaded connection stops taking requests, but it stays
+  // open until it has answered the one it was sent
+  pool->maintain(100);
+  CHECK_EQUAL(cql::PoolTest::connections(*pool), 2);
+  CHECK_EQUAL(cql::PoolTest::defunct(*pool), 1);
+  pool->maintain(120);
+  CHECK_EQUAL(
+      connections[0]->state_,
+      cql::ClientConnection::CLIENT_STATE_READY);
+  CHECK(!requests[0]->ready());
+
+  std::unique_ptr<char> frame(test_result_void(first_stream));
+  connections[0]->consume(frame.get(), CQL_HEADER_SIZE_V3 + 4);
+  CHECK(requests[0]->ready());
+  CHECK(!requests[0]->error);
+  pool->maintain(150);
+  CHECK_EQUAL(
+      connections[0]->state_,
+      cql::ClientConnection::CLIENT_STATE_DISCONNECTING);
+
+  // closed ones are freed, and the next one goes after a delay of its own
+  uv_run(loop, UV_RUN_NOWAIT);
+  pool->maintain(200);
+  CHECK_EQUAL(cql::PoolTest::connections(*pool), 1);
+  CHECK_EQUAL(cql::PoolTest::defunct(*pool), 1);
+
+  // never below the core connections
+  pool->maintain(400);
+  pool->maintain(600);
+  CHECK_EQUAL(cql::PoolTest::connections(*pool), 1);
+
+  pool->close();
+  uv_run(loop, UV_RUN_DEFAULT);
+  pool->maintain(uv_now(loop));
+  CHECK(pool->is_closed());
+  delete pool;
+  uv_loop_delete(loop);
+
+  delete requests[0]->result;
+  delete requests[0];
+  for (size_t i = 1; i < requests.size(); ++i) {
+    CHECK(requests[i]->ready());
+    CHECK_EQUAL(requests[i]->error->code, CQL_ERROR_LIB_CONNECTION_CLOSED);
+    delete requests[i]->error;
+    delete requests[i];
+  }
+  return true;
+}
+
+bool
+test_pool_sizer() {
+  cql::PoolSizer sizer(64, 8, 1000);
+
+  // one connection at the high water mark opens a second
+  CHECK_EQUAL(sizer.update(0, 64, 1, 1, 4), cql::PoolSizer::GROW);
+  CHECK_EQUAL(sizer.update(0, 63, 1, 1, 4), cql::PoolSizer::HOLD);
+  CHECK_EQUAL(sizer.update(0, 512, 4, 1, 4), cql::PoolSizer::HOLD);
+
+  // between the marks nothing moves
+  CHECK_EQUAL(sizer.update(0, 40, 2, 1, 4), cql::PoolSizer::HOLD);
+  CHECK_EQUAL(sizer.update(5000, 40, 2, 1, 4), cql::PoolSizer::HOLD);
+
+  // quiet, but not for long enough
+  CHECK_EQUAL(sizer.update(10000, 8, 2, 1, 4), cql::PoolSizer::HOLD);
+  CHECK_EQUAL(sizer.update(10500, 8, 2, 1, 4), cql::PoolSizer::HOLD);
+  // a burst restarts the delay
+  CHECK_EQUAL(sizer.update(10800, 9, 2, 1, 4), cql::PoolSizer::HOLD);
+  CHECK_EQUAL(sizer.update(11000, 8, 2, 1, 4), cql::PoolSizer::HOLD);
+  CHECK_EQUAL(sizer.update(11900, 8, 2, 1, 4), cql::PoolSizer::HOLD);
+  CHECK_EQUAL(sizer.update(12000, 8, 2, 1, 4), cql::PoolSizer::SHRINK);
+
+  // one connection per delay, and never below core
+  CHECK_EQUAL(sizer.update(12000, 0, 3, 1, 4), cql::PoolSizer::HOLD);
+  CHECK_EQUAL(sizer.update(13000, 0, 3, 1, 4), cql::PoolSizer::SHRINK);
+  CHECK_EQUAL(sizer.update(20000, 0, 1, 1, 4), cql::PoolSizer::HOLD);
+  CHECK_EQUAL(sizer.update(30000, 0, 2, 2, 4), cql::PoolSizer::HOLD);
+  return true;
+}
+
+bool
+test_murmur3() {
+  // tokens Cassandra's Murmur3Partitioner gives the same keys
+  CHECK_EQUAL(cql::murmur3_token("123", 3), -7468325962851647638LL);
+
+  std::string composite;
+  for (int i = 0; i < 10; ++i) {
+    composite.append("\x00\xff\x10\xfa\x99", 5);
+  }
+  CHECK_EQUAL(
+      cql::murmur3_token(composite.data(), composite.size()),
+      5837342703291459765LL);
+
+  std::string negative(8, '\xfe');
+  CHECK_EQUAL(
+      cql::murmur3_token(negative.data(), negative.size()),
+      -8927430733708461935LL);
+
+  std::string positive(8, '\x10');
+  CHECK_EQUAL(
+      cql::murmur3_token(positive.data(), positive.size()),
+      1446172840243228796LL);
+
+  CHECK_EQUAL(
+      cql::murmur3_token("9223372036854775807", 19),
+      7162290910810015547LL);
+  return true;
+}
+
+bool
+test_token_map() {
+  cql::Metadata metadata(2);
+  cql::Host     a("10.0.0.1");
+  cql::Host     b("10.0.0.2");
+  cql::Host     c("10.0.0.3");
+  a.tokens.push_back(-100);
+  a.tokens.push_back(200);
+  b.tokens.push_back(0);
+  c.tokens.push_back(100);
+  metadata.update_host(a);
+  metadata.update_host(b);
+  metadata.update_host(c);
+
+  const cql::TokenMap&           map = metadata.token_map();
+  const cql::TokenMap::Replicas* replicas = map.replicas(-50);
+  CHECK(replicas);
+  CHECK_EQUAL(replicas->size(), 2);
+  CHECK_EQUAL(metadata.hosts()[(*replicas)[0]].address, "10.0.0.2");
+  CHECK_EQUAL(metadata.hosts()[(*replicas)[1]].address, "10.0.0.3");
+
+  // a token on a host's token belongs to it
+  replicas = map.replicas(100);
+  CHECK_EQUAL(metadata.hosts()[(*replicas)[0]].address, "10.0.0.3");
+  CHECK_EQUAL(metadata.hosts()[(*replicas)[1]].address, "10.0.0.1");
+
+  // past the last token wraps to the first, skipping the same host
+  replicas = map.replicas(300);
+  CHECK_EQUAL(metadata.hosts()[(*replicas)[0]].address, "10.0.0.1");
+  CHECK_EQUAL(metadata.hosts()[(*replicas)[1]].address, "10.0.0.2");
+
+  replicas = map.replicas(150);
+  CHECK_EQUAL(replicas->size(), 2);
+  CHECK_EQUAL(metadata.hosts()[(*replicas)[0]].address, "10.0.0.1");
+  CHECK_EQUAL(metadata.hosts()[(*replicas)[1]].address, "10.0.0.2");
+
+  CHECK(metadata.remove_host("10.0.0.1"));
+  replicas = map.replicas(150);
+  CHECK_EQUAL(metadata.hosts()[(*replicas)[0]].address, "10.0.0.2");
+  CHECK(!metadata.remove_host("10.0.0.1"));
+
+  cql::Metadata empty;
+  empty.update_host(cql::Host("10.0.0.1"));
+  CHECK((empty.token_map().replicas(0) == NULL));
+  return true;
+}
+
+bool
+test_token_aware_policy() {
+  cql::Metadata metadata(2);
+  for (int i = 0; i < 4; ++i) {
+    cql::Host host("10.0.0." + std::to_string(i + 1));
+    host.tokens.push_back(i * 1000);
+    metadata.update_host(host);
+  }
+
+  cql::TokenAwarePolicy policy(new cql::RoundRobinPolicy());
+  cql::QueryPlan        plan;
+  cql::Token            token = 1500;
+  policy.plan(metadata, &token, plan);
+
+  // both replicas first, then everyone else once
+  CHECK_EQUAL(plan.size(), 4);
+  CHECK((plan[0]->address == "10.0.0.3" || plan[0]->address == "10.0.0.4"));
+  CHECK((plan[1]->address == "10.0.0.3" || plan[1]->address == "10.0.0.4"));
+  CHECK((plan[0] != plan[1]));
+  CHECK((plan[2]->address == "10.0.0.1" || plan[2]->address == "10.0.0.2"));
+  CHECK((plan[2] != plan[3]));
+
+  // replicas take turns being first
+  cql::QueryPlan next;
+  policy.plan(metadata, &token, next);
+  CHECK((plan[0] != next[0]));
+
+  // without a routing key the plan is the child's
+  plan.clear();
+  policy.plan(metadata, NULL, plan);
+  CHECK_EQUAL(plan.size(), 4);
+
+  // a composite routing key is each component with its length and a
+  // trailing zero
+  cql::Message    message(CQL_OPCODE_QUERY);
+  cql::BodyQuery* query = static_cast<cql::BodyQuery*>(message.body.get());
+  query->query_string("SELECT * FROM t WHERE a = ? AND b = ? AND c = ?");
+  query->add_value("x", 1);
+  query->add_value("ab", 2);
+  query->add_value("c", 1);
+
+  std::vector<char> key;
+  CHECK(!message.body->routing_key(key));
+  int indexes[] = { 1, 0 };
+  query->routing_key_indexes(indexes, 2);
+  CHECK(message.body->routing_key(key));
+  CHECK_EQUAL(std::string(&key[0], key.size()),
+              std::string("\x00\x02" "ab" "\x00" "\x00\x01" "x" "\x00", 9));
+
+  key.clear();
+  query->routing_key_indexes(indexes, 1);
+  CHECK(message.body->routing_key(key));
+  CHECK_EQUAL(std::string(&key[0], key.size()), "ab");
+  return true;
+}
+
+bool
+test_dc_aware_policy() {
+  cql::Metadata metadata(2);
+  const char*   datacenters[] = { "dc1", "dc2", "dc1", "dc2", "dc2" };
+  for (int i = 0; i < 5; ++i) {
+    cql::Host host("10.0.0." + std::to_string(i + 1));
+    host.datacenter = datacenters[i];
+    host.tokens.push_back(i * 1000);
+    metadata.update_host(host);
+  }
+  metadata.local_datacenter("dc1");
+
+  cql::DCAwareRoundRobinPolicy policy("", 1);
+  CHECK_EQUAL(policy.distance(metadata, *metadata.find_host("10.0.0.1")),
+              cql::LOCAL);
+  CHECK_EQUAL(policy.distance(metadata, *metadata.find_host("10.0.0.2")),
+              cql::REMOTE);
+  CHECK_EQUAL(policy.distance(metadata, *metadata.find_host("10.0.0.4")),
+              cql::IGNORED);
+  // contact points before the topology is known
+  CHECK_EQUAL(policy.distance(metadata, cql::Host("10.0.0.9")), cql::LOCAL);
+
+  // the local hosts in turn, then the one host used in dc2
+  cql::QueryPlan plan;
+  policy.plan(metadata, NULL, plan);
+  CHECK_EQUAL(plan.size(), 3);
+  CHECK_EQUAL(plan[0]->datacenter, "dc1");
+  CHECK_EQUAL(plan[1]->datacenter, "dc1");
+  CHECK((plan[0] != plan[1]));
+  CHECK_EQUAL(plan[2]->address, "10.0.0.2");
+
+  cql::QueryPlan next;
+  policy.plan(metadata, NULL, next);
+  CHECK((plan[0] != next[0]));
+
+  // the application's choice of datacenter wins, remote ones are off
+  cql::DCAwareRoundRobinPolicy dc2("dc2");
+  plan.clear();
+  dc2.plan(metadata, NULL, plan);
+  CHECK_EQUAL(plan.size(), 3);
+  for (size_t i = 0; i < plan.size(); ++i) {
+    CHECK_EQUAL(plan[i]->datacenter, "dc2");
+  }
+  CHECK_EQUAL(dc2.distance(metadata, *metadata.find_host("10.0.0.1")),
+              cql::IGNORED);
+
+  // only the local replica goes first, the replica in dc2 waits until
+  // the local hosts are exhausted
+  cql::TokenAwarePolicy token_aware(new cql::DCAwareRoundRobinPolicy("", 1));
+  cql::Token            token = 500;
+  plan.clear();
+  token_aware.plan(metadata, &token, plan);
+  CHECK_EQUAL(plan.size(), 3);
+  CHECK_EQUAL(plan[0]->address, "10.0.0.3");
+  CHECK_EQUAL(plan[1]->address, "10.0.0.1");
+  CHECK_EQUAL(plan[2]->address, "10.0.0.2");
+
+  // an ignored replica never shows up
+  token = 2500;
+  plan.clear();
+  token_aware.plan(metadata, &token, plan);
+  CHECK_EQUAL(plan.size(), 3);
+  for (size_t i = 0; i < plan.size(); ++i) {
+    CHECK((plan[i]->address != "10.0.0.4"));
+  }
+  return true;
+}
+
+bool
+test_latency_aware_policy() {
+  const uint64_t ms = 1000000;
+  uint64_t       now = 1000 * ms;
+
+  // a new sample weighs more the longer the host went without one
+  cql::HostLatency average;
+  average.update(now, 1 * ms);
+  CHECK_EQUAL(average.average(), 1 * ms);
+  average.update(now + CQL_HOST_LATENCY_SCALE * ms, 3 * ms);
+  CHECK_EQUAL(average.average(), 2 * ms);
+  CHECK_EQUAL(average.samples(), 2);
+
+  cql::Metadata metadata;
+  for (int i = 0; i < 3; ++i) {
+    metadata.update_host(cql::Host("10.0.0." + std::to_string(i + 1)));
+  }
+  for (int i = 0; i < CQL_LATENCY_AWARE_MIN_MEASURED; ++i) {
+    metadata.find_host("10.0.0.1")->latency->update(now + i, 1 * ms);
+    metadata.find_host("10.0.0.2")->latency->update(now + i, 5 * ms);
+  }
+
+  // a newer view of a host keeps its average
+  metadata.update_host(cql::Host("10.0.0.2"));
+  CHECK_EQUAL(metadata.find_host("10.0.0.2")->latency->samples(),
+              CQL_LATENCY_AWARE_MIN_MEASURED);
+
+  cql::LatencyAwarePolicy policy(new cql::RoundRobinPolicy());
+  cql::QueryPlan          plan;
+  plan.push_back(metadata.find_host("10.0.0.2"));
+  plan.push_back(metadata.find_host("10.0.0.1"));
+  plan.push_back(metadata.find_host("10.0.0.3"));
+
+  // the slow host goes last, a host without samples keeps its place
+  cql::QueryPlan reordered(plan);
+  policy.reorder(now, reordered, 0);
+  CHECK_EQUAL(reordered.size(), 3);
+  CHECK_EQUAL(reordered[0]->address, "10.0.0.1");
+  CHECK_EQUAL(reordered[1]->address, "10.0.0.3");
+  CHECK_EQUAL(reordered[2]->address, "10.0.0.2");
+
+  // after the retry period without samples it's tried again
+  reordered = plan;
+  policy.reorder(
+      now + 2 * CQL_LATENCY_AWARE_RETRY_PERIOD * ms,
+      reordered,
+      0);
+  CHECK((reordered == plan));
+
+  // only what the policy appended is reordered
+  reordered = plan;
+  policy.reorder(now, reordered, 1);
+  CHECK_EQUAL(reordered[0]->address, "10.0.0.2");
+  CHECK_EQUAL(reordered[1]->address, "10.0.0.1");
+  return true;
+}
+
+bool
+test_speculative_execution_policy() {
+  const uint64_t ms = 1000000;
+
+  // buckets are a quarter of a power of two wide
+  CHECK_EQUAL(cql::LatencyHistogram::bucket(3), 3);
+  CHECK_EQUAL(cql::LatencyHistogram::bucket(8), 8);
+  CHECK_EQUAL(cql::LatencyHistogram::bucket(9), 8);
+  CHECK_EQUAL(cql::LatencyHistogram::upper_bound(8), 9);
+  CHECK((cql::LatencyHistogram::bucket(~0ULL)
+         < CQL_LATENCY_HISTOGRAM_BUCKETS));
+
+  cql::LatencyHistogram histogram;
+  CHECK_EQUAL(histogram.percentile(0.5), 0);
+  for (uint64_t i = 1; i <= 100; ++i) {
+    histogram.record(i * ms);
+  }
+  CHECK_EQUAL(histogram.percentile(0.5, 101), 0);
+  uint64_t median = histogram.percentile(0.5);
+  CHECK((median >= 50 * ms && median <= 50 * ms * 5 / 4));
+  uint64_t p99 = histogram.percentile(0.99);
+  CHECK((p99 >= 99 * ms && p99 <= 99 * ms * 5 / 4));
+
+  // old samples fade out once a window's worth of new ones came in
+  cql::LatencyHistogram recent;
+  for (int i = 0; i < CQL_LATENCY_HISTOGRAM_WINDOW; ++i) {
+    recent.record(1 * ms);
+  }
+  for (int i = 0; i < CQL_LATENCY_HISTOGRAM_WINDOW; ++i) {
+    recent.record(10 * ms);
+  }
+  CHECK((recent.percentile(0.5) >= 10 * ms));
+
+  cql::ConstantSpeculativeExecutionPolicy constant(20, 2);
+  cql::Host                               host("10.0.0.1");
+  CHECK_EQUAL(constant.delay(host), 20);
+  CHECK_EQUAL(constant.max_executions(), 2);
+
+  // no copies for a host without enough samples to go by
+  cql::PercentileSpeculativeExecutionPolicy percentile(0.99, 1);
+  CHECK_EQUAL(percentile.delay(host), 0);
+  for (int i = 0; i < CQL_SPECULATIVE_EXECUTION_MIN_SAMPLES; ++i) {
+    host.latency->update(i, 4 * ms);
+  }
+  CHECK_EQUAL(percentile.delay(host), 5);
+
+  cql::Message    message(CQL_OPCODE_QUERY);
+  cql::BodyQuery* query = static_cast<cql::BodyQuery*>(message.body.get());
+  CHECK(!message.body->idempotent());
+  query->idempotent(true);
+  CHECK(message.body->idempotent());
+  CHECK(!message.copy_values);
+
+  cql::Cluster cluster;
+  CHECK(!cluster.speculative_execution_policy());
+  int delay = 10;
+  cluster.option(CQL_OPTION_SPECULATIVE_EXECUTION_DELAY, &delay, sizeof(int));
+  std::unique_ptr<cql::SpeculativeExecutionPolicy> policy(
+      cluster.speculative_execution_policy());
+  CHECK((policy.get() != NULL));
+  CHECK_EQUAL(policy->delay(host), 10);
+  return true;
+}
+
+cql::Message*
+test_idempotent_query() {
+  cql::Message*   message = new cql::Message(CQL_OPCODE_QUERY);
+  cql::BodyQuery* query   = static_cast<cql::BodyQuery*>(message->body.get());
+  query->query_string("SELECT");
+  query->idempotent(true);
+  return message;
+}
+
+bool
+test_speculative_execution() {
+  uv_loop_t*       loop = uv_loop_new();
+  cql::TimingWheel wheel(loop);
+  cql::PoolOptions options;
+  options.core_connections_per_host = 0;
+
+  std::shared_ptr<cql::Pool> pools[2];
+  cql::ClientConnection*     connections[2];
+  for (int i = 0; i < 2; ++i) {
+    pools[i].reset(
+        new cql::Pool(
+            loop,
+            NULL,
+            NULL,
+            NULL,
+            NULL,
+            cql::Host(i ? "127.0.0.2" : "127.0.0.1"),
+            cql::LOCAL,
+            options));
+    connections[i] = new cql::ClientConnection(loop, NULL, NULL, NULL);
+    test_open_connection(*connections[i], loop);
+    cql::PoolTest::add(*pools[i], connections[i]);
+  }
+
+  cql::SpeculativeExecution::Collection       executions;
+  cql::SpeculativeExecution::TargetCollection targets(2);
+  targets[0].pool  = pools[0];
+  targets[0].delay = 10;
+  targets[1].pool  = pools[1];
+  targets[1].delay = 0;
+
+  // the copy sent after the delay answers first and wins
+  cql::Message*       message = test_idempotent_query();
+  cql::CallerRequest* request = new cql::CallerRequest();
+  cql::QueuedRequest  queued  = { message, request, false };
+  (new cql::SpeculativeExecution(
+      loop, &wheel, NULL, queued, targets, &executions))->start();
+  int16_t first = message->stream;
+  CHECK_EQUAL(connections[0]->in_flight(), 1);
+  for (int i = 0; i < 1000 && !connections[1]->in_flight(); ++i) {
+    uv_run(loop, UV_RUN_ONCE);
+  }
+  CHECK_EQUAL(connections[1]->in_flight(), 1);
+  int16_t second = message->stream;
+
+  std::unique_ptr<char> frame(test_result_void(second));
+  connections[1]->consume(frame.get(), CQL_HEADER_SIZE_V3 + 4);
+  CHECK(request->ready());
+  CHECK(!request->error);
+  CHECK(request->result);
+
+  // the loser's answer is dropped, and only then is the execution gone
+  CHECK_EQUAL(executions.size(), 1);
+  frame.reset(test_result_void(first));
+  connections[0]->consume(frame.get(), CQL_HEADER_SIZE_V3 + 4);
+  CHECK_EQUAL(executions.size(), 0);
+  CHECK_EQUAL(connections[0]->in_flight(), 0);
+  delete request->result;
+  delete request;
+
+  // an error with no other copy out moves on to the next pool
+  targets[0].delay = 0;
+  message = test_idempotent_query();
+  request = new cql::CallerRequest();
+  queued.message = message;
+  queued.request = request;
+  (new cql::SpeculativeExecution(
+      loop, &wheel, NULL, queued, targets, &executions))->start();
+  first = message->stream;
+  frame.reset(test_error_overloaded(first));
+  connections[0]->consume(frame.get(), CQL_HEADER_SIZE_V3 + 12);
+  CHECK(!request->ready());
+  CHECK_EQUAL(connections[1]->in_flight(), 1);
+  second = message->stream;
+  frame.reset(test_result_void(second));
+  connections[1]->consume(frame.get(), CQL_HEADER_SIZE_V3 + 4);
+  CHECK(request->ready());
+  CHECK(!request->error);
+  CHECK_EQUAL(executions.size(), 0);
+  delete request->result;
+  delete request;
+
+  // shutting down fails the caller's request right away, the copy still
+  // out fails with its connection
+  message = test_idempotent_query();
+  request = new cql::CallerRequest();
+  queued.message = message;
+  queued.request = request;
+  (new cql::SpeculativeExecution(
+      loop, &wheel, NULL, queued, targets, &executions))->start();
+  CHECK_EQUAL(connections[0]->in_flight(), 1);
+  executions.front()->shutdown();
+  CHECK(request->ready());
+  CHECK_EQUAL(request->error->code, CQL_ERROR_LIB_SESSION_STATE);
+  CHECK_EQUAL(executions.size(), 1);
+  pools[0]->close();
+  pools[1]->close();
+  for (int i = 0; i < 1000 && !executions.empty(); ++i) {
+    uv_run(loop, UV_RUN_NOWAIT);
+  }
+  CHECK_EQUAL(executions.size(), 0);
+  delete request->error;
+  delete request;
+
+  // a copy isn't left waiting for a connection to come up, the values
+  // bound to it may be gone by then
+  options.core_connections_per_host = 1;
+  options.port                      = "1999";
+  std::shared_ptr<cql::Pool> opening(
+      new cql::Pool(
+          loop,
+          NULL,
+          NULL,
+          NULL,
+          NULL,
+          cql::Host("127.0.0.1"),
+          cql::LOCAL,
+          options));
+  cql::Message       borrowed(CQL_OPCODE_QUERY);
+  cql::CallerRequest parked;
+  queued.message  = &borrowed;
+  queued.request  = &parked;
+  queued.borrowed = true;
+  opening->execute(queued);
+  CHECK(parked.ready());
+  CHECK_EQUAL(parked.error->code, CQL_ERROR_LIB_NO_HOSTS);
+  delete parked.error;
+  parked.error = NULL;
+
+  opening->close();
+  for (int i = 0;
+       i < 1000
+           && !(pools[0]->is_closed()
+                && pools[1]->is_closed()
+                && opening->is_closed());
+       ++i) {
+    uv_run(loop, UV_RUN_NOWAIT);
+    pools[0]->maintain(uv_now(loop));
+    pools[1]->maintain(uv_now(loop));
+    opening->maintain(uv_now(loop));
+  }
+  CHECK(pools[0]->is_closed());
+  CHECK(pools[1]->is_closed());
+  CHECK(opening->is_closed());
+  pools[0].reset();
+  pools[1].reset();
+  opening.reset();
+  targets.clear();
+  wheel.close();
+  uv_run(loop, UV_RUN_DEFAULT);
+  uv_loop_delete(loop);
+  return true;
+}
+
+void
+append_short(
+    std::string& output,
+    int16_t      value) {
+  char buffer[sizeof(int16_t)];
+  cql::encode_short(buffer, value);
+  output.append(buffer, sizeof(buffer));
+}
+
+void
+append_int(
+    std::string& output,
+    int32_t      value) {
+  char buffer[sizeof(int32_t)];
+  cql::encode_int(buffer, value);
+  output.append(buffer, sizeof(buffer));
+}
+
+void
+append_value(
+    std::string&       output,
+    const std::string& value) {
+  append_int(output, value.size());
+  output.append(value);
+}
+
+std::string
+test_token_set(
+    bool                            v3,
+    const std::vector<std::string>& tokens) {
+  std::string output;
+  v3 ? append_int(output, tokens.size()) : append_short(output, tokens.size());
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    v3 ? append_int(output, tokens[i].size())
+       : append_short(output, tokens[i].size());
+    output.append(tokens[i]);
+  }
+  return output;
+}
+
+/**
+ * a RESULT frame holding two rows of system.peers
+ *
+ * @param v3
+ * @param truncated the first token set claims one more token than it has
+ */
+std::string
+test_peers_frame(
+    bool v3,
+    bool truncated = false) {
+  std::string body;
+  append_int(body, CQL_RESULT_KIND_ROWS);
+  append_int(body, CQL_RESULT_FLAG_GLOBAL_TABLESPEC);
+  append_int(body, 5);
+  append_short(body, 6);
+  body.append("system");
+  append_short(body, 5);
+  body.append("peers");
+
+  const char* names[] = { "peer", "data_center", "rack", "tokens",
+                          "rpc_address" };
+  int16_t     types[] = { CQL_COLUMN_TYPE_INET, CQL_COLUMN_TYPE_VARCHAR,
+                          CQL_COLUMN_TYPE_VARCHAR, CQL_COLUMN_TYPE_SET,
+                          CQL_COLUMN_TYPE_INET };
+  for (int i = 0; i < 5; ++i) {
+    append_short(body, strlen(names[i]));
+    body.append(names[i]);
+    append_short(body, types[i]);
+    if (types[i] == CQL_COLUMN_TYPE_SET) {
+      append_short(body, CQL_COLUMN_TYPE_VARCHAR);
+    }
+  }
+  append_int(body, 2);
+
+  std::vector<std::string> tokens;
+  tokens.push_back("-100");
+  tokens.push_back("200");
+  append_value(body, std::string("\x0a\x00\x00\x02", 4));
+  append_value(body, "dc1");
+  append_value(body, "r1");
+  std::string token_set = test_token_set(v3, tokens);
+  if (truncated) {
+    ++token_set[v3 ? 3 : 1];
+  }
+  append_value(body, token_set);
+  append_value(body, std::string("\x0a\x00\x01\x02", 4));
+
+  // no rack, and an rpc_address which isn't one
+  tokens.clear();
+  tokens.push_back("0");
+  append_value(body, std::string("\x0a\x00\x00\x03", 4));
+  append_value(body, "dc2");
+  append_int(body, -1);
+  append_value(body, test_token_set(v3, tokens));
+  append_value(body, std::string(4, '\0'));
+
+  std::string frame;
+  frame.push_back(v3 ? 0x83 : 0x82);
+  frame.push_back(0);
+  v3 ? append_short(frame, 1) : frame.push_back(1);
+  frame.push_back(CQL_OPCODE_RESULT);
+  append_int(frame, body.size());
+  return frame + body;
+}
+
+bool
+test_control_connection_hosts() {
+  for (int v3 = 0; v3 < 2; ++v3) {
+    std::string  frame = test_peers_frame(v3);
+    cql::Message response;
+    CHECK_EQUAL(
+        response.consume(const_cast<char*>(frame.c_str()), frame.size()),
+        static_cast<int>(frame.size()));
+    CHECK(response.body_ready);
+
+    std::vector<cql::Host> hosts;
+    CHECK(cql::ControlConnection::parse_hosts(&response, "", hosts));
+    CHECK_EQUAL(hosts.size(), 2);
+
+    CHECK_EQUAL(hosts[0].address, "10.0.1.2");
+    CHECK_EQUAL(hosts[0].datacenter, "dc1");
+    CHECK_EQUAL(hosts[0].rack, "r1");
+    CHECK_EQUAL(hosts[0].tokens.size(), 2);
+    CHECK_EQUAL(hosts[0].tokens[0], -100);
+    CHECK_EQUAL(hosts[0].tokens[1], 200);
+
+    CHECK_EQUAL(hosts[1].address, "10.0.0.3");
+    CHECK_EQUAL(hosts[1].datacenter, "dc2");
+    CHECK(hosts[1].rack.empty());
+    CHECK_EQUAL(hosts[1].tokens.size(), 1);
+    CHECK_EQUAL(hosts[1].tokens[0], 0);
+  }
+
+  // element lengths are checked against the value
+  std::vector<std::string> values;
+  CHECK(cql::decode_string_collection(
+      "\x00\x01\x00\x02" "ab", 6, false, values));
+  CHECK_EQUAL(values.size(), 1);
+  CHECK_EQUAL(values[0], "ab");
+  CHECK(!cql::decode_string_collection(
+      "\x00\x01\x00\x03" "ab", 6, false, values));
+
+  // and a host whose tokens don't add up fails the whole read
+  std::string  frame = test_peers_frame(true, true);
+  cql::Message response;
+  response.consume(const_cast<char*>(frame.c_str()), frame.size());
+  std::vector<cql::Host> hosts;
+  CHECK(!cql::ControlConnection::parse_hosts(&response, "", hosts));
+  return true;
+}
+
+namespace cql {
+
+struct ControlConnectionTest {
+  /**
+   * replace the current connection with one which finished its handshake
+   */
+  static void
+  established(
+      ControlConnection& control,
+      ClientConnection*  connection) {
+    control.retire();
+    control.adopt(connection);
+    control.connected_ = true;
+  }
+
+  static void
+  refresh(
+      ControlConnection& control) {
+    control.refresh();
+  }
+
+  static ClientConnection*
+  connection(
+      ControlConnection& control) {
+    return control.connection_;
+  }
+};
+
+}
+
+bool
+test_control_connection_rotation() {
+  uv_loop_t*       loop = uv_loop_new();
+  cql::TimingWheel wheel(loop);
+  cql::PoolOptions options;
+  // nothing listens there
+  options.port = "1999";
+  size_t topology_updates = 0;
+  cql::ControlConnection control(
+      loop,
+      NULL,
+      &wheel,
+      options,
+      0,
+      [&topology_updates](const std::vector<cql::Host>&) {
+        ++topology_updates;
+      });
+
+  std::list<std::string> contact_points;
+  contact_points.push_back("127.0.0.1");
+  contact_points.push_back("127.0.0.2");
+  control.connect(contact_points);
+
+  cql::ClientConnection* first
+      = new cql::ClientConnection(loop, NULL, NULL, &wheel);
+  first->hostname_ = "127.0.0.3";
+  test_open_connection(*first, loop);
+  cql::ControlConnectionTest::established(control, first);
+  cql::ControlConnectionTest::refresh(control);
+  CHECK_EQUAL(first->waiting_requests(), 1);
+
+  // the query fails once the first is replaced, which mustn't take the
+  // connection which replaced it down with it
+  cql::ClientConnection* second
+      = new cql::ClientConnection(loop, NULL, NULL, &wheel);
+  second->hostname_ = "127.0.0.4";
+  test_open_connection(*second, loop);
+  cql::ControlConnectionTest::established(control, second);
+  uv_run(loop, UV_RUN_NOWAIT);
+  CHECK(first->is_closed());
+  CHECK((cql::ControlConnectionTest::connection(control) == second));
+
+  // the server hangs up with a query on its way, which fails first.
+  // either way the contact points are tried again, from the first one
+  cql::ControlConnectionTest::refresh(control);
+  second->close();
+  uv_run(loop, UV_RUN_NOWAIT);
+  cql::ClientConnection* next = cql::ControlConnectionTest::connection(control);
+  CHECK(next);
+  CHECK_EQUAL(next->hostname_, "127.0.0.1");
+
+  // which can't be reached, nor can the one after it
+  for (int i = 0;
+       i < 1000 && cql::ControlConnectionTest::connection(control) == next;
+       ++i) {
+    uv_run(loop, UV_RUN_ONCE);
+  }
+  next = cql::ControlConnectionTest::connection(control);
+  CHECK(next);
+  CHECK_EQUAL(next->hostname_, "127.0.0.2");
+  for (int i = 0;
+       i < 1000 && cql::ControlConnectionTest::connection(control);
+       ++i) {
+    uv_run(loop, UV_RUN_ONCE);
+  }
+  CHECK(!cql::ControlConnectionTest::connection(control));
+  CHECK_EQUAL(topology_updates, 0);
+
+  control.close();
+  for (int i = 0; i < 1000 && !control.is_closed(); ++i) {
+    uv_run(loop, UV_RUN_NOWAIT);
+  }
+  CHECK(control.is_closed());
+  wheel.close();
+  uv_run(loop, UV_RUN_DEFAULT);
+  uv_loop_delete(loop);
+  return true;
+}
+
 int
 main() {
   TEST(test_error_consume());
+  TEST(test_error_consume_in_place());
+  TEST(test_error_consume_split());
+  TEST(test_receive_buffer());
+  TEST(test_object_pool());
   TEST(test_error_prepare());
   TEST(test_options_prepare());
   TEST(test_startup_prepare());
   TEST(test_query_query());
   TEST(test_query_query_paging());
+  TEST(test_options_encode());
+  TEST(test_query_encode_values());
+  TEST(test_compression());
+  TEST(test_error_v3());
+  TEST(test_stream_storage_limit());
+  TEST(test_stream_storage_bitmap());
+  TEST(test_timing_wheel());
+  TEST(test_request_timeout());
+  TEST(test_write_batch_delay());
+  TEST(test_session_shutdown());
+  TEST(test_session_steal());
+  TEST(test_mpmc_queue_size());
+  TEST(test_mpmc_queue_bulk());
+  TEST(test_mpmc_queue_bulk_threads());
+  TEST(test_wait_strategies());
+  TEST(test_segmented_queue());
+  TEST(test_segmented_queue_threads());
+  TEST(test_completion());
+  TEST(test_callback_executor());
+  TEST(test_callback_executor_overflow());
+  TEST(test_batched_completion());
+  TEST(test_connection_load());
+  TEST(test_pool_least_busy());
+  TEST(test_pool_reap());
+  TEST(test_pool_sizer());
+  TEST(test_murmur3());
+  TEST(test_token_map());
+  TEST(test_token_aware_policy());
+  TEST(test_control_connection_hosts());
+  TEST(test_control_connection_rotation());
+  TEST(test_dc_aware_policy());
+  TEST(test_latency_aware_policy());
+  TEST(test_speculative_execution_policy());
+  TEST(test_speculative_execution());
   TEST(test_ssl());
   TEST(test_stream_storage());
   TEST(test_query_query_value());